@@ -81,6 +81,8 @@ module red_pitaya_ps (
   input   [ 32-1: 0] sys_rdata_i        ,  // system read data
   input              sys_err_i          ,  // system error indicator
   input              sys_ack_i          ,  // system acknowledge signal
+  // interrupts
+  input              irq_agc_i          ,  // counter, to IRQ_F2P[1]
   // AXI masters
   input              axi1_clk_i   , axi0_clk_i   ,  // global clock
   input              axi1_rstn_i  , axi0_rstn_i  ,  // global reset
@@ -389,6 +391,8 @@ system_wrapper system_i (
   .Vaux8_v_n (vinn_i[0]),  .Vaux8_v_p (vinp_i[0]),
   .Vaux9_v_n (vinn_i[3]),  .Vaux9_v_p (vinp_i[3]),
   .Vp_Vn_v_n (vinn_i[4]),  .Vp_Vn_v_p (vinp_i[4]),
+  // interrupts
+  .IRQ_AGC           (irq_agc_i        ),
   // GP0
   .M_AXI_GP0_ACLK    (axi0_clk_i),
   .M_AXI_GP0_arvalid (gp0_maxi_arvalid),  // out
@@ -148,6 +148,8 @@ wire             axi1_wfixed , axi0_wfixed ;
 wire             axi1_werr   , axi0_werr   ;
 wire             axi1_wrdy   , axi0_wrdy   ;
 
+wire             irq_agc            ;  // counter interrupt
+
 red_pitaya_ps i_ps (
   .FIXED_IO_mio       (  FIXED_IO_mio                ),
   .FIXED_IO_ps_clk    (  FIXED_IO_ps_clk             ),
@@ -188,6 +190,8 @@ red_pitaya_ps i_ps (
   .sys_rdata_i   (ps_sys_rdata),  // system read data
   .sys_err_i     (ps_sys_err  ),  // system error indicator
   .sys_ack_i     (ps_sys_ack  ),  // system acknowledge signal
+  // interrupts
+  .irq_agc_i     (irq_agc     ),  // counter, level sensitive
   // AXI masters
   .axi1_clk_i    (axi1_clk    ),  .axi0_clk_i    (axi0_clk    ),  // global clock
   .axi1_rstn_i   (axi1_rstn   ),  .axi0_rstn_i   (axi0_rstn   ),  // global reset
@@ -577,6 +581,18 @@ lfs i_lfs
   .exp_n_dat_o     (  exp_n_out                  ),
   .exp_n_dir_o     (  exp_n_dir                  ),
 
+   // AXI0 master, event records to the DDR ring
+  .axi0_waddr_o    (  axi0_waddr                 ),
+  .axi0_wdata_o    (  axi0_wdata                 ),
+  .axi0_wsel_o     (  axi0_wsel                  ),
+  .axi0_wvalid_o   (  axi0_wvalid                ),
+  .axi0_wlen_o     (  axi0_wlen                  ),
+  .axi0_wfixed_o   (  axi0_wfixed                ),
+  .axi0_werr_i     (  axi0_werr                  ),
+  .axi0_wrdy_i     (  axi0_wrdy                  ),
+
+  .irq_o           (  irq_agc                    ),  // interrupt
+
    // System bus
   .sys_addr      (  sys_addr                   ),  // address
   .sys_wdata     (  sys_wdata                  ),  // write data
@@ -34,6 +34,18 @@ module lfs
 	output reg [  8-1: 0] exp_n_dat_o     ,  //!<
 	output reg [  8-1: 0] exp_n_dir_o     ,  //!<
    
+	// AXI0 master, event records to the DDR ring
+	output     [ 32-1: 0] axi0_waddr_o  ,  //!< write address
+	output     [ 64-1: 0] axi0_wdata_o  ,  //!< write data
+	output     [  8-1: 0] axi0_wsel_o   ,  //!< write byte select
+	output                axi0_wvalid_o ,  //!< write data valid
+	output     [  4-1: 0] axi0_wlen_o   ,  //!< write burst length
+	output                axi0_wfixed_o ,  //!< write burst type (fixed / incremental)
+	input                 axi0_werr_i   ,  //!< write error
+	input                 axi0_wrdy_i   ,  //!< write ready
+   
+	output reg            irq_o         ,  //!< interrupt, high while at least irq_level peaks wait
+   
 	//System bus	
 	input      [ 32-1: 0] sys_addr      ,  //!< bus address
 	input      [ 32-1: 0] sys_wdata     ,  //!< bus write data
@@ -60,7 +72,12 @@ assign in_b = dat_b_i;
 
 ////-------------------------------------- Main ---------------------------------------////
 
-`define FIFO_size 300
+`define FIFO_AW 11							//FIFO in block RAM, 2^FIFO_AW elements
+`define FIFO_size (1<<`FIFO_AW)
+`define AGC_ID 32'h41474315	//"AGC" and the version (1.5), lets the program skip reloading a bitstream that is already loaded
+`define AGC_CAPS {caps_fifo_size,13'd0,1'b1,1'b0,1'b1}	//b31-16 : FIFO size, b2 : interrupt available, b1 : spectrum mode available (not in this design), b0 : DDR ring available
+
+wire [ 15: 0] caps_fifo_size = `FIFO_size;		//a sized literal cannot take the macro expression
 
 reg signed [ 13: 0] cntr_thresh_alpha;
 reg                 cntr_sign_alpha;
@@ -69,12 +86,20 @@ reg                 cntr_sign_gamma;
 reg  [ 31: 0] cntr_mintime_alpha;
 reg  [ 31: 0] cntr_mintime_gamma;
 
-reg [ 63: 0] cntr_timestamp_buf [0:`FIFO_size-1];
-reg signed [ 13: 0] cntr_amp_buf [0:`FIFO_size-1];
-reg          cntr_type_buf [0:`FIFO_size-1];		//0 means alpha, 1 means gamma
-reg 	     cntr_isd_buf [0:`FIFO_size-1];		//indicates if this element (of all four arrays) contains any data
-integer i;
+reg  [ 78: 0] fifo_mem [0:`FIFO_size-1];		//{type (0 means alpha, 1 means gamma), amplitude, timestamp}
+reg  [ 78: 0] fifo_wdata;
+reg  [ 78: 0] fifo_rdata;
+reg           fifo_we;
+reg           fifo_re;
+reg  [`FIFO_AW-1: 0] fifo_wp;
+reg  [`FIFO_AW-1: 0] fifo_rp;
+reg  [`FIFO_AW  : 0] fifo_cnt;			//elements in fifo_mem
+reg           fifo_rd_pending;				//fifo_rdata becomes valid in the next cycle
 
+reg  [ 63: 0] head_timestamp;				//oldest element, this is what the registers h20-h28 show
+reg signed [ 13: 0] head_amp;
+reg           head_type;
+reg           head_isd;					//indicates if head contains any data
 
 reg          reset_fifo;
 reg          reset_fifo_loc;
@@ -92,11 +117,49 @@ reg signed [ 13: 0] cntr_max_gamma;
 reg [ 63: 0] cntr_timestamp_gamma;
 reg cntr_gamma_ongoing;
 reg cntr_gamma_saveflag;
-reg tmpreg;
 
-reg          mes_received;				//this gets flipped if the last element in the FIFO has been read
+reg          mes_received;				//this gets flipped if the head element has been read
 reg          mes_received_loc;				//a local copy of mes_received which we check to see if flipped
 
+//DDR ring: in DDR mode the head element is written to the ring as a 16 byte record instead of being read over
+//the bus: a 64 bit timestamp, then {32 bit sequence number (1 after reset), 32 bits as in register h20}.
+//The CPU finds new records by their sequence number and reports how far it has read in dma_tail.
+reg           dma_en;					//set in register h2C
+reg  [ 31: 0] dma_start;				//ring physical address, 16 byte aligned
+reg  [ 31: 0] dma_size;					//ring size in bytes, multiple of 16
+reg  [ 31: 0] dma_tail;					//byte offset of the first record not yet consumed by the CPU
+reg  [ 31: 0] dma_head;					//byte offset of the next record
+reg  [ 31: 0] dma_seq;
+reg  [ 63: 0] dma_dat;
+reg  [ 63: 0] dma_head_rec;				//second word of the record being written
+reg           dma_dv;
+reg           dma_second;				//second word of a record is due
+reg           dma_clr;
+wire [ 31: 0] dma_used = (dma_head>=dma_tail) ? dma_head-dma_tail : dma_head+dma_size-dma_tail;
+wire          dma_overflow;
+wire [ 31: 0] dma_cur_addr;				//address axi_wr_fifo has issued up to
+wire [ 31: 0] dma_cur = dma_cur_addr-dma_start;
+wire [ 31: 0] dma_issued = (dma_cur >= dma_size) ? 32'd0 : dma_cur;
+wire [ 31: 0] dma_inflight = (dma_head >= dma_issued) ? dma_head-dma_issued : dma_head+dma_size-dma_issued;	//bytes in the axi_wr_fifo buffer (2 kB)
+wire          dma_go = dma_en && head_isd && !dma_second && (dma_used < dma_size-32'd16) && (dma_inflight < 32'd1024);
+
+//Interrupt: irq_o is high while at least irq_level peaks wait to be read, in the FIFO and in DDR mode also in the ring,
+//so the CPU can sleep until there is a batch worth reading. It is a level, the CPU masks it in the interrupt controller
+//and unmasks it after reading. irq_level 0 turns it off.
+reg  [ 15: 0] irq_level;				//set in register h5C
+wire [ 31: 0] irq_pending = mes_in_FIFO + (dma_en ? dma_used[31:4] : 32'd0);
+
+wire head_pop = (mes_received_loc != mes_received) || dma_go;
+wire save_alpha = cntr_alpha_saveflag;
+wire save_gamma = cntr_gamma_saveflag && !cntr_alpha_saveflag;
+wire fifo_full = (fifo_cnt + (fifo_we ? 1 : 0) >= `FIFO_size);
+wire lost_save = (save_alpha || save_gamma) && fifo_full;	//FIFO full, peak is lost
+
+always @(posedge clk_i) begin					//block RAM, no reset
+	if (fifo_we) fifo_mem[fifo_wp] <= fifo_wdata;
+	if (fifo_re) fifo_rdata <= fifo_mem[fifo_rp];
+end
+
 always @(posedge clk_i) begin	
 	if ((rstn_i == 1'b0) || (reset_fifo != reset_fifo_loc)) begin
 		if(reset_fifo != reset_fifo_loc) begin
@@ -107,13 +170,24 @@ always @(posedge clk_i) begin
 			mes_received_loc <= 1'd0;
 		end
 	
-		for (i=0; i<=`FIFO_size-1; i=i+1)	//FIFO
-			cntr_isd_buf[i] <= 1'd0;	//none of the elements contain any data	
-			
+		fifo_wp <= {`FIFO_AW{1'b0}};
+		fifo_rp <= {`FIFO_AW{1'b0}};
+		fifo_cnt <= {`FIFO_AW+1{1'b0}};
+		fifo_we <= 1'd0;
+		fifo_re <= 1'd0;
+		fifo_rd_pending <= 1'd0;
+		head_isd <= 1'd0;			//none of the elements contain any data
+		
+		dma_head <= 32'd0;
+		dma_seq <= 32'd1;
+		dma_dv <= 1'd0;
+		dma_second <= 1'd0;
+		dma_clr <= 1'd1;
 		
 		mes_in_FIFO <= 16'd0;
 		max_mes_in_FIFO <= 16'd0;
 		mes_lost <= 32'd0;
+		irq_o <= 1'd0;
 		
 		out_a <= 14'sd0;
 		out_b <= 14'sd0;
@@ -127,51 +201,61 @@ always @(posedge clk_i) begin
 		cntr_gamma_ongoing <= 1'd0;
 		cntr_gamma_saveflag <= 1'd0;
 		
-		tmpreg <= 1'd0;
-		
 		timestamp_cntr  <= 64'd0;
 	end
 	else begin
 		timestamp_cntr  <= timestamp_cntr + 64'd1;
-				
-		if ((cntr_alpha_saveflag == 1'b0) && (cntr_gamma_saveflag == 1'b0)) begin
-			if (mes_received_loc != mes_received) begin	//last element has been read
-				mes_received_loc <= mes_received;
-				cntr_isd_buf[`FIFO_size-1] <= 1'd0;
-				mes_in_FIFO <= mes_in_FIFO-16'd1;
+		dma_clr <= 1'd0;
+		
+		//saving, one peak per cycle, alphas first (the other one waits in its saveflag)
+		fifo_we <= 1'd0;
+		if (save_alpha || save_gamma) begin
+			if (!fifo_full) begin
+				fifo_wdata <= save_alpha ? {1'b0, cntr_max_alpha, cntr_timestamp_alpha} : {1'b1, cntr_max_gamma, cntr_timestamp_gamma};
+				fifo_we <= 1'd1;
 			end
+			if (save_alpha) cntr_alpha_saveflag <= 1'b0;
+			else cntr_gamma_saveflag <= 1'b0;
 		end
-		else if ((cntr_isd_buf[0]==1'd0) && (cntr_alpha_saveflag == 1'b1)) begin
-			cntr_timestamp_buf[0] <= cntr_timestamp_alpha;
-			cntr_amp_buf[0] <= cntr_max_alpha;
-			cntr_isd_buf[0] <= 1'd1;
-			cntr_type_buf[0] <= 1'd0;			//alpha
-
-			cntr_alpha_saveflag <= 1'b0;
-			mes_in_FIFO <= mes_in_FIFO+16'd1;
-			tmpreg <= 1'd0;
+		if (fifo_we) fifo_wp <= fifo_wp + 1'd1;
+		
+		//reading: fifo_mem -> head (one cycle read latency) -> bus registers or DDR ring
+		fifo_re <= 1'd0;
+		fifo_rd_pending <= fifo_re;
+		if (head_pop) begin
+			head_isd <= 1'd0;
+			if (mes_received_loc != mes_received) mes_received_loc <= mes_received;
 		end
-		else if (cntr_isd_buf[0]==1'd0) begin
-			cntr_timestamp_buf[0] <= cntr_timestamp_gamma;
-			cntr_amp_buf[0] <= cntr_max_gamma;
-			cntr_isd_buf[0] <= 1'd1;
-			cntr_type_buf[0] <= 1'd1;			//gamma
-
-			cntr_gamma_saveflag <= 1'b0;
-			mes_in_FIFO <= mes_in_FIFO+16'd1;
-			tmpreg <= 1'd0;
+		if (fifo_rd_pending) begin
+			{head_type, head_amp, head_timestamp} <= fifo_rdata;
+			head_isd <= 1'd1;
 		end
-		else begin
-			if (tmpreg) begin
-				mes_lost <= mes_lost + 32'd1;
-				cntr_alpha_saveflag <= 1'b0;
-				cntr_gamma_saveflag <= 1'b0;
-				tmpreg <= 1'd0;
-			end
-			else begin	//we give it one extra cycle so that the FIFO may move
-				tmpreg <= 1'd1;
-			end
+		else if ((!head_isd || head_pop) && !fifo_re && (fifo_cnt != 0)) begin
+			fifo_re <= 1'd1;
 		end
+		if (fifo_re) fifo_rp <= fifo_rp + 1'd1;
+		fifo_cnt <= fifo_cnt + (fifo_we ? 1 : 0) - ((!fifo_rd_pending && (!head_isd || head_pop) && !fifo_re && (fifo_cnt != 0)) ? 1 : 0);
+		
+		//DDR ring: two 64 bit words per record
+		dma_dv <= 1'd0;
+		if (dma_go) begin
+			dma_dat <= head_timestamp;
+			dma_dv <= 1'd1;
+			dma_second <= 1'd1;
+			dma_head_rec <= {dma_seq, 1'b1, head_type, head_amp, 16'h0};
+		end
+		else if (dma_second) begin
+			dma_dat <= dma_head_rec;
+			dma_dv <= 1'd1;
+			dma_second <= 1'd0;
+			dma_seq <= dma_seq + 32'd1;
+			dma_head <= (dma_head+32'd16 >= dma_size) ? 32'd0 : dma_head+32'd16;
+		end
+		mes_lost <= mes_lost + lost_save + dma_overflow;	//dma_overflow: AXI did not keep up (prevented by dma_inflight)
+		
+		mes_in_FIFO <= fifo_cnt + (fifo_re ? 1 : 0) + (fifo_rd_pending ? 1 : 0) + (head_isd ? 1 : 0);
+		if (max_mes_in_FIFO<mes_in_FIFO) max_mes_in_FIFO <= mes_in_FIFO;	//just to log the largest number of elements in FIFO at any point after reset
+		irq_o <= (irq_level != 16'd0) && (irq_pending >= irq_level);
 		
 		if ( (cntr_alpha_saveflag == 1'd0) && (((!cntr_sign_alpha) && (in_a >= cntr_thresh_alpha)) || ((cntr_sign_alpha) && (in_a <= cntr_thresh_alpha))) ) begin		//alpha adc over threshold
 			if (cntr_alpha_ongoing == 1'd1) begin															
@@ -204,25 +288,41 @@ always @(posedge clk_i) begin
 			cntr_gamma_ongoing <= 1'd0;
 			if ((timestamp_cntr-cntr_timestamp_gamma)>=cntr_mintime_gamma) cntr_gamma_saveflag <= 1'b1;
 		end
-		
-		if (max_mes_in_FIFO<mes_in_FIFO) max_mes_in_FIFO <= mes_in_FIFO;	//just to log the largest number of elements in FIFO at any point after reset
-		
-		for (i=0; i<`FIFO_size-1; i=i+1)					//here we shift the FIFO
-			if ((cntr_isd_buf[i+1]==1'd0)&&(cntr_isd_buf[i]==1'd1))  begin
-				cntr_timestamp_buf[i+1] <= cntr_timestamp_buf[i];
-				cntr_amp_buf[i+1] <= cntr_amp_buf[i];
-				cntr_type_buf[i+1] <= cntr_type_buf[i];
-				cntr_isd_buf[i+1] <= cntr_isd_buf[i];
-				cntr_timestamp_buf[i] <= 64'd0;
-				cntr_amp_buf[i] <= 14'sd0;
-				cntr_type_buf[i] <= 1'd0;
-				cntr_isd_buf[i] <= 1'd0;
-			end
-			
-				
 	end
 end
 
+axi_wr_fifo #(
+  .DW  (  64    ), // data width (8,16,...,1024)
+  .AW  (  32    ), // address width
+  .FW  (   8    )  // address width of FIFO pointers
+) i_wr0 (
+   // global signals
+  .axi_clk_i          (  clk_i             ), // global clock
+  .axi_rstn_i         (  rstn_i            ), // global reset
+
+   // Connection to AXI master
+  .axi_waddr_o        (  axi0_waddr_o      ), // write address
+  .axi_wdata_o        (  axi0_wdata_o      ), // write data
+  .axi_wsel_o         (  axi0_wsel_o       ), // write byte select
+  .axi_wvalid_o       (  axi0_wvalid_o     ), // write data valid
+  .axi_wlen_o         (  axi0_wlen_o       ), // write burst length
+  .axi_wfixed_o       (  axi0_wfixed_o     ), // write burst type (fixed / incremental)
+  .axi_werr_i         (  axi0_werr_i       ), // write error
+  .axi_wrdy_i         (  axi0_wrdy_i       ), // write ready
+
+   // data and configuration
+  .wr_data_i          (  dma_dat           ), // write data
+  .wr_val_i           (  dma_dv            ), // write data valid
+  .ctrl_start_addr_i  (  dma_start         ), // range start address
+  .ctrl_stop_addr_i   (  dma_start+dma_size-32'd8 ), // range stop address
+  .ctrl_trig_size_i   (  4'hF              ), // trigger level
+  .ctrl_wrap_i        (  1'b1              ), // start from begining when reached stop
+  .ctrl_clr_i         (  dma_clr           ), // clear / flush
+  .stat_overflow_o    (  dma_overflow      ), // overflow indicator
+  .stat_cur_addr_o    (  dma_cur_addr      ), // current write address
+  .stat_write_data_o  (                    )  // write data indicator
+);
+
 ////------------------------------- System bus connection -----------------------------////
 
 
@@ -235,7 +335,11 @@ always @(posedge clk_i) begin
 		cntr_mintime_alpha <= 32'd4294967295;
 		cntr_mintime_gamma <= 32'd4294967295;
 		reset_fifo <= 1'd0;
-		
+		dma_en <= 1'd0;
+		dma_start <= 32'd0;
+		dma_size <= 32'd16;
+		dma_tail <= 32'd0;
+		irq_level <= 16'd0;
 	end
 	else begin
 		if (sys_wen) begin
@@ -254,10 +358,17 @@ always @(posedge clk_i) begin
 				20'h0010	: 	reset_fifo <= ~reset_fifo;
 				//20'h0014	used
 				//20'h0018	used
-				//20'h001C	unused
+				//20'h001C	used
 				//20'h0020	used
 				//20'h0024	used	
 				//20'h0028	used  	
+				20'h002C	: 	dma_en <= sys_wdata[0];
+				20'h0030	: 	dma_start <= {sys_wdata[31:4],4'h0};
+				20'h0034	: 	dma_size <= {sys_wdata[31:4],4'h0};
+				//20'h0038	used
+				20'h003C	: 	dma_tail <= sys_wdata[31:0];
+				//20'h0040	used
+				20'h005C	: 	irq_level <= sys_wdata[15:0];
 			endcase
 
 		end
@@ -284,23 +395,30 @@ end else begin
 		//20'h0010	used
 		20'h0014		: begin sys_ack <= sys_en;	sys_rdata <= mes_lost; end
 		20'h0018		: begin sys_ack <= sys_en;	sys_rdata <= {max_mes_in_FIFO,mes_in_FIFO}; end
-		//20'h001C	unused
+		20'h001C		: begin sys_ack <= sys_en;	sys_rdata <= `AGC_ID; end
 		
 		20'h0020		: begin 
 						sys_ack <= sys_en;	
-						sys_rdata <= {cntr_isd_buf[`FIFO_size-1],cntr_type_buf[`FIFO_size-1],cntr_amp_buf[`FIFO_size-1],{32-16{1'b0}}}; 
+						sys_rdata <= {head_isd,head_type,head_amp,{32-16{1'b0}}}; 
 					  end
 		20'h0024		: begin 
 						sys_ack <= sys_en;	
-						sys_rdata <= cntr_timestamp_buf[`FIFO_size-1][31:0]; 
+						sys_rdata <= head_timestamp[31:0]; 
 					  end
 		20'h0028		: begin 
 						sys_ack <= sys_en;	
-						sys_rdata <= cntr_timestamp_buf[`FIFO_size-1][63:32]; 	//ALWAYS read this buffer last as it will delete the FIFO element
-						if (sys_ren && (cntr_isd_buf[`FIFO_size-1]==1'd1)) mes_received <= ~mes_received; 	//last element has been read
+						sys_rdata <= head_timestamp[63:32]; 	//ALWAYS read this buffer last as it will delete the FIFO element
+						if (sys_ren && head_isd && !dma_en) mes_received <= ~mes_received; 	//head element has been read
 					  end
+		20'h002C		: begin sys_ack <= sys_en;	sys_rdata <= {{32-1{1'b0}}, dma_en}; end
+		20'h0030		: begin sys_ack <= sys_en;	sys_rdata <= dma_start; end
+		20'h0034		: begin sys_ack <= sys_en;	sys_rdata <= dma_size; end
+		20'h0038		: begin sys_ack <= sys_en;	sys_rdata <= dma_head; end
+		20'h003C		: begin sys_ack <= sys_en;	sys_rdata <= dma_tail; end
+		20'h0040		: begin sys_ack <= sys_en;	sys_rdata <= `AGC_CAPS; end
+		//20'h0044-20'h0058	reserved for spectrum mode
+		20'h005C		: begin sys_ack <= sys_en;	sys_rdata <= {{32-16{1'b0}}, irq_level}; end
 		
-
 		default	:	begin sys_ack <= sys_en;	sys_rdata <=  32'h0;	end
 	endcase
 end
@@ -0,0 +1,396 @@
+/*
+    Alpha Gamma Counter
+    Copyright (C) 2017  Mario Vretenar
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+ * GENERAL DESCRIPTION:
+ *
+ * Testbench for the alpha gamma counter (ssla.v).
+ *
+ * Pulses are generated on both ADC channels. The peaks are first read through
+ * the registers (h20-h28), then in DDR mode they are written by axi_wr_fifo and
+ * axi_master into a memory model, and consumed from there like fpga.cpp does:
+ * by sequence number, reporting the consumed offset in dma_tail. The ring is
+ * smaller than the number of peaks, so the flow control is tested too.
+ * Last the interrupt must follow the number of waiting peaks around the
+ * watermark in irq_level.
+ * 
+ */
+
+`timescale 1ns / 1ps
+
+module ssla_tb #(
+  // time periods
+  realtime  TP = 8.0ns  // 125MHz
+);
+
+logic              clk ;
+logic              rstn;
+
+logic [14-1:0]     adc_a;
+logic [14-1:0]     adc_b;
+
+// ADC clock
+initial        clk = 1'b0;
+always #(TP/2) clk = ~clk;
+
+// ADC reset
+initial begin
+  rstn = 1'b0;
+  repeat(4) @(posedge clk);
+  rstn = 1'b1;
+end
+
+////////////////////////////////////////////////////////////////////////////////
+// pulse generation
+////////////////////////////////////////////////////////////////////////////////
+
+typedef struct {
+  bit          isgamma;
+  int          amp;
+} peak_t;
+
+peak_t expected [$];
+
+task pulse (
+  input bit isgamma,
+  input int amp,
+  input int width
+);
+  @(posedge clk);
+  if (isgamma) adc_b <= amp[13:0];
+  else         adc_a <= amp[13:0];
+  repeat(width) @(posedge clk);
+  adc_a <= 14'd0;
+  adc_b <= 14'd0;
+  expected.push_back('{isgamma, amp});
+  repeat(10) @(posedge clk);
+endtask: pulse
+
+task pulses (input int n);
+  for (int i=0; i<n; i++)
+    pulse (i%3==2, 1000+37*i, 4+i%5);
+endtask: pulses
+
+////////////////////////////////////////////////////////////////////////////////
+// test sequence
+////////////////////////////////////////////////////////////////////////////////
+
+logic [ 32-1: 0] sys_addr ;
+logic [ 32-1: 0] sys_wdata;
+logic [  4-1: 0] sys_sel  ;
+logic            sys_wen  ;
+logic            sys_ren  ;
+logic [ 32-1: 0] sys_rdata;
+logic            sys_err  ;
+logic            sys_ack  ;
+
+logic [ 32-1: 0] rdata, rtime_l, rtime_h;
+logic            irq;
+int              errors = 0;
+
+localparam int unsigned DMA_START = 32'h1000;
+localparam int unsigned DMA_SIZE  = 32'h100;   // 16 records
+
+task check (input logic [32-1:0] data, input int n);
+  peak_t e;
+  e = expected.pop_front();
+  if (!data[31] || (data[30] != e.isgamma) || ($signed(data[29:16]) != e.amp)) begin
+    $display ("FAILURE: peak %0d is %h, expected type %0d amplitude %0d", n, data, e.isgamma, e.amp);
+    errors++;
+  end
+endtask: check
+
+initial begin
+  adc_a = 14'd0;
+  adc_b = 14'd0;
+  wait (rstn)
+  repeat(10) @(posedge clk);
+
+  bus.read (32'h1C, rdata);
+  if (rdata != 32'h41474315) begin $display ("FAILURE: ID register is %h", rdata); errors++; end
+
+  bus.write(32'h00, 32'd500 );  // alpha threshold, rising edge
+  bus.write(32'h04, 32'd500 );  // gamma threshold, rising edge
+  bus.write(32'h08, 32'd2   );  // alpha mintime
+  bus.write(32'h0C, 32'd2   );  // gamma mintime
+  bus.write(32'h10, 32'd0   );  // reset FIFO
+  repeat(10) @(posedge clk);
+
+  // 1. register readout
+  pulses(20);
+  for (int i=0; i<20; i++) begin
+    bus.read(32'h20, rdata  );
+    bus.read(32'h24, rtime_l);
+    bus.read(32'h28, rtime_h);  // pops the peak
+    check(rdata, i);
+  end
+  repeat(10) @(posedge clk);
+  bus.read(32'h20, rdata);
+  if (rdata[31]) begin $display ("FAILURE: FIFO not empty after readout"); errors++; end
+
+  // 2. DDR ring
+  bus.write(32'h30, DMA_START);
+  bus.write(32'h34, DMA_SIZE );
+  bus.write(32'h3C, 32'd0    );  // tail
+  bus.write(32'h10, 32'd0    );  // reset FIFO, also clears the ring
+  bus.write(32'h2C, 32'd1    );  // DDR mode
+  fork
+    pulses(40);
+    begin: consumer
+      int unsigned tail = 0;
+      int unsigned seq  = 1;
+      while (seq <= 40) begin
+        logic [64-1:0] w1;
+        w1 = ddr[(DMA_START+tail+8)>>3];
+        if (w1[63:32] == seq) begin
+          check(w1[31:0], seq);
+          seq++;
+          tail = (tail+16) % DMA_SIZE;
+          bus.write(32'h3C, tail);
+        end
+        else repeat(50) @(posedge clk);
+      end
+    end
+  join
+  bus.read(32'h14, rdata);
+  if (rdata != 0) begin $display ("FAILURE: %0d peaks lost", rdata); errors++; end
+
+  // 3. interrupt
+  bus.write(32'h2C, 32'd0    );  // register readout
+  bus.write(32'h10, 32'd0    );  // reset FIFO
+  bus.write(32'h5C, 32'd3    );  // watermark
+  pulses(2);
+  repeat(10) @(posedge clk);
+  if (irq) begin $display ("FAILURE: interrupt below the watermark"); errors++; end
+  pulses(1);
+  repeat(10) @(posedge clk);
+  if (!irq) begin $display ("FAILURE: no interrupt at the watermark"); errors++; end
+  for (int i=0; i<3; i++) begin
+    bus.read(32'h20, rdata  );
+    bus.read(32'h24, rtime_l);
+    bus.read(32'h28, rtime_h);
+    check(rdata, i);
+    repeat(10) @(posedge clk);
+    if (irq) begin $display ("FAILURE: interrupt with %0d peaks left", 2-i); errors++; end
+  end
+  bus.write(32'h5C, 32'd0    );  // off
+  pulses(4);
+  repeat(10) @(posedge clk);
+  if (irq) begin $display ("FAILURE: interrupt while off"); errors++; end
+  for (int i=0; i<4; i++) begin
+    bus.read(32'h20, rdata  );
+    bus.read(32'h24, rtime_l);
+    bus.read(32'h28, rtime_h);
+    check(rdata, i);
+  end
+
+  if (errors == 0) $display ("SUCCESS");
+  else             $display ("FAILURE");
+  repeat(100) @(posedge clk);
+  $finish ();
+end
+
+sys_bus_model bus (
+  // system signals
+  .clk          (clk      ),
+  .rstn         (rstn     ),
+  // bus protocol signals
+  .sys_addr     (sys_addr ),
+  .sys_wdata    (sys_wdata),
+  .sys_sel      (sys_sel  ),
+  .sys_wen      (sys_wen  ),
+  .sys_ren      (sys_ren  ),
+  .sys_rdata    (sys_rdata),
+  .sys_err      (sys_err  ),
+  .sys_ack      (sys_ack  ) 
+);
+
+////////////////////////////////////////////////////////////////////////////////
+// DUT, AXI master and DDR memory model
+////////////////////////////////////////////////////////////////////////////////
+
+logic [32-1:0] axi0_waddr ;
+logic [64-1:0] axi0_wdata ;
+logic [ 8-1:0] axi0_wsel  ;
+logic          axi0_wvalid;
+logic [ 4-1:0] axi0_wlen  ;
+logic          axi0_wfixed;
+logic          axi0_werr  ;
+logic          axi0_wrdy  ;
+
+lfs lfs (
+  .clk_i          (clk      ),
+  .rstn_i         (rstn     ),
+  .dat_a_i        (adc_a    ),
+  .dat_b_i        (adc_b    ),
+  .dat_a_o        (         ),
+  .dat_b_o        (         ),
+  .exp_p_dat_i    (8'h0     ),
+  .exp_p_dat_o    (         ),
+  .exp_p_dir_o    (         ),
+  .exp_n_dat_i    (8'h0     ),
+  .exp_n_dat_o    (         ),
+  .exp_n_dir_o    (         ),
+  .axi0_waddr_o   (axi0_waddr ),
+  .axi0_wdata_o   (axi0_wdata ),
+  .axi0_wsel_o    (axi0_wsel  ),
+  .axi0_wvalid_o  (axi0_wvalid),
+  .axi0_wlen_o    (axi0_wlen  ),
+  .axi0_wfixed_o  (axi0_wfixed),
+  .axi0_werr_i    (axi0_werr  ),
+  .axi0_wrdy_i    (axi0_wrdy  ),
+  .irq_o          (irq        ),
+  .sys_addr       (sys_addr ),
+  .sys_wdata      (sys_wdata),
+  .sys_sel        (sys_sel  ),
+  .sys_wen        (sys_wen  ),
+  .sys_ren        (sys_ren  ),
+  .sys_rdata      (sys_rdata),
+  .sys_err        (sys_err  ),
+  .sys_ack        (sys_ack  )
+);
+
+logic [ 6-1:0] awid, wid, bid;
+logic [32-1:0] awaddr;
+logic [ 4-1:0] awlen;
+logic          awvalid, awready;
+logic [64-1:0] wdata;
+logic [ 8-1:0] wstrb;
+logic          wlast, wvalid, wready;
+logic [ 2-1:0] bresp;
+logic          bvalid, bready;
+
+axi_master #(
+  .DW   (  64    ), // data width (8,16,...,1024)
+  .AW   (  32    ), // address width
+  .ID   (   0    ), // master ID
+  .IW   (   6    ), // master ID width
+  .LW   (   4    )  // length width
+) axi_master (
+  .axi_clk_i      (clk        ),
+  .axi_rstn_i     (rstn       ),
+  .axi_awid_o     (awid       ),
+  .axi_awaddr_o   (awaddr     ),
+  .axi_awlen_o    (awlen      ),
+  .axi_awsize_o   (           ),
+  .axi_awburst_o  (           ),
+  .axi_awlock_o   (           ),
+  .axi_awcache_o  (           ),
+  .axi_awprot_o   (           ),
+  .axi_awvalid_o  (awvalid    ),
+  .axi_awready_i  (awready    ),
+  .axi_wid_o      (wid        ),
+  .axi_wdata_o    (wdata      ),
+  .axi_wstrb_o    (wstrb      ),
+  .axi_wlast_o    (wlast      ),
+  .axi_wvalid_o   (wvalid     ),
+  .axi_wready_i   (wready     ),
+  .axi_bid_i      (bid        ),
+  .axi_bresp_i    (bresp      ),
+  .axi_bvalid_i   (bvalid     ),
+  .axi_bready_o   (bready     ),
+  .axi_arid_o     (           ),
+  .axi_araddr_o   (           ),
+  .axi_arlen_o    (           ),
+  .axi_arsize_o   (           ),
+  .axi_arburst_o  (           ),
+  .axi_arlock_o   (           ),
+  .axi_arcache_o  (           ),
+  .axi_arprot_o   (           ),
+  .axi_arvalid_o  (           ),
+  .axi_arready_i  (1'b1       ),
+  .axi_rid_i      (6'h0       ),
+  .axi_rdata_i    (64'h0      ),
+  .axi_rresp_i    (2'h0       ),
+  .axi_rlast_i    (1'b0       ),
+  .axi_rvalid_i   (1'b0       ),
+  .axi_rready_o   (           ),
+  .sys_waddr_i    (axi0_waddr ),
+  .sys_wdata_i    (axi0_wdata ),
+  .sys_wsel_i     (axi0_wsel  ),
+  .sys_wvalid_i   (axi0_wvalid),
+  .sys_wlen_i     (axi0_wlen  ),
+  .sys_wfixed_i   (axi0_wfixed),
+  .sys_werr_o     (axi0_werr  ),
+  .sys_wrdy_o     (axi0_wrdy  ),
+  .sys_raddr_i    (32'h0      ),
+  .sys_rvalid_i   (1'b0       ),
+  .sys_rsel_i     (8'h0       ),
+  .sys_rlen_i     (4'h0       ),
+  .sys_rfixed_i   (1'b0       ),
+  .sys_rdata_o    (           ),
+  .sys_rrdy_o     (           ),
+  .sys_rerr_o     (           )
+);
+
+// DDR: accepts one write burst at a time, incrementing addresses, with random
+// stalls on every channel. Checks the AXI write protocol the way the HP port
+// would see it: burst length against wlast, byte strobes, and that no write
+// leaves the ring.
+logic [64-1:0] ddr [int unsigned];
+logic [32-1:0] burst_addr;
+logic [ 4-1:0] burst_beats;
+logic          burst_on;
+logic          aw_stall, w_stall, b_stall;
+
+assign awready = !burst_on && !bvalid && !aw_stall;
+assign wready  = burst_on && !w_stall;
+assign bresp   = 2'h0;
+
+always_ff @(posedge clk)
+if (!rstn) begin
+  burst_on <= 1'b0;
+  bvalid   <= 1'b0;
+  aw_stall <= 1'b0;
+  w_stall  <= 1'b0;
+  b_stall  <= 1'b0;
+end else begin
+  aw_stall <= ($urandom%4 == 0);
+  w_stall  <= ($urandom%4 == 0);
+  b_stall  <= ($urandom%2 == 0);
+  if (awvalid && awready) begin
+    if (awaddr < DMA_START || awaddr+8*(awlen+1) > DMA_START+DMA_SIZE) begin
+      $display ("FAILURE: write burst at %h, length %0d, outside of the ring", awaddr, awlen+1); errors++;
+    end
+    burst_on    <= 1'b1;
+    burst_addr  <= awaddr;
+    burst_beats <= awlen;
+    bid         <= awid;
+  end
+  if (wvalid && wready) begin
+    for (int b=0; b<8; b++)
+      if (wstrb[b]) ddr[burst_addr>>3][8*b+:8] <= wdata[8*b+:8];
+    if (wid != bid) begin $display ("FAILURE: wid %h does not match awid %h", wid, bid); errors++; end
+    burst_addr  <= burst_addr + 8;
+    burst_beats <= burst_beats - 1;
+    if (wlast != (burst_beats == 0)) begin $display ("FAILURE: wlast does not match awlen"); errors++; end
+    if (wlast) begin
+      burst_on <= 1'b0;
+      bvalid   <= 1'b1;
+    end
+  end
+  if (bvalid && bready && !b_stall)
+    bvalid <= 1'b0;
+end
+
+initial begin
+  $dumpfile("ssla_tb.vcd");
+  $dumpvars(0, ssla_tb);
+end
+
+endmodule: ssla_tb
@@ -22,169 +22,33 @@
 #include <cstdlib>
 #include <string>
 #include <fstream>
-#include <deque>
 #include <thread>
 #include <mutex>
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <pthread.h>
 #include <inttypes.h>
+#include <sys/stat.h>
 #include "fpga.cpp"
+#include "reorder.cpp"
+#include "ring.cpp"
+#include "timehist.cpp"
+#include "coinc.cpp"
+#include "kernel.cpp"
+#include "checkpoint.cpp"
+#include "listmode.cpp"
+#include "conf.cpp"
+#include "analysis.cpp"
+#include "shm.cpp"
+#include "fanout.cpp"
+#include "stats.cpp"
 
-using namespace std;
-
-struct peak{
-	uint64_t time;
-	int amp;
-	bool isalpha;
-};
-
-int alpha_thresh;
-bool alpha_edge;	//0 - rising edge, 1 - falling edge
-int gamma_thresh;
-bool gamma_edge;
-double alpha_mintime;unsigned alpha_mintime_uint;
-double gamma_mintime;unsigned gamma_mintime_uint;
-double interval;unsigned interval_uint;
-unsigned step_alpha;
-unsigned step_gamma;
-int alpha_max;
-int gamma_max;
-
-bool sortfun (peak a,peak b) {
-	if (a.time==b.time) {
-		return (a.isalpha==true);
-	}
-	else return (a.time<b.time);
-}
-
-void _gen_conf(void)
-{
-	FILE *conffile;
-	conffile=fopen("agc_conf.txt","w");
-	fprintf(conffile,
-		"Thresholds are minimum intensities required for trigger.\n"
-		"alpha_thresh(-8192 - 8191):\t100\n"
-		"alpha zero level (not needed by program, for reference):\t0\n"
-		"alpha_edge(Rising (R) or Falling (F)):\tR\n"
-		"alpha_max(R edge: alpha_thresh < x < 8191, F edge: -8192 < x < alpha_thresh):\t8191\n"
-		"gamma_thresh(-8192 - 8191):\t100\n"
-		"gamma zero level (not needed by program, for reference):\t0\n"
-		"gamma_edge(Rising (R) or Falling (F)):\tR\n"
-		"gamma_max(R edge: gamma_thresh < x < 8191, F edge: -8192 < x < gamma_thresh):\t8191\n"
-		"Mintime is the minimum duration from threshold rising(falling) pass to falling(rising) pass for the peak to be registered. (in seconds)\n"
-		"alpha_mintime(0 - 34.3597):\t0.00001\n"
-		"gamma_mintime(0 - 34.3597):\t0.00001\n"
-		"Observed interval before and after trigger event(0 - 34.3597)(in seconds):\t0.00001\n"
-		"Time resolved alpha amplitude step:\t100000\n"
-		"Time resolved gamma amplitude step:\t100000\n"
-		);
-	fclose(conffile);
-}
+#define RING_SIZE (1<<20)	//number of peaks buffered in RAM between the FIFO reader and the processing thread (power of two)
+#define FANOUT_SIZE (1<<16)	//number of reordered peaks shared by the analysis threads, with more than one analysis (power of two)
+#define UI_PERIOD 200		//ms between the display, end and checkpoint checks of the processing loop, also its longest sleep
 
-void _load_conf(bool pf)
-{
-	ifstream t("agc_conf.txt");
-	string conffile((istreambuf_iterator<char>(t)), istreambuf_iterator<char>());            //put the conf file into a string
-	
-	if (conffile.size()!=0){
-		char tmpch; int z;
-		size_t pos_alpha_thresh = conffile.find("alpha_thresh(-8192 - 8191):");
-			if (pos_alpha_thresh != string::npos){
-				pos_alpha_thresh+=27;
-				sscanf(conffile.substr(pos_alpha_thresh).c_str(), "%d", &alpha_thresh);
-				if(pf)printf("alpha_thresh=%d\n",alpha_thresh);
-			}else {printf("Error in alpha_thresh. Delete file to regenerate from template.\n"); exit(0);}
-		size_t pos_alpha_edge = conffile.find("alpha_edge(Rising (R) or Falling (F)):");
-			if (pos_alpha_edge != string::npos){
-				pos_alpha_edge+=38;
-				z=0; do {sscanf(conffile.substr(pos_alpha_edge+z).c_str(), "%c", &tmpch); z++;}
-				while (isspace(tmpch));
-				if (tmpch=='R') alpha_edge=0;
-				else if (tmpch=='F') alpha_edge=1;
-				else {printf("Error in alpha_edge. Must be F or R!\n"); exit(0);}
-				if(pf)printf("alpha_edge=%c\n",alpha_edge?'F':'R');
-			}else {printf("Error in alpha_edge. Delete file to regenerate from template.\n"); exit(0);}
-		size_t pos_gamma_thresh = conffile.find("gamma_thresh(-8192 - 8191):");
-			if (pos_gamma_thresh != string::npos){
-				pos_gamma_thresh+=27;
-				sscanf(conffile.substr(pos_gamma_thresh).c_str(), "%d", &gamma_thresh);
-				if(pf)printf("gamma_thresh=%d\n",gamma_thresh);
-			}else {printf("Error in gamma_thresh. Delete file to regenerate from template.\n"); exit(0);}
-		size_t pos_gamma_edge = conffile.find("gamma_edge(Rising (R) or Falling (F)):");
-			if (pos_gamma_edge != string::npos){
-				pos_gamma_edge+=38;
-				z=0; do {sscanf(conffile.substr(pos_gamma_edge+z).c_str(), "%c", &tmpch); z++;}
-				while (isspace(tmpch));
-				if (tmpch=='R') gamma_edge=0;
-				else if (tmpch=='F') gamma_edge=1;
-				else {printf("Error in gamma_edge. Must be F or R!\n"); exit(0);}
-				if(pf)printf("gamma_edge=%c\n",gamma_edge?'F':'R');
-			}else {printf("Error in gamma_edge. Delete file to regenerate from template.\n"); exit(0);}
-		size_t pos_alpha_mintime = conffile.find("alpha_mintime(0 - 34.3597):");
-			if (pos_alpha_mintime != string::npos){
-				pos_alpha_mintime+=27;
-				sscanf(conffile.substr(pos_alpha_mintime).c_str(), "%lf", &alpha_mintime);
-				if(pf)printf("alpha_mintime=%lf\n",alpha_mintime);
-			}else {printf("Error in alpha_mintime. Delete file to regenerate from template.\n"); exit(0);}
-		size_t pos_gamma_mintime = conffile.find("gamma_mintime(0 - 34.3597):");
-			if (pos_gamma_mintime != string::npos){
-				pos_gamma_mintime+=27;
-				sscanf(conffile.substr(pos_gamma_mintime).c_str(), "%lf", &gamma_mintime);
-				if(pf)printf("gamma_mintime=%lf\n",gamma_mintime);
-			}else {printf("Error in gamma_mintime. Delete file to regenerate from template.\n"); exit(0);}
-		char tmp[100];
-		size_t pos_interval = conffile.find("Observed interval before and after trigger event(0 - 34.3597)(in seconds):");
-			if (pos_interval != string::npos){
-				pos_interval+=74;
-				sscanf(conffile.substr(pos_interval).c_str(), "%lf", &interval);
-				if(pf)printf("interval=%lf\n",interval);
-			}else {printf("Error in interval. Delete file to regenerate from template.\n"); exit(0);}
-		size_t pos_step_alpha = conffile.find("Time resolved alpha amplitude step:");
-			if (pos_step_alpha != string::npos){
-				pos_step_alpha+=35;
-				sscanf(conffile.substr(pos_step_alpha).c_str(), "%u", &step_alpha);
-				if(pf)printf("step_alpha=%u\n",step_alpha);
-			}else {printf("Error in step_alpha. Delete file to regenerate from template.\n"); exit(0);}
-		size_t pos_step_gamma = conffile.find("Time resolved gamma amplitude step:");
-			if (pos_step_gamma != string::npos){
-				pos_step_gamma+=35;
-				sscanf(conffile.substr(pos_step_gamma).c_str(), "%u", &step_gamma);
-				if(pf)printf("step_gamma=%u\n",step_gamma);
-			}else {printf("Error in step_gamma. Delete file to regenerate from template.\n"); exit(0);}		
-		size_t pos_alpha_max = conffile.find("alpha_max(R edge: alpha_thresh < x < 8191, F edge: -8192 < x < alpha_thresh):");
-			if (pos_alpha_max != string::npos){
-				pos_alpha_max+=77;
-				sscanf(conffile.substr(pos_alpha_max).c_str(), "%d", &alpha_max);
-				if(pf)printf("alpha_max=%d\n",alpha_max);
-			}else {printf("Error in alpha_max. Delete file to regenerate from template.\n"); exit(0);}
-		size_t pos_gamma_max = conffile.find("gamma_max(R edge: gamma_thresh < x < 8191, F edge: -8192 < x < gamma_thresh):");
-			if (pos_gamma_max != string::npos){
-				pos_gamma_max+=77;
-				sscanf(conffile.substr(pos_gamma_max).c_str(), "%d", &gamma_max);
-				if(pf)printf("gamma_max=%d\n",gamma_max);
-			}else {printf("Error in gamma_max. Delete file to regenerate from template.\n"); exit(0);}
-			
-		if(pf)printf("All loaded, no errors (I did not check for boundaries, you better had chosen them properly)!.\n");
-	}
-	else{
-		printf ("No agc_conf.txt found. Generating file from template. Modify the file and rerun the program.\n");
-		_gen_conf();
-		exit(0);
-	}
-	t.close();
-}
-
-bool _match_confs()	//compare configs
-{
-	ifstream t0("agc_conf.txt");
-	string conffile0((istreambuf_iterator<char>(t0)), istreambuf_iterator<char>());
-	ifstream t1("measurements/agc_conf.txt");
-	string conffile2((istreambuf_iterator<char>(t1)), istreambuf_iterator<char>());
-	if (conffile2.empty()){
-		system ("cp agc_conf.txt measurements/agc_conf.txt");
-	}
-	else if (conffile0.compare(conffile2) != 0) return true;
-	return false;
-}
+using namespace std;
 
 mutex endack_mx;
 bool endack=false;
@@ -201,7 +65,61 @@ void term_fun(void){
 	}
 }
 
+void _pin_to_core(unsigned core)	//does nothing on single core machines
+{
+	if (thread::hardware_concurrency()<2) return;
+	cpu_set_t cpuset;
+	CPU_ZERO(&cpuset);
+	CPU_SET(core%thread::hardware_concurrency(),&cpuset);
+	pthread_setaffinity_np(pthread_self(),sizeof(cpu_set_t),&cpuset);
+}
+
+atomic<bool> reader_stop(false);
+void reader_fun(spsc_ring<peak>* ring){		//drains the FPGA FIFO into the ring, nothing else
+	_pin_to_core(1);
+	peak buf[AGC_FIFO_SIZE];
+	unsigned idle=0;
+	while (!reader_stop.load(memory_order_relaxed)){
+		int n=AGC_dma?AGC_dma_get_samples(buf,AGC_FIFO_SIZE):AGC_get_samples(buf,AGC_FIFO_SIZE);
+		if (n==0) {AGC_wait(idle++); continue;}
+		idle=0;
+		for (int i=0;i!=n;i++)
+			while (ring->push(buf[i]))				//ring full: stall, the FPGA FIFO takes over (and counts losses)
+				if (reader_stop.load(memory_order_relaxed)) return;
+		ring->notify();							//the processing thread may be asleep on an empty ring
+	}
+}
+
+void _totals(const analysis& an, uint64_t* N_alpha, uint64_t* N_gamma)	//in spectrum mode every peak is counted by the FPGA, most are never read
+{
+	if (AGC_spec) {AGC_spectrum_counts(); *N_alpha=AGC_spec_alpha; *N_gamma=AGC_spec_gamma;}
+	else {*N_alpha=an.st.N_alpha; *N_gamma=an.st.N_gamma;}
+}
+
+struct pipeline{			//one analysis of the peaks and where it is saved
+	string name, dir;
+	analysis an;
+	string duration;		//durations of previous runs, this run's is added by each checkpoint
+	ckpt_src ckpt;
+	checkpointer writer;
+	shm_export shm;			//live export, if on
+};
+
+void _merge_spectra(vector<pipeline>& pl)	//spectrum mode: adds the FPGA histograms to alpha_array and gamma_array
+{
+	if (!AGC_spec) return;
+	AGC_spectrum_read();
+	for (size_t i=0;i!=pl.size();i++){
+		analysis& an=pl[i].an;
+		pl[i].shm.begin();
+		AGC_spectrum_merge(an.alpha_array,an.ENmax_alpha,an.c.alpha_thresh,an.c.alpha_edge,an.gamma_array,an.ENmax_gamma,an.c.gamma_thresh,an.c.gamma_edge);
+		pl[i].shm.end(an.st);
+	}
+}
+
 int main(int argc,char *argv[]){
+	chrono::steady_clock::time_point t_start=chrono::steady_clock::now();	//startup time is reported without the time spent waiting for the user
+	double t_wait=0;
 	bool pf=true;
 	if (argc==2) pf=false;
 	if(pf) printf("Alpha-gamma counter program, version: %s\n",VERSION);
@@ -210,176 +128,188 @@ int main(int argc,char *argv[]){
 	if(pf)printf ("Note that existing .dat files are read and new counts are added to existing ones. If the settings change (such as energy boundaries) these files should be removed"
 	              ", else the program may crash (because wrong file lenghts etc.).\n\n");
 	_load_conf(pf);
-	alpha_mintime_uint=(unsigned)(alpha_mintime*125000000);
-	gamma_mintime_uint=(unsigned)(gamma_mintime*125000000);
-	interval_uint=(unsigned)(interval*125000000);
+	vector<pipeline_conf> extra=_load_pipeline_confs(pf);		//agc_conf_<name>.txt: more analyses of the same peaks
 
-	//check if red_pitaya_agcv_VERSION.bin exists
-	FILE* binFILE;
-	string fnamecomm="red_pitaya_agc_v";
-	fnamecomm += VERSION;
-	fnamecomm += ".bit";
-	binFILE = fopen(fnamecomm.c_str(),"rb");
-	if (binFILE!=NULL) fclose(binFILE);
-	else {printf ("FILE %s NOT FOUND. ABORTING.\n",fnamecomm.c_str());return 0;}
-	fnamecomm.insert(0,"cat ");
-	fnamecomm+= " > /dev/xdevcfg";
-	system (fnamecomm.c_str());
+	const char* emu=getenv("AGC_EMU");	//AGC_EMU=alpha_rate[,gamma_rate] (peaks/s) runs on the software emulator, no Red Pitaya needed
+	double emu_ra=0, emu_rg=0;
+	if (emu){
+		if (sscanf(emu,"%lf,%lf",&emu_ra,&emu_rg)==1) emu_rg=emu_ra;
+		printf("Using the FPGA emulator with %g alphas/s and %g gammas/s.\n",emu_ra,emu_rg);
+	}
+	
+	//check if red_pitaya_agcv_VERSION.bin exists, unless it is already loaded
+	bool reload=!emu && !AGC_loaded();
+	if (!emu && !reload && pf) printf("Bitstream v%s is already loaded, not reloading it.\n",VERSION);
+	if (reload){
+		FILE* binFILE;
+		string fnamecomm="red_pitaya_agc_v";
+		fnamecomm += VERSION;
+		fnamecomm += ".bit";
+		binFILE = fopen(fnamecomm.c_str(),"rb");
+		if (binFILE!=NULL) fclose(binFILE);
+		else {printf ("FILE %s NOT FOUND. ABORTING.\n",fnamecomm.c_str());return 0;}
+		fnamecomm.insert(0,"cat ");
+		fnamecomm+= " > /dev/xdevcfg";
+		system (fnamecomm.c_str());
+	}
 	
 	//make measurements folder if missing, and check if existing configuration inside it matches the config in the working directory
-	system ("mkdir measurements -p");
-	if (_match_confs()) {printf ("Configuration in working directory does not match the one in measurements folder. "
+	if (mkdir("measurements",0755) && errno!=EEXIST) {printf("Cannot create the measurements folder: %s\n",strerror(errno)); return -1;}
+	int match=_match_confs();
+	if (match<0) return -1;
+	if (match) {printf ("Configuration in working directory does not match the one in measurements folder. "
 			"You should rename the measurements folder to prevent appending new data with different configuration. Aborting.\n");return 0;}
 	
-	int ENmax_alpha;
-	if (!alpha_edge){	//rising edge
-		ENmax_alpha=alpha_max-alpha_thresh+1;	//num of elements in the array
-	}else{
-		ENmax_alpha=-(alpha_max-alpha_thresh)+1;	//num of elements in the array
+	vector<pipeline> pl(1+extra.size());
+	pl[0].dir="measurements";
+	if (pl[0].an.setup(_analysis_conf())) {printf("Error in energy, step, interval or time axis settings.\n"); return 0;}
+	for (size_t i=0;i!=extra.size();i++){		//each in its own subfolder, with its own copy of the configuration
+		pipeline& p=pl[i+1];
+		p.name=extra[i].name;
+		p.dir="measurements/"+p.name;
+		if (extra[i].c.alpha_edge!=alpha_edge || extra[i].c.gamma_edge!=gamma_edge) {printf("The trigger edges in %s must be the same as in agc_conf.txt. Aborting.\n",extra[i].fname.c_str()); return 0;}
+		if (mkdir(p.dir.c_str(),0755) && errno!=EEXIST) {printf("Cannot create the %s folder: %s\n",p.dir.c_str(),strerror(errno)); return -1;}
+		match=_match_confs(extra[i].fname,p.dir);
+		if (match<0) return -1;
+		if (match) {printf ("Configuration %s does not match the one in %s. "
+				"You should rename the folder to prevent appending new data with different configuration. Aborting.\n",extra[i].fname.c_str(),p.dir.c_str());return 0;}
+		if (p.an.setup(extra[i].c)) {printf("Error in energy, step, interval or time axis settings of %s.\n",extra[i].fname.c_str()); return 0;}
 	}
-	unsigned alpha_binN = ENmax_alpha/step_alpha+1;
-	if(pf)printf("\nalpha_binN=%u\n",alpha_binN);
-	int ENmax_gamma;
-	if (!gamma_edge){
-		ENmax_gamma=gamma_max-gamma_thresh+1;	//num of elements in the array
-	}else{
-		ENmax_gamma=-(gamma_max-gamma_thresh)+1;	//num of elements in the array
+	long unsigned memreq=0;
+	unsigned max_interval=0;
+	for (size_t i=0;i!=pl.size();i++){
+		analysis& an=pl[i].an;
+		if(pf && i) printf("\nAnalysis %s, saved in %s:",pl[i].name.c_str(),pl[i].dir.c_str());
+		if(pf)printf("\nalpha_binN=%u\n",an.alpha_binN);
+		if(pf)printf("gamma_binN=%u\n",an.gamma_binN);
+		if(pf)printf("time_binN=%u\n\n",an.time_binN);
+		memreq+=an.memreq();
+		max_interval=max(max_interval,an.c.interval);
 	}
-	unsigned gamma_binN = ENmax_gamma/step_gamma+1;
-	if(pf)printf("gamma_binN=%u\n\n",gamma_binN);
 	
-	long unsigned memreq;
-	memreq=ENmax_alpha+ENmax_gamma+alpha_binN*gamma_binN*2*interval_uint;
-	memreq*=sizeof(unsigned);
 	printf("Total memory required (both in RAM and SD): %.4lf MB. MAKE SURE IT IS AVAILABLE BEFORE PROCEEDING.\n",(double)memreq/1024/1024);
 	if(pf){	printf("Press any key to continue...\n");
+		chrono::steady_clock::time_point t=chrono::steady_clock::now();
 		scanf("%*c");
+		t_wait=chrono::duration<double>(chrono::steady_clock::now()-t).count();
 	}
 	
-	if (AGC_init()) return -1;		//fpga init
+	if (emu?AGC_init_emu(emu_ra,emu_rg):AGC_init()) return -1;		//fpga init
 	AGC_setup(alpha_thresh,gamma_thresh,alpha_edge,gamma_edge,alpha_mintime_uint,gamma_mintime_uint);
+	if (getenv("AGC_DMA")!=NULL && atoi(getenv("AGC_DMA"))){	//peaks through the DDR ring, opt-in: the ring must be reserved on the board
+		int r=AGC_dma_init();
+		if (r<0) return -1;
+		if (r==1) printf("The bitstream does not support DDR mode, peaks are read through the registers.\n");
+		else if(pf) printf("Reading peaks from the DDR ring.\n");
+	}
+	if (spectrum_mode){					//window: the longest coincidence interval, delay: interval + the 2*interval the reorder stage allows for
+		int r=AGC_spectrum_init(max_interval,(3*(uint64_t)max_interval>0xFFFFFFFF)?0xFFFFFFFF:3*max_interval);
+		if (r<0) return -1;
+		if (r==1) printf("The bitstream does not support spectrum mode, all peaks are read.\n");
+		else if(pf) printf("Spectrum mode: energy spectra are histogrammed on the FPGA.\n");
+	}
+	if (getenv("AGC_IRQ")!=NULL && atoi(getenv("AGC_IRQ"))){	//the FIFO reader sleeps until the FIFO fills up to the watermark instead of polling, opt-in until the interrupt is verified on hardware
+		int r=AGC_irq_init(AGC_get_fifo_size()/8);
+		if (r<0) return -1;
+		if (r==1) printf("The bitstream or the kernel does not support the FIFO interrupt, the FIFO is polled.\n");
+		else if(pf) printf("Waiting for FIFO interrupts.\n");
+	}
 	
 	if(pf){
 		thread term_thread (term_fun);			//ending by button
 		term_thread.detach();			
 	}
        
-       
-        FILE* ifile;
-		//####generate alpha energy array
-	ifile = fopen("measurements/alpha.dat","rb");
-	unsigned *alpha_array = new unsigned[ENmax_alpha];
-	if (ifile!=NULL) {
-		fread (alpha_array,sizeof(unsigned),ENmax_alpha,ifile);	// read existing file
-		fclose(ifile);
+	vector<analysis*> ans;
+	vector<shm_export*> shms;
+	for (size_t i=0;i!=pl.size();i++){
+		pipeline& p=pl[i];
+		if (checkpoint_replay(p.dir)) {printf("Applying the checkpoint journal %s/checkpoint.jnl failed. Aborting.\n",p.dir.c_str()); return -1;}	//finish a checkpoint interrupted by a crash
+		
+		ifstream tdur(p.dir+"/duration.txt");
+		p.duration=string((istreambuf_iterator<char>(tdur)), istreambuf_iterator<char>());
+		
+		analysis& an=p.an;
+		void* mem=NULL;					//histograms in shared memory, for other processes to read live
+		if (shm_export_on && (mem=p.shm.create(i?"/agc_"+p.name:"/agc",an.mem_size()))==NULL) return -1;
+		if (an.open(p.dir.c_str(),mem)) return -1;		//existing .dat files are read (time.dat is mapped), or new ones started
+		if (AGC_spec) an.st.ENmax_alpha=an.st.ENmax_gamma=0;	//the kernel must not count the forwarded peaks again
+		p.shm.describe(an);
+		p.ckpt.alpha_array=an.alpha_array; p.ckpt.ENmax_alpha=an.ENmax_alpha;
+		p.ckpt.gamma_array=an.gamma_array; p.ckpt.ENmax_gamma=an.ENmax_gamma;
+		p.ckpt.wide=an.c.wide_spectra;
+		p.ckpt.bins=&an.bins;
+		p.ckpt.shared=p.shm.base();
+		ans.push_back(&an);
+		shms.push_back(&p.shm);
 	}
-	else for (int i=0;i!=ENmax_alpha;i++)alpha_array[i]=0;	// else fill with 0
+	analysis& an=pl[0].an;				//counters and elapsed time are the same for all analyses
+	uint64_t N_alpha=0, N_gamma=0;
 	
-		//####generate gamma energy array
-	ifile = fopen("measurements/gamma.dat","rb");
-	unsigned *gamma_array = new unsigned[ENmax_gamma];
-	if (ifile!=NULL) {
-		fread (gamma_array,sizeof(unsigned),ENmax_gamma,ifile);	// read existing file
-		fclose(ifile);
-	}
-	else for (int i=0;i!=ENmax_gamma;i++)gamma_array[i]=0;	// else fill with 0
+        uint64_t timestamp=0;
+	peak pk;
+	spsc_ring<peak> ring(RING_SIZE);
+	fanout fo;
 	
-		//####generate time arrays
+	uint64_t next_ckpt=(uint64_t)checkpoint_period*125000000;
 	
-	ifile = fopen("measurements/time.dat","rb");
-	unsigned*** bins = new unsigned**[alpha_binN];
-	for (int i=0; i!=alpha_binN;i++) {
-		bins[i] = new unsigned*[gamma_binN];
-		for (int j=0; j!=gamma_binN;j++){
-			bins[i][j] = new unsigned[2*interval_uint];
-			if (ifile!=NULL) fread (bins[i][j],sizeof(unsigned),2*interval_uint,ifile);	// read existing file
-			else for (int k=0;k!=2*interval_uint;k++)bins[i][j][k]=0;
-		}
+	lm_writer lm;
+	if (listmode && lm.open("measurements/listmode.dat")) return -1;
+	lm_writer stream;					//the same blocks to agc-collect
+	bool streaming=(stream_to!="-");
+	uint32_t board=0;
+	if (streaming){
+		size_t c=stream_to.rfind(':'), b=(c==string::npos)?c:stream_to.find('/',c);
+		if (c==string::npos || b==string::npos || c==0 || b==c+1 || sscanf(stream_to.c_str()+b+1,"%u",&board)!=1) {printf("stream_to must be host:port/board, not %s.\n",stream_to.c_str()); return -1;}
+		if (stream.connect(stream_to.substr(0,c),stream_to.substr(c+1,b-c-1))) return -1;
+		if (AGC_spec) printf("Warning: in spectrum mode only peaks with a coincidence on this board are streamed.\n");
 	}
-	if (ifile!=NULL) fclose(ifile);	
-
-	uint64_t N_alpha=0;
-        uint64_t N_gamma=0;
-        uint64_t timestamp=0;
-        
-        deque <peak> active_trig_alpha;
-        deque <peak> active_trig_gamma;
-        bool isalpha;
-	int amplitude;
 	
-	deque <peak> time_shift;	//see comments below
+	hot_stats hs;
+	stats_publisher stats;
 	
+	uint64_t start_ns=chrono::duration_cast<chrono::nanoseconds>(chrono::system_clock::now().time_since_epoch()).count();
 	AGC_reset_fifo(); 
-	for(int i=0;;i++){
-		if (!AGC_get_sample(&isalpha,&amplitude,&timestamp)){
-				//Peaks may not be in chronological order so we store and sort data before processing.
-			time_shift.emplace_back();
-			time_shift.back().time=timestamp;
-			time_shift.back().amp=amplitude;
-			time_shift.back().isalpha=isalpha;
-			
-			sort (time_shift.begin(), time_shift.end(), sortfun);
-
-			while (time_shift.back().time>time_shift.front().time+2*interval_uint){
-				timestamp=time_shift.front().time;
-				amplitude=time_shift.front().amp;
-				isalpha=time_shift.front().isalpha;
-				time_shift.pop_front();
-				if (isalpha){
-					N_alpha++;
-					if (abs(amplitude-alpha_thresh)<ENmax_alpha)
-						alpha_array[abs(amplitude-alpha_thresh)]++;	
-				}
-				else{
-					N_gamma++;
-					if (abs(amplitude-gamma_thresh)<ENmax_gamma)
-						gamma_array[abs(amplitude-gamma_thresh)]++;
-				}
-				
-				if (isalpha){
-					active_trig_alpha.emplace_back();
-					active_trig_alpha.back().time=timestamp;
-					active_trig_alpha.back().amp=amplitude;
-				}else{
-					active_trig_gamma.emplace_back();
-					active_trig_gamma.back().time=timestamp;
-					active_trig_gamma.back().amp=amplitude;
-				}
-				
-				if (!isalpha){
-					for (int j=0;j!=active_trig_alpha.size();j++){
-						if (timestamp>=active_trig_alpha[j].time+interval_uint){
-							active_trig_alpha.pop_front();
-							j--;
-						}else{
-							unsigned a,b;
-							a=abs(active_trig_alpha[j].amp-alpha_thresh)/step_alpha;
-							b=abs(amplitude-gamma_thresh)/step_gamma;
-							if ((interval_uint+(timestamp-active_trig_alpha[j].time))<2*interval_uint)
-								if ((a<alpha_binN)&&(b<gamma_binN))
-									bins[a][b][interval_uint+(timestamp-active_trig_alpha[j].time)]++;
-						}
-					}	
-				}else{
-					for (int j=0;j!=active_trig_gamma.size();j++){
-						if (timestamp>active_trig_gamma[j].time+interval_uint){
-							active_trig_gamma.pop_front();
-							j--;
-						}else{
-							unsigned a,b;
-							a=abs(amplitude-alpha_thresh)/step_alpha;
-							b=abs(active_trig_gamma[j].amp-gamma_thresh)/step_gamma;
-							if ((interval_uint-(timestamp-active_trig_gamma[j].time))<=interval_uint)
-								if ((a<alpha_binN)&&(b<gamma_binN))
-									bins[a][b][interval_uint-(timestamp-active_trig_gamma[j].time)]++;
-						}
-					}	
-				}
-				if (time_shift.empty()) break;
+	if (streaming && stream.begin(board,start_ns)) return -1;
+	fo.start(ans,shms,FANOUT_SIZE);				//with more than one analysis, each gets a worker thread
+	thread reader_thread (reader_fun, &ring);		//FIFO reader on the second core, processing stays on this one
+	_pin_to_core(0);
+	stats.startup=chrono::duration<double>(chrono::steady_clock::now()-t_start).count()-t_wait;
+	if(pf)printf("Startup took %.3lf s.\n",stats.startup);
+	if (stats_period) stats.start("measurements/stats.txt",stats_period,&ring);
+	unsigned idle=0;
+	chrono::steady_clock::time_point next_ui=chrono::steady_clock::now();
+	for(unsigned i=0;;i++){
+		if (!ring.pop(&pk)){
+			idle=0;
+				//Peaks may not be in chronological order so we hold them in the reorder stage before processing.
+			timestamp=pk.time;
+			if (listmode) lm.push(pk);
+			if (streaming) stream.push(pk);
+			if (hs.timed()){
+				chrono::steady_clock::time_point t0=chrono::steady_clock::now();
+				fo.push(pk);
+				hs.record(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now()-t0).count());
 			}
+			else fo.push(pk);
+			hs.track(fo.in_reorder(),fo.open_alphas(),fo.open_gammas());
+		}
+		else{
+			fo.publish();
+			if (streaming) stream.poll();
+			ring.wait(idle++,UI_PERIOD);				//spins, yields, then sleeps until the reader pushes
+		}
+		if (stats.is_due()){
+			fo.sync();
+			_totals(an,&hs.N_alpha,&hs.N_gamma);
+			hs.elapsed=an.st.last_time;
+			stats.submit(hs);
 		}
 
-		if (i/1000000){
+		if (!idle && (i&1023)) continue;				//the clock is read every 1024 peaks and on every empty pop
+		chrono::steady_clock::time_point now=chrono::steady_clock::now();
+		if (now>=next_ui){
+			next_ui=now+chrono::milliseconds(UI_PERIOD);
 			if(pf){
 				endack_mx.lock();
 				if (endack) break;
@@ -387,60 +317,81 @@ int main(int argc,char *argv[]){
 			}
 			else if (timestamp/125000000>=atoi(argv[1])) break;
 			
+			fo.sync();
+			if (checkpoint_period && an.st.last_time>=next_ckpt){
+				bool busy=false;
+				for (size_t j=0;j!=pl.size();j++) busy|=pl[j].writer.poll();
+				if (!busy){					//all analyses are checkpointed at the same peak
+					_merge_spectra(pl);
+					int r=0;
+					for (size_t j=0;j!=pl.size();j++){
+						pl[j].ckpt.elapsed=an.st.last_time;
+						pl[j].ckpt.duration=pl[j].duration+"+"+to_string(an.st.last_time/125000000)+" seconds\n";
+						r|=pl[j].writer.start(pl[j].ckpt,pl[j].dir);
+					}
+					if (!r) next_ckpt=an.st.last_time+(uint64_t)checkpoint_period*125000000;
+				}
+			}
+			
+			_totals(an,&N_alpha,&N_gamma);
 			if(pf)printf ("\033[2JPress 'e' to stop acquistion.\nN_alpha=%" PRIu64"\nN_gamma=%" PRIu64"\nelapsed time=%" PRIu64" s\n"
-			              "RPTY lost peaks:%" PRIu32"(max in queue %" PRIu16"/250)\n",N_alpha,N_gamma,timestamp/125000000,AGC_get_num_lost(),AGC_get_max_in_queue());
-			i=0;
+			              "RPTY lost peaks:%" PRIu32"(max in queue %" PRIu16"/250)\n"
+			              "RAM ring:%zu(max in ring %zu/%zu)\n"
+			              "MMIO reads per peak:%.2lf\n",N_alpha,N_gamma,timestamp/125000000,AGC_get_num_lost(),AGC_get_max_in_queue(),ring.in_ring(),ring.max_in_ring(),ring.size(),
+			              AGC_reads_per_peak());
+			if(pf && listmode)printf("List mode peaks written:%" PRIu64"(dropped %" PRIu64")\n",lm.num_written(),lm.num_dropped());
+			if(pf && streaming)printf("Peaks streamed:%" PRIu64"(dropped %" PRIu64")\n",stream.num_written(),stream.num_dropped());
 		}
 		
 	}
+	stats.end();
+	reader_stop=true;
+	reader_thread.join();
+	fo.stop();
+	lm.close();
+	stream.close();
+	_totals(an,&N_alpha,&N_gamma);
 	
 	if(pf)printf ("\033[2JAcquistion ended.\nN_alpha=%" PRIu64"\nN_gamma=%" PRIu64"\nelapsed time=%" PRIu64" s\n"
-	              "RPTY lost peaks:%" PRIu32"(max in queue %" PRIu16"/250)\n",N_alpha,N_gamma,timestamp/125000000,AGC_get_num_lost(),AGC_get_max_in_queue());
-	
-	FILE* ofile;
-	
-	if(pf)printf("Saving alpha...");
-	ofile=fopen("measurements/alpha.dat","wb");
-	fwrite (alpha_array,sizeof(unsigned),ENmax_alpha,ofile);
-	fclose(ofile);
-	if(pf)printf("done! format is \'%%uint32\' starting from threshold(=0). One line is one channel.\n");
-	delete[] alpha_array;
-
-	if(pf)printf("Saving gamma...");
-	ofile=fopen("measurements/gamma.dat","wb");
-	fwrite (gamma_array,sizeof(unsigned),ENmax_gamma,ofile);
-	fclose(ofile);
-	if(pf)printf("done! format is \'%%uint32\' starting from threshold(=0). One line is one channel.\n");
-	delete[] gamma_array;
-
-	unsigned *timesum = new unsigned[2*interval_uint];
-	for (int k=0;k!=2*interval_uint;k++)timesum[k]=0;
+	              "RPTY lost peaks:%" PRIu32"(max in queue %" PRIu16"/250)\n"
+	              "RAM ring:%zu(max in ring %zu/%zu)\n"
+	              "MMIO reads per peak:%.2lf\n",N_alpha,N_gamma,timestamp/125000000,AGC_get_num_lost(),AGC_get_max_in_queue(),ring.in_ring(),ring.max_in_ring(),ring.size(),
+	              AGC_reads_per_peak());
+	if(pf && listmode)printf("List mode peaks written:%" PRIu64"(dropped %" PRIu64")\n",lm.num_written(),lm.num_dropped());
+	if(pf && streaming)printf("Peaks streamed:%" PRIu64"(dropped %" PRIu64")\n",stream.num_written(),stream.num_dropped());
+	if (AGC_stat_irq_missed) printf("WARNING: %" PRIu64" times the FIFO reached the watermark without an interrupt, check the interrupt wiring or run without AGC_IRQ.\n",(uint64_t)AGC_stat_irq_missed);
 	
-	if(pf)printf("Saving time...");
-	ofile = fopen("measurements/time.dat","wb");
-	for (int i=0; i!=alpha_binN;i++) {
-		for (int j=0; j!=gamma_binN;j++){
-			fwrite (bins[i][j],sizeof(unsigned),2*interval_uint,ofile);
-			for (int k=0;k!=2*interval_uint;k++)timesum[k]+=bins[i][j][k];
-			delete[] bins[i][j];
-		}
-		delete[] bins[i];
+	if(pf)printf("Saving...");
+	for (size_t i=0;i!=pl.size();i++) pl[i].writer.wait();
+	_merge_spectra(pl);
+	for (size_t i=0;i!=pl.size();i++){
+		pipeline& p=pl[i];
+		p.ckpt.elapsed=an.st.last_time;
+		p.ckpt.duration=p.duration+"+"+to_string(an.st.last_time/125000000)+" seconds\n";
+		if (checkpoint_write(p.ckpt,p.dir)) {printf("Saving %s failed: %s\n",p.dir.c_str(),strerror(errno)); return -1;}
+		p.an.taxis.write_desc((p.dir+"/time_axis.txt").c_str());
 	}
-	delete[] bins;
-	fclose(ofile);
-	if(pf)printf("done! format is \'%%uint32\' and is a 3D matrix of size %d:%d:%d.\n ",alpha_binN,gamma_binN,2*interval_uint);
-	
-	if(pf)printf("Saving timesum...");
-	ofile=fopen("measurements/timesum.dat","wb");
-	fwrite (timesum,sizeof(unsigned),2*interval_uint,ofile);
-	fclose(ofile);
-	if(pf)printf("done! format is \'%%uint32\' .\n For time and timesum: One step is 8 ns. Total time is 2x interval, so for $0==%u we have t=0s\n",interval_uint);
-	delete[] timesum;
-	
-	if(pf)printf("Saving duration...");
-	ofile=fopen("measurements/duration.txt","a");
-	fprintf(ofile,"+%" PRIu64" seconds\n",timestamp/125000000);
-	fclose(ofile);
+	if(pf)printf("done!\n");
+	for (size_t i=0;i!=pl.size();i++){
+		analysis& a=pl[i].an;
+		if (!a.c.wide_spectra && (spec_saturated(a.alpha_array,a.ENmax_alpha) || spec_saturated(a.gamma_array,a.ENmax_gamma)))
+			printf("Some %s/alpha.dat or gamma.dat bins exceed 2^32-1 and were saved as 2^32-1. Set wide_spectra to Y to save them as uint64.\n",pl[i].dir.c_str());
+	}
+	if(pf)printf("alpha.dat, gamma.dat: format is \'%%%s\' starting from threshold(=0). One line is one channel.\n",an.c.wide_spectra?"uint64":"uint32");
+	if(pf){
+		if (an.c.sparse_time) printf("time.sdat: compressed time.dat, a 3D matrix of size %d:%d:%d. Convert it with agc-tconv or read single cells as described in README.md.\n",an.alpha_binN,an.gamma_binN,an.time_binN);
+		else printf("time.dat: format is \'%%uint32\' and is a 3D matrix of size %d:%d:%d.\n",an.alpha_binN,an.gamma_binN,an.time_binN);
+	}
+	if(pf)printf("alphaproj.dat, gammaproj.dat: format is \'%%uint32\', time.dat summed over gamma (alpha) bins, matrices of size %d:%d and %d:%d.\n",an.alpha_binN,an.time_binN,an.gamma_binN,an.time_binN);
+	if(pf){
+		if (an.taxis.islog) printf("timesum.dat: format is \'%%uint32\' .\n For time and timesum: logarithmic time axis, for $0==%u we have t=0s. Bin edges are listed in time_axis.txt\n",an.taxis.half);
+		else printf("timesum.dat: format is \'%%uint32\' .\n For time and timesum: One step is %u x 8 ns. Total time is 2x interval, so for $0==%u we have t=0s\n",an.taxis.width,an.taxis.half);
+	}
+	for (size_t i=1;i<pl.size();i++){
+		analysis& a=pl[i].an;
+		if(pf)printf("%s: alpha.dat, gamma.dat as \'%%%s\', %s of size %d:%d:%d, see its time_axis.txt.\n",pl[i].dir.c_str(),a.c.wide_spectra?"uint64":"uint32",a.c.sparse_time?"time.sdat":"time.dat",a.alpha_binN,a.gamma_binN,a.time_binN);
+	}
+	for (size_t i=0;i!=pl.size();i++) {pl[i].an.close(); pl[i].shm.close();}
 	
 	AGC_exit();
 }
@@ -0,0 +1,159 @@
+/*
+    Alpha Gamma Counter
+    Copyright (C) 2017  Mario Vretenar
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+////-------------------------------- analysis --------------------------------////
+// One complete processing pipeline for one analysis_conf: reorder stage, event kernel,
+// coincidence engine and the alpha, gamma and time histograms. Used by the acquisition
+// program and by the offline tools, so they all histogram peaks in exactly the same way.
+
+class analysis{
+public:
+	analysis(): alpha_array(NULL), gamma_array(NULL), _coinc(NULL), _rb(NULL), _extmem(false) {}
+	~analysis() {close();}
+	
+	int setup(const analysis_conf& conf)	//computes the histogram sizes, returns 0 on success
+	{
+		c=conf;
+		if (!c.alpha_edge) ENmax_alpha=c.alpha_max-c.alpha_thresh+1;	//num of elements in the array
+		else ENmax_alpha=-(c.alpha_max-c.alpha_thresh)+1;
+		if (!c.gamma_edge) ENmax_gamma=c.gamma_max-c.gamma_thresh+1;
+		else ENmax_gamma=-(c.gamma_max-c.gamma_thresh)+1;
+		if ((int)ENmax_alpha<=0 || (int)ENmax_gamma<=0 || c.step_alpha==0 || c.step_gamma==0) return -1;
+		alpha_binN=ENmax_alpha/c.step_alpha+1;
+		gamma_binN=ENmax_gamma/c.step_gamma+1;
+		if (taxis.setup(c.interval,c.time_binwidth,c.time_logbins)) return -1;
+		time_binN=taxis.size();
+		return 0;
+	}
+	
+	long unsigned memreq() const	//bytes
+	{
+		return (ENmax_alpha+ENmax_gamma)*sizeof(uint64_t)+(long unsigned)alpha_binN*gamma_binN*time_binN*c.time_cell_bits/8
+		       +(long unsigned)(alpha_binN+gamma_binN+1)*time_binN*sizeof(unsigned);		//+ the projections
+	}
+	
+	size_t mem_size() const		//bytes open() needs in mem
+	{
+		return (size_t)(ENmax_alpha+ENmax_gamma)*sizeof(uint64_t)+time_hist::mem_size(alpha_binN,gamma_binN,time_binN,c.time_cell_bits);
+	}
+	
+	int open(const char* dir, void* mem=NULL)	//loads existing histograms from dir (or starts new ones), dir==NULL: new histograms in RAM only,
+	{						//mem: zeroed, mem_size() bytes to keep all histograms in (shared memory), returns 0 on success
+		_extmem=(mem!=NULL);
+		alpha_array=mem?(uint64_t*)mem:new uint64_t[ENmax_alpha];
+		gamma_array=mem?alpha_array+ENmax_alpha:new uint64_t[ENmax_gamma];
+		_load(dir,"alpha.dat",alpha_array,ENmax_alpha);
+		_load(dir,"gamma.dat",gamma_array,ENmax_gamma);
+		if (bins.open(dir?(std::string(dir)+(c.sparse_time?"/time.sdat":"/time.dat")).c_str():NULL,alpha_binN,gamma_binN,time_binN,c.time_cell_bits,mem?gamma_array+ENmax_gamma:NULL,c.sparse_time)) return -1;
+		st.alpha_thresh=c.alpha_thresh; st.step_alpha=c.step_alpha; st.ENmax_alpha=ENmax_alpha; st.alpha_array=alpha_array;
+		st.gamma_thresh=c.gamma_thresh; st.step_gamma=c.step_gamma; st.ENmax_gamma=ENmax_gamma; st.gamma_array=gamma_array;
+		st.N_alpha=0;
+		st.N_gamma=0;
+		st.last_time=0;
+		_process=select_kernel(st,c.alpha_edge,c.gamma_edge);		//specialized for this configuration
+		_process_ordered=select_ordered_kernel(st,c.alpha_edge,c.gamma_edge);
+		restart();
+		return 0;
+	}
+	
+	void restart()			//forget the open coincidence windows and the reorder stage (new, unrelated peak stream)
+	{
+		delete _coinc;
+		delete _rb;
+		_coinc=new coinc_engine(c.interval,&taxis,&bins);
+		_rb=new reorder_buf(2*c.interval);
+		st.coinc=_coinc;
+	}
+	
+	inline void push(const peak& pk)		//peaks may be out of chronological order by up to 2*interval
+	{
+		_rb->push(pk);
+		_process(st,*_rb);
+	}
+	
+	inline void push_ordered(const peak* pks, size_t n)	//peaks already in chronological order, the reorder stage is bypassed
+	{
+		_process_ordered(st,pks,n);
+	}
+	
+	void flush()					//end of stream, process everything still held in the reorder stage
+	{
+		_rb->flush();
+		_process(st,*_rb);
+	}
+	
+	inline void warm(const peak& pk)		//in chronological order: only opens the coincidence window, nothing is counted
+	{
+		if (pk.isalpha) _coinc->open_alpha(pk.time,(unsigned)(c.alpha_edge?c.alpha_thresh-pk.amp:pk.amp-c.alpha_thresh)/c.step_alpha);
+		else _coinc->open_gamma(pk.time,(unsigned)(c.gamma_edge?c.gamma_thresh-pk.amp:pk.amp-c.gamma_thresh)/c.step_gamma);
+	}
+	
+	const coinc_engine& coinc() const {return *_coinc;}
+	size_t in_reorder() const {return _rb->size();}
+	
+	void close()
+	{
+		delete _coinc; _coinc=NULL;
+		delete _rb; _rb=NULL;
+		if (!_extmem) {delete[] alpha_array; delete[] gamma_array;}
+		alpha_array=gamma_array=NULL;
+		bins.close();
+	}
+	
+	analysis_conf c;
+	unsigned ENmax_alpha, ENmax_gamma;
+	unsigned alpha_binN, gamma_binN, time_binN;
+	time_axis taxis;
+	uint64_t *alpha_array;
+	uint64_t *gamma_array;
+	time_hist bins;
+	event_state st;
+	
+private:
+	coinc_engine* _coinc;
+	reorder_buf* _rb;
+	kernel_fn _process;
+	ordered_fn _process_ordered;
+	bool _extmem;				//the histograms are in memory given to open()
+	
+	void _load(const char* dir, const char* fname, uint64_t* array, unsigned n)	//%uint32 or %uint64, told apart by the size
+	{
+		FILE* ifile=NULL;
+		if (dir) ifile=fopen((std::string(dir)+"/"+fname).c_str(),"rb");
+		size_t r=0;
+		if (ifile!=NULL) {
+			fseek(ifile,0,SEEK_END);
+			bool wide=(ftell(ifile)==(long)(n*sizeof(uint64_t)));
+			rewind(ifile);
+			if (wide) r=fread(array,sizeof(uint64_t),n,ifile);	// read existing file
+			else {
+				std::vector<uint32_t> tmp(n);
+				r=fread(tmp.data(),sizeof(uint32_t),n,ifile);
+				for (size_t i=0;i!=r;i++) array[i]=tmp[i];
+			}
+			fclose(ifile);
+		}
+		for (size_t i=r;i<n;i++) array[i]=0;		// else fill with 0
+	}
+};
@@ -0,0 +1,376 @@
+/*
+    Alpha Gamma Counter
+    Copyright (C) 2017  Mario Vretenar
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+#include <inttypes.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include "fpga.cpp"
+#include "ring.cpp"
+#include "reorder.cpp"
+#include "timehist.cpp"
+#include "coinc.cpp"
+#include "kernel.cpp"
+#include "conf.cpp"
+#include "analysis.cpp"
+
+using namespace std;
+
+// Benchmarks of the event processing done in main(): reorder stage, event kernel, energy
+// histograms and coincidence engine, fed from a synthetic source instead of the FPGA.
+// The kernel microbenchmark compares the generic (division) kernel with the one specialized
+// for power of two energy steps. The pipeline benchmark runs the analysis class over a grid
+// of interval, step and rate settings, each in its own process so peak memory can be measured.
+// Throughput can be saved as a baseline (-s) and later checked against it (-c), the program
+// then returns 1 if any setting got slower than the tolerance allows.
+// The readout benchmark (-r) runs the FIFO reader of agc against the emulator instead, polling and
+// sleeping until the FIFO interrupt, and reports its CPU use and the peaks lost in the FIFO.
+
+double _run_kernel(const vector<peak>& peaks, unsigned interval, unsigned step, bool generic, uint64_t* nbins)
+{
+	time_axis taxis; taxis.setup(interval,1,0);
+	unsigned ENmax=8192, binN=ENmax/step+1;
+	time_hist bins;
+	if (bins.open(NULL,binN,binN,taxis.size())) exit(-1);
+	vector<uint64_t> alpha_array(ENmax), gamma_array(ENmax);
+	coinc_engine coinc(interval,&taxis,&bins);
+	event_state st;
+	st.alpha_thresh=100; st.step_alpha=step; st.ENmax_alpha=ENmax; st.alpha_array=alpha_array.data();
+	st.gamma_thresh=-100; st.step_gamma=step; st.ENmax_gamma=ENmax; st.gamma_array=gamma_array.data();
+	st.coinc=&coinc;
+	st.N_alpha=0; st.N_gamma=0; st.last_time=0;
+	kernel_fn process=select_kernel(st,false,true,generic);
+	reorder_buf rb(2*interval);
+	
+	chrono::steady_clock::time_point t0=chrono::steady_clock::now();
+	for (size_t i=0;i!=peaks.size();i++){
+		rb.push(peaks[i]);
+		process(st,rb);
+	}
+	double dt=chrono::duration<double>(chrono::steady_clock::now()-t0).count();
+	
+	*nbins=0;
+	for (size_t k=0;k!=(size_t)binN*binN*taxis.size();k++) *nbins+=bins.bins[k];
+	return dt;
+}
+
+int _bench_kernel(size_t N)
+{
+	unsigned interval=1250;							//10 us
+	mt19937_64 rng(1);
+	vector<peak> peaks(N);
+	uint64_t t=0;
+	for (size_t i=0;i!=N;i++){						//~1 MHz total rate, alphas on a rising, gammas on a falling edge
+		t+=rng()%250;
+		peaks[i].time=t;
+		peaks[i].isalpha=rng()&1;
+		peaks[i].amp=peaks[i].isalpha?100+(int)(rng()%8000):-100-(int)(rng()%8000);
+	}
+	
+	printf("kernel microbenchmark, %zu peaks, interval %u cycles\n",N,interval);
+	unsigned steps[]={256,1024,8192};
+	for (int s=0;s!=3;s++){
+		uint64_t ng,ns;
+		double tg=_run_kernel(peaks,interval,steps[s],true,&ng);
+		double ts=_run_kernel(peaks,interval,steps[s],false,&ns);
+		printf("step %5u: generic %7.2lf Mpeaks/s, specialized %7.2lf Mpeaks/s, speedup %.2lfx%s\n",steps[s],N/tg/1e6,N/ts/1e6,tg/ts,(ng==ns)?"":" (COUNTS DIFFER!)");
+		if (ng!=ns) return 1;
+	}
+	return 0;
+}
+
+////--------------------------- pipeline benchmark ---------------------------////
+
+struct bench_point{
+	unsigned interval;		//clock cycles
+	unsigned step;			//step_alpha and step_gamma
+	double rate;			//total peaks per second
+	unsigned cellbits;		//time histogram cells
+};
+
+struct bench_result{
+	double eps;			//events (peaks) per second
+	double p50, p99, p999, max;	//per peak processing latency, ns
+	long mem;			//peak memory of the pipeline, kB
+};
+
+analysis_conf _bench_conf(const bench_point& bp)
+{
+	analysis_conf c;
+	c.alpha_thresh=100; c.alpha_edge=false; c.alpha_max=8191;		//alphas on a rising, gammas on a falling edge
+	c.gamma_thresh=-100; c.gamma_edge=true; c.gamma_max=-8192;
+	c.interval=bp.interval;
+	c.step_alpha=bp.step; c.step_gamma=bp.step;
+	c.time_binwidth=1; c.time_logbins=0;
+	c.time_cell_bits=bp.cellbits; c.wide_spectra=false; c.sparse_time=false;
+	return c;
+}
+
+void _gen_stream(double rate, size_t N, vector<peak>& peaks)	//peaks in the order the FPGA would store them
+{
+	source_conf sc;
+	sc.rate_alpha=rate/2;
+	sc.cascade_prob=0.36;							//Am-241: 59.5 keV gamma
+	sc.rate_gamma=rate/2-sc.cascade_prob*sc.rate_alpha;
+	sc.cascade_tau=8.4;							//67 ns
+	sc.alpha_amp=3000; sc.alpha_sigma=100;
+	sc.gamma_amp=1500; sc.gamma_sigma=50;
+	sc.flat=0.2;
+	cascade_source src(sc);
+	src.reset();
+	peaks.resize(N);
+	vector<pair<uint64_t,size_t> > order(N);
+	for (size_t i=0;i!=N;i++){
+		peaks[i]=src.next(100,false,-100,true);
+		order[i]=make_pair(emu_peak_end(peaks[i],1250),i);
+	}
+	sort(order.begin(),order.end());
+	vector<peak> stored(N);
+	for (size_t i=0;i!=N;i++) stored[i]=peaks[order[i].second];
+	peaks.swap(stored);
+}
+
+long _rss()	//current resident memory, kB
+{
+	long pages=0, rss=0;
+	FILE* f=fopen("/proc/self/statm","r");
+	if (f==NULL) return 0;
+	if (fscanf(f,"%ld %ld",&pages,&rss)!=2) rss=0;
+	fclose(f);
+	return rss*(sysconf(_SC_PAGESIZE)/1024);
+}
+
+int _run_pipeline(const bench_point& bp, const vector<peak>& peaks, bench_result* res)	//in a child process, returns 0 on success
+{
+	int fd[2];
+	if (pipe(fd)) {fprintf(stderr, "pipe() failed: %s\n", strerror(errno)); return -1;}
+	pid_t pid=fork();
+	if (pid<0) {fprintf(stderr, "fork() failed: %s\n", strerror(errno)); return -1;}
+	if (pid==0){
+		close(fd[0]);
+		long mem0=_rss();
+		bench_result r;
+		analysis an;
+		if (an.setup(_bench_conf(bp)) || an.open(NULL)) _exit(1);
+		
+		chrono::steady_clock::time_point t0=chrono::steady_clock::now();	//throughput, no timing inside the loop
+		for (size_t i=0;i!=peaks.size();i++) an.push(peaks[i]);
+		an.flush();
+		r.eps=peaks.size()/chrono::duration<double>(chrono::steady_clock::now()-t0).count();
+		
+		an.close();								//latency, every push timed
+		if (an.open(NULL)) _exit(1);
+		vector<float> lat(peaks.size());
+		for (size_t i=0;i!=peaks.size();i++){
+			chrono::steady_clock::time_point t=chrono::steady_clock::now();
+			an.push(peaks[i]);
+			lat[i]=chrono::duration<float,nano>(chrono::steady_clock::now()-t).count();
+		}
+		an.flush();
+		sort(lat.begin(),lat.end());
+		r.p50=lat[lat.size()/2];
+		r.p99=lat[lat.size()*99/100];
+		r.p999=lat[lat.size()*999/1000];
+		r.max=lat.back();
+		
+		struct rusage ru;
+		getrusage(RUSAGE_SELF,&ru);
+		r.mem=ru.ru_maxrss-mem0;
+		if (write(fd[1],&r,sizeof(r))!=sizeof(r)) _exit(1);
+		_exit(0);
+	}
+	close(fd[1]);
+	ssize_t n=read(fd[0],res,sizeof(*res));
+	close(fd[0]);
+	int status;
+	waitpid(pid,&status,0);
+	if (n!=sizeof(*res) || !WIFEXITED(status) || WEXITSTATUS(status)!=0) {fprintf(stderr, "Benchmark process failed.\n"); return -1;}
+	return 0;
+}
+
+int _bench_pipeline(size_t N, const char* save, const char* check, double tolerance, unsigned cellbits)
+{
+	unsigned intervals[]={625,2500};					//5 us, 20 us
+	unsigned steps[]={256,1000};						//power of two and generic kernel
+	double rates[]={1e5,1e6};
+	
+	vector<pair<string,double> > baseline;
+	if (check){
+		FILE* f=fopen(check,"r");
+		if (f==NULL) {fprintf(stderr, "Cannot open baseline file %s: %s\n", check, strerror(errno)); return -1;}
+		char key[64]; double eps;
+		while (fscanf(f,"%63s %lf",key,&eps)==2) baseline.push_back(make_pair(string(key),eps));
+		fclose(f);
+	}
+	FILE* out=NULL;
+	if (save){
+		out=fopen(save,"w");
+		if (out==NULL) {fprintf(stderr, "Cannot open baseline file %s: %s\n", save, strerror(errno)); return -1;}
+	}
+	
+	printf("\npipeline benchmark, %zu peaks per setting\n",N);
+	printf("interval  step     rate   Mpeaks/s   p50[ns]   p99[ns] p99.9[ns]   max[ns]   mem[kB]\n");
+	int regressed=0;
+	for (int r=0;r!=2;r++){
+		vector<peak> peaks;
+		_gen_stream(rates[r],N,peaks);
+		for (int i=0;i!=2;i++) for (int s=0;s!=2;s++){
+			bench_point bp={intervals[i],steps[s],rates[r],cellbits};
+			bench_result res;
+			if (_run_pipeline(bp,peaks,&res)) return -1;
+			char key[64];
+			sprintf(key,"i%u_s%u_r%.0lf",bp.interval,bp.step,bp.rate);
+			if (cellbits!=32) sprintf(key+strlen(key),"_b%u",cellbits);
+			printf("%8u %5u %8.0lf %10.3lf %9.0lf %9.0lf %9.0lf %9.0lf %9ld",bp.interval,bp.step,bp.rate,res.eps/1e6,res.p50,res.p99,res.p999,res.max,res.mem);
+			for (size_t k=0;k!=baseline.size();k++) if (baseline[k].first==key){
+				double rel=res.eps/baseline[k].second;
+				printf("  %+.1lf%%%s",(rel-1)*100,(rel<1-tolerance)?" REGRESSION":"");
+				if (rel<1-tolerance) regressed++;
+			}
+			printf("\n");
+			if (out) fprintf(out,"%s %.0lf\n",key,res.eps);
+		}
+	}
+	if (out) fclose(out);
+	if (regressed) printf("%d settings regressed by more than %.0lf%%.\n",regressed,tolerance*100);
+	return regressed?1:0;
+}
+
+////--------------------------- readout benchmark ----------------------------////
+
+enum {READOUT_SINGLE, READOUT_POLL, READOUT_IRQ};
+const char* readout_names[]={"single","poll","irq"};
+
+struct readout_result{
+	double cpu;		//of the whole process but the emulator, fraction of a core
+	double loss;		//fraction of the peaks
+	double mmio;		//register reads per peak read
+	double wakeups;		//interrupts per second
+};
+
+double _process_cpu()		//user and system seconds of all threads so far
+{
+	struct rusage ru;
+	if (getrusage(RUSAGE_SELF,&ru)) return 0;
+	return ru.ru_utime.tv_sec+ru.ru_utime.tv_usec*1e-6+ru.ru_stime.tv_sec+ru.ru_stime.tv_usec*1e-6;
+}
+
+int _run_readout(double rate, int mode, double seconds, readout_result* res)	//returns 0 on success
+{
+	if (AGC_init_emu(rate/2,rate/2)) return -1;
+	AGC_setup(100,100,false,false,0,0);
+	if (mode==READOUT_IRQ && AGC_irq_init(AGC_get_fifo_size()/8)) {AGC_exit(); return -1;}
+	uint64_t irqs0=AGC_stat_irqs;
+	AGC_reset_fifo();
+	uint64_t reads0=AGC_emu->num_reads();
+	atomic<bool> stop(false);
+	uint64_t read=0;
+	spsc_ring<peak> ring(1<<16);
+	double cpu0=_process_cpu()-AGC_emu->cpu_time();
+	thread reader([&](){
+		peak buf[AGC_FIFO_SIZE];
+		unsigned idle=0;
+		while (!stop.load(memory_order_relaxed)){
+			if (mode==READOUT_SINGLE){				//the original loop: one AGC_get_sample per pass, never sleeps
+				if (!AGC_get_sample(&buf[0].isalpha,&buf[0].amp,&buf[0].time)) read++;
+				continue;
+			}
+			int n=AGC_get_samples(buf,AGC_FIFO_SIZE);		//as reader_fun in agc.cpp
+			if (n==0) {AGC_wait(idle++); continue;}
+			idle=0;
+			for (int i=0;i!=n;i++)
+				while (ring.push(buf[i])) if (stop.load(memory_order_relaxed)) return;
+			ring.notify();
+		}
+	});
+	thread consumer([&](){					//as the processing loop in agc.cpp, without the processing
+		if (mode==READOUT_SINGLE) return;
+		peak pk;
+		unsigned idle=0;
+		while (!stop.load(memory_order_relaxed)){
+			if (!ring.pop(&pk)) {idle=0; read++;}
+			else ring.wait(idle++,200);
+		}
+	});
+	usleep(seconds*1e6);
+	stop=true;
+	reader.join();
+	consumer.join();
+	double cpu_s=_process_cpu()-AGC_emu->cpu_time()-cpu0;	//the emulator thread stands in for the FPGA, it is left out
+	uint64_t reads=AGC_emu->num_reads()-reads0;
+	uint64_t lost=AGC_get_num_lost();
+	res->cpu=cpu_s/seconds;
+	res->loss=(read+lost)?(double)lost/(read+lost):0;
+	res->mmio=read?(double)reads/read:0;
+	res->wakeups=(AGC_stat_irqs-irqs0)/seconds;
+	AGC_exit();
+	return 0;
+}
+int _bench_readout(double seconds)
+{
+	double rates[]={1e3,1e4,1e5,3e5};
+	printf("readout benchmark on the emulator, %.1lf s per setting, watermark FIFO size/8\n",seconds);
+	printf("single: one peak per poll as the original loop, poll: batched with back-off, irq: waits for the FIFO interrupt\n");
+	printf("    rate  readout     CPU[%%]    loss[%%]  MMIO reads/peak  interrupts/s\n");
+	for (int r=0;r!=4;r++) for (int m=READOUT_SINGLE;m<=READOUT_IRQ;m++){
+		readout_result res;
+		if (_run_readout(rates[r],m,seconds,&res)) {fprintf(stderr, "Readout benchmark failed.\n"); return -1;}
+		printf("%8.0lf  %-7s %10.2lf %10.4lf %16.2lf %13.0lf\n",rates[r],readout_names[m],res.cpu*100,res.loss*100,res.mmio,res.wakeups);
+	}
+	return 0;
+}
+
+int main(int argc,char *argv[]){
+	size_t N=1000000;
+	const char* save=NULL;
+	const char* check=NULL;
+	double tolerance=0.1;
+	unsigned cellbits=32;
+	double readout=0;
+	for (int i=1;i<argc;i++){
+		if (!strcmp(argv[i],"-s") && i+1<argc) save=argv[++i];
+		else if (!strcmp(argv[i],"-c") && i+1<argc) check=argv[++i];
+		else if (!strcmp(argv[i],"-t") && i+1<argc) tolerance=atof(argv[++i]);
+		else if (!strcmp(argv[i],"-b") && i+1<argc) cellbits=atoi(argv[++i]);
+		else if (!strcmp(argv[i],"-r") && i+1<argc) readout=atof(argv[++i]);
+		else if (argv[i][0]!='-') N=atol(argv[i]);
+		else {
+			printf("Usage: %s [peaks] [-s baseline_file] [-c baseline_file] [-t tolerance] [-b time_cell_bits] [-r seconds]\n"
+			       " -s saves the throughput of every setting, -c compares with a saved baseline and returns 1 if\n"
+			       " any setting is slower by more than tolerance (default 0.1). -b runs the pipeline with 8 or 16 bit\n"
+			       " time histogram cells. -r runs the readout benchmark instead, for the given seconds per setting.\n",argv[0]);
+			return 0;
+		}
+	}
+	if (readout>0) return _bench_readout(readout)?1:0;
+	if (_bench_kernel(N)) return 1;
+	if (cellbits!=8 && cellbits!=16 && cellbits!=32) {printf("time_cell_bits must be 8, 16 or 32.\n"); return -1;}
+	return _bench_pipeline(N,save,check,tolerance,cellbits);
+}
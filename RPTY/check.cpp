@@ -0,0 +1,390 @@
+/*
+    Alpha Gamma Counter
+    Copyright (C) 2017  Mario Vretenar
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include <deque>
+#include <random>
+#include <algorithm>
+#include <inttypes.h>
+#include "fpga.cpp"
+#include "reorder.cpp"
+#include "timehist.cpp"
+#include "coinc.cpp"
+#include "kernel.cpp"
+#include "checkpoint.cpp"
+
+// Checks that the rewritten processing stages give exactly the results of the loops in agc.cpp
+// they replaced (kept here as reference implementations), on randomized peak streams, and that
+// spectrum mode gives the same results as reading every peak, on the same emulated peaks, and
+// that checkpoints of histograms in shared memory save what they held when the checkpoint started.
+// Returns 0 if all checks pass, run by ctest.
+
+using namespace std;
+
+bool _ref_order(const peak& a, const peak& b)	//sortfun of the old loop (alphas first on equal timestamps), as a strict weak ordering
+{
+	if (a.time==b.time) return (a.isalpha && !b.isalpha);
+	return (a.time<b.time);
+}
+
+bool _id_order(const peak& a, const peak& b)	//also orders peaks with the same timestamp and type, by their amp (unique here)
+{
+	if (a.time!=b.time || a.isalpha!=b.isalpha) return _ref_order(a,b);
+	return (a.amp<b.amp);
+}
+
+vector<peak> _random_stream(mt19937_64& rng, size_t n, uint64_t maxgap, uint64_t jitter)	//peaks up to jitter cycles out of order, amp is a unique id
+{
+	vector<peak> s(n);
+	uint64_t t=jitter;
+	for (size_t i=0;i!=n;i++){
+		t+=rng()%(maxgap+1);
+		s[i].time=t-rng()%(jitter+1);
+		s[i].amp=i;
+		s[i].isalpha=rng()&1;
+	}
+	return s;
+}
+
+int _check_reorder(mt19937_64& rng)		//reorder_buf against the deque sorted on every peak
+{
+	const uint64_t windows[]={1,10,1250,100000};
+	int err=0;
+	for (unsigned w=0;w!=sizeof(windows)/sizeof(windows[0]);w++){
+		uint64_t window=windows[w];
+		for (unsigned trial=0;trial!=20;trial++){
+			vector<peak> s=_random_stream(rng,20000,trial%2?window/4+1:window*3,trial%3?window:window/2);
+			reorder_buf rb(window);
+			deque<peak> ref;
+			size_t released=0;
+			for (size_t i=0;i!=s.size() && !err;i++){
+				vector<peak> a, b;
+				rb.push(s[i]);
+				peak p;
+				while (!rb.pop(&p)) a.push_back(p);
+				ref.push_back(s[i]);
+				sort(ref.begin(),ref.end(),_ref_order);
+				while (!ref.empty() && ref.back().time>ref.front().time+window) {b.push_back(ref.front()); ref.pop_front();}
+				if (a.size()!=b.size() || rb.size()!=ref.size()) {printf("reorder: window %" PRIu64", peak %zu: %zu released (old loop %zu)\n",window,i,a.size(),b.size()); err++; break;}
+				for (size_t k=0;k!=a.size();k++)
+					if (a[k].time!=b[k].time || a[k].isalpha!=b[k].isalpha) {printf("reorder: window %" PRIu64", peak %zu: different order\n",window,i); err++; break;}
+				sort(a.begin(),a.end(),_id_order);			//same peaks, equal timestamps of one type may come in any order
+				sort(b.begin(),b.end(),_id_order);
+				for (size_t k=0;k!=a.size() && !err;k++)
+					if (a[k].amp!=b[k].amp) {printf("reorder: window %" PRIu64", peak %zu: different peaks released\n",window,i); err++;}
+				released+=a.size();
+			}
+			if (!err && released==0) {printf("reorder: window %" PRIu64": nothing released\n",window); err++;}
+		}
+	}
+	printf("reorder: %s\n",err?"FAILED":"same order as the old loop");
+	return err;
+}
+
+struct _ref_coinc{				//the active_trig loop of the old agc.cpp, into a dense [alpha bin][gamma bin][2*interval] array
+	_ref_coinc(unsigned interval, unsigned abinN, unsigned gbinN): interval(interval), abinN(abinN), gbinN(gbinN), bins((size_t)abinN*gbinN*2*interval,0) {}
+	
+	void push(uint64_t timestamp, unsigned ebin, bool isalpha)
+	{
+		peak p; p.time=timestamp; p.amp=ebin; p.isalpha=isalpha;
+		if (isalpha) active_trig_alpha.push_back(p);
+		else active_trig_gamma.push_back(p);
+		if (!isalpha){
+			for (size_t j=0;j!=active_trig_alpha.size();j++){
+				if (timestamp>=active_trig_alpha[j].time+interval){
+					active_trig_alpha.pop_front();
+					j--;
+				}else{
+					unsigned a=active_trig_alpha[j].amp, b=ebin;
+					if ((interval+(timestamp-active_trig_alpha[j].time))<2*interval)
+						if ((a<abinN)&&(b<gbinN))
+							bins[((size_t)a*gbinN+b)*2*interval+interval+(timestamp-active_trig_alpha[j].time)]++;
+				}
+			}
+		}else{
+			for (size_t j=0;j!=active_trig_gamma.size();j++){
+				if (timestamp>active_trig_gamma[j].time+interval){
+					active_trig_gamma.pop_front();
+					j--;
+				}else{
+					unsigned a=ebin, b=active_trig_gamma[j].amp;
+					if ((interval-(timestamp-active_trig_gamma[j].time))<=interval)
+						if ((a<abinN)&&(b<gbinN))
+							bins[((size_t)a*gbinN+b)*2*interval+interval-(timestamp-active_trig_gamma[j].time)]++;
+				}
+			}
+		}
+	}
+	
+	unsigned interval, abinN, gbinN;
+	deque<peak> active_trig_alpha, active_trig_gamma;
+	vector<unsigned> bins;
+};
+
+int _compare_coinc(const _ref_coinc& ref, const time_hist& th)	//returns the number of differing time bins
+{
+	int diff=0;
+	vector<unsigned> buf(th.tN);
+	for (size_t c=0;c!=(size_t)th.alpha_binN*th.gamma_binN;c++){
+		const unsigned* r=th.row(c,buf.data());
+		for (unsigned k=0;k!=th.tN;k++) diff+=(r[k]!=ref.bins[c*th.tN+k]);
+	}
+	return diff;
+}
+
+int _check_coinc_boundaries()		//pairs exactly interval apart: counted for gamma before alpha, not for alpha before gamma
+{
+	const unsigned interval=10;
+	time_axis ta; ta.setup(interval,1,0);
+	time_hist th; th.open(NULL,1,1,ta.size());
+	coinc_engine ce(interval,&ta,&th);
+	_ref_coinc ref(interval,1,1);
+	const uint64_t t[]={100,100+interval-1,100+interval, 1000,1000+interval, 2000,2000+interval+1};
+	const bool a[]={true,false,false, false,true, false,true};
+	for (int i=0;i!=7;i++){
+		if (a[i]) ce.add_alpha(t[i],0);
+		else ce.add_gamma(t[i],0);
+		ref.push(t[i],0,a[i]);
+	}
+	int err=0;
+	const unsigned* r=th.row(0,NULL);
+	if (r[2*interval-1]!=1) {printf("coinc: gamma interval-1 after an alpha not counted\n"); err++;}	//bin interval+interval-1
+	if (r[0]!=1) {printf("coinc: gamma interval before an alpha not counted\n"); err++;}		//bin interval-interval
+	unsigned total=0;
+	for (unsigned k=0;k!=th.tN;k++) total+=r[k];
+	if (total!=2) {printf("coinc: %u pairs counted at the window boundaries, expected 2\n",total); err++;}
+	if (_compare_coinc(ref,th)) {printf("coinc: window boundaries differ from the old loop\n"); err++;}
+	return err;
+}
+
+int _check_coinc(mt19937_64& rng)		//coinc_engine against the old active_trig loop, default time axis
+{
+	const unsigned intervals[]={1,2,7,100};
+	int err=_check_coinc_boundaries();
+	uint64_t pairs=0;
+	for (unsigned i=0;i!=sizeof(intervals)/sizeof(intervals[0]) && !err;i++){
+		unsigned interval=intervals[i];
+		for (unsigned trial=0;trial!=10 && !err;trial++){
+			const unsigned abinN=3, gbinN=4;
+			time_axis ta; ta.setup(interval,1,0);
+			time_hist th; th.open(NULL,abinN,gbinN,ta.size());
+			coinc_engine ce(interval,&ta,&th);
+			_ref_coinc ref(interval,abinN,gbinN);
+			vector<peak> s=_random_stream(rng,20000,trial%2?interval+1:interval/4+1,0);	//in order, gaps around the interval hit the boundaries
+			for (size_t k=0;k!=s.size();k++){
+				unsigned ebin=rng()%(trial%3?abinN+1:gbinN+2);			//some outside the histogram
+				if (s[k].isalpha) ce.add_alpha(s[k].time,ebin);
+				else ce.add_gamma(s[k].time,ebin);
+				ref.push(s[k].time,ebin,s[k].isalpha);
+			}
+			int d=_compare_coinc(ref,th);
+			if (d) {printf("coinc: interval %u: %d time bins differ from the old loop\n",interval,d); err++;}
+			for (size_t c=0;c!=ref.bins.size();c++) pairs+=ref.bins[c];
+		}
+	}
+	if (!err && pairs==0) {printf("coinc: no pairs counted\n"); err++;}
+	printf("coinc: %s\n",err?"FAILED":"same time histogram as the old loop");
+	return err;
+}
+
+class _ending_source: public agc_source{	//the peaks of src that start before end
+public:
+	_ending_source(agc_source* src, uint64_t end): src(src), end(end) {}
+	~_ending_source() {delete src;}
+	void reset() {src->reset();}
+	peak next(int thresh_alpha, bool falling_alpha, int thresh_gamma, bool falling_gamma)
+	{
+		peak pk=src->next(thresh_alpha,falling_alpha,thresh_gamma,falling_gamma);
+		if (pk.time>=end) pk.time=UINT64_MAX/2;
+		return pk;
+	}
+private:
+	agc_source* src;
+	uint64_t end;
+};
+
+struct _spec_run{
+	vector<unsigned> time;			//time histogram, cell after cell
+	vector<uint64_t> alpha, gamma;		//energy spectra
+	uint64_t N_alpha, N_gamma;
+	uint32_t lost, filtered;
+};
+
+int _spectrum_run(unsigned interval, bool spectrum, _spec_run* r)	//an emulated acquisition read like agc.cpp does, the same peaks every time
+{
+	const int thresh=100;
+	const unsigned ENmax=8191-thresh+1, step=1024, binN=ENmax/step+1;
+	const uint64_t end=125000000/2;						//0.5 s
+	source_conf sc={20000,20000,0.5,interval/2.0,3000,200,4000,300,0.2};
+	_emu_src=new _ending_source(new cascade_source(sc),end);
+	AGC_emu=new agc_emu(_emu_src,true);
+	AGC_setup(thresh,thresh,false,false,125,125);
+	if (spectrum) {if (AGC_spectrum_init(interval,3*interval)) {AGC_exit(); return -1;}}
+	else AGC_reset_fifo();
+	
+	time_axis ta; ta.setup(interval,1,0);
+	time_hist th;
+	if (th.open(NULL,binN,binN,ta.size())) {AGC_exit(); return -1;}
+	coinc_engine ce(interval,&ta,&th);
+	r->alpha.assign(ENmax,0);
+	r->gamma.assign(ENmax,0);
+	event_state st;
+	st.alpha_thresh=thresh; st.step_alpha=step; st.ENmax_alpha=spectrum?0:ENmax; st.alpha_array=r->alpha.data();	//as agc.cpp: the FPGA counts the spectra
+	st.gamma_thresh=thresh; st.step_gamma=step; st.ENmax_gamma=spectrum?0:ENmax; st.gamma_array=r->gamma.data();
+	st.coinc=&ce;
+	st.N_alpha=0; st.N_gamma=0; st.last_time=0;
+	kernel_fn process=select_kernel(st,false,false);
+	reorder_buf rb(2*interval);
+	
+	peak buf[AGC_FIFO_SIZE];
+	for (uint64_t t=0;t<end+100*(uint64_t)interval+100000;t+=500){		//past the end, so every peak is stored, decided and read
+		AGC_emu->advance(500);
+		for (int n;(n=AGC_get_samples(buf,AGC_FIFO_SIZE))>0;){
+			for (int i=0;i!=n;i++) rb.push(buf[i]);
+			process(st,rb);
+		}
+	}
+	rb.flush();
+	process(st,rb);
+	
+	if (spectrum){
+		AGC_spectrum_read();
+		AGC_spectrum_merge(r->alpha.data(),ENmax,thresh,false,r->gamma.data(),ENmax,thresh,false);
+		AGC_spectrum_counts();
+		r->N_alpha=AGC_spec_alpha;
+		r->N_gamma=AGC_spec_gamma;
+	}
+	else {r->N_alpha=st.N_alpha; r->N_gamma=st.N_gamma;}
+	r->lost=AGC_get_num_lost();
+	r->filtered=AGC_RD(spec_filtered);
+	r->time.clear();
+	vector<unsigned> row(th.tN);
+	for (size_t c=0;c!=(size_t)th.alpha_binN*th.gamma_binN;c++){
+		const unsigned* p=th.row(c,row.data());
+		r->time.insert(r->time.end(),p,p+th.tN);
+	}
+	AGC_exit();
+	return 0;
+}
+
+int _check_spectrum()		//spectrum mode against reading every peak: same coincidences and spectra from the same emulated peaks
+{
+	const unsigned intervals[]={125,1250};
+	int err=0;
+	for (unsigned i=0;i!=sizeof(intervals)/sizeof(intervals[0]) && !err;i++){
+		unsigned interval=intervals[i];
+		_spec_run all, flt;
+		if (_spectrum_run(interval,false,&all) || _spectrum_run(interval,true,&flt)) {printf("spectrum: emulated run failed\n"); err++; break;}
+		uint64_t pairs=0;
+		int d=0;
+		for (size_t k=0;k!=all.time.size();k++) {pairs+=all.time[k]; d+=(all.time[k]!=flt.time[k]);}
+		if (all.lost || flt.lost) {printf("spectrum: interval %u: %u and %u peaks lost in the emulator\n",interval,all.lost,flt.lost); err++;}
+		if (!pairs || !flt.filtered) {printf("spectrum: interval %u: %" PRIu64 " pairs, %u peaks filtered, nothing to compare\n",interval,pairs,flt.filtered); err++;}
+		if (d) {printf("spectrum: interval %u: %d time bins differ with the filter on\n",interval,d); err++;}
+		if (all.alpha!=flt.alpha || all.gamma!=flt.gamma) {printf("spectrum: interval %u: the FPGA spectra differ from the kernel spectra\n",interval); err++;}
+		if (all.N_alpha!=flt.N_alpha || all.N_gamma!=flt.N_gamma) {printf("spectrum: interval %u: FPGA counts %" PRIu64 "/%" PRIu64 ", kernel counts %" PRIu64 "/%" PRIu64 "\n",interval,flt.N_alpha,flt.N_gamma,all.N_alpha,all.N_gamma); err++;}
+		if (!err) printf("spectrum: interval %u: %" PRIu64 " pairs, %u of %" PRIu64 " peaks filtered\n",interval,pairs,flt.filtered,all.N_alpha+all.N_gamma);
+	}
+	printf("spectrum: %s\n",err?"FAILED":"same coincidences and spectra with the filter on and off");
+	return err;
+}
+
+int _check_checkpoint_files(const string& dir, const time_hist& th, const vector<unsigned>& rows)	//time.dat or time.sdat and timesum.dat against rows (then timesum), returns 0 if equal
+{
+	size_t ncells=(size_t)th.alpha_binN*th.gamma_binN;
+	vector<unsigned> disk(rows.size()), buf(th.tN);
+	if (th.sparse){
+		tsparse_reader r;
+		if (r.open((dir+"/time.sdat").c_str())) return -1;
+		for (size_t c=0;c!=ncells;c++){
+			if (r.cell(c,buf.data())) return -1;
+			copy(buf.begin(),buf.end(),disk.begin()+c*th.tN);
+		}
+	}
+	else{
+		int fd=open((dir+"/time.dat").c_str(),O_RDONLY);
+		if (fd<0 || _read_all(fd,disk.data(),ncells*th.tN*sizeof(unsigned))) {if (fd>=0) close(fd); return -1;}
+		close(fd);
+	}
+	int fd=open((dir+"/timesum.dat").c_str(),O_RDONLY);
+	if (fd<0 || _read_all(fd,disk.data()+ncells*th.tN,th.tN*sizeof(unsigned))) {if (fd>=0) close(fd); return -1;}
+	close(fd);
+	return (disk==rows)?0:-1;
+}
+
+int _check_checkpoint(mt19937_64& rng)	//checkpoints from shared memory, while the parent goes on changing it
+{
+	const bool sparse[]={false,true,true,false};
+	const unsigned cbits[]={32,32,16,8};
+	const unsigned abinN=6, gbinN=5, tN=50, ENmax=100;
+	int err=0;
+	for (unsigned v=0;v!=4 && !err;v++){
+		char dtmp[]="/tmp/agc-check.XXXXXX";
+		if (mkdtemp(dtmp)==NULL) {printf("checkpoint: mkdtemp() failed: %s\n",strerror(errno)); return 1;}
+		string dir=dtmp;
+		size_t memsize=time_hist::mem_size(abinN,gbinN,tN,cbits[v])+2*ENmax*sizeof(uint64_t);
+		void* mem=mmap(NULL,memsize,PROT_READ | PROT_WRITE,MAP_SHARED | MAP_ANONYMOUS,-1,0);		//not copy-on-write, like the shm segment
+		if (mem==MAP_FAILED) {printf("checkpoint: mmap() failed: %s\n",strerror(errno)); rmdir(dir.c_str()); return 1;}
+		uint64_t* alpha=(uint64_t*)mem;
+		uint64_t* gamma=alpha+ENmax;
+		time_hist th;
+		if (th.open((dir+(sparse[v]?"/time.sdat":"/time.dat")).c_str(),abinN,gbinN,tN,cbits[v],gamma+ENmax,sparse[v])) {printf("checkpoint: open failed\n"); err++; break;}
+		ckpt_src src;
+		src.alpha_array=alpha; src.ENmax_alpha=ENmax;
+		src.gamma_array=gamma; src.ENmax_gamma=ENmax;
+		src.wide=false;
+		src.bins=&th;
+		src.shared=mem;
+		src.elapsed=0;
+		checkpointer writer;
+		for (unsigned round=0;round!=5 && !err;round++){
+			unsigned a0=1+round%(abinN-1);				//a few cells per round, the others stay as in the last checkpoint
+			for (unsigned k=0;k!=(round?300u:70000u);k++){	//the first round wraps the compact cells around
+				th.inc(a0,1+rng()%2,rng()%tN);
+				alpha[rng()%ENmax]++;
+			}
+			vector<unsigned> rows, buf(tN);
+			for (size_t c=0;c!=(size_t)abinN*gbinN;c++) {const unsigned* r=th.row(c,buf.data()); rows.insert(rows.end(),r,r+tN);}
+			rows.insert(rows.end(),th.timesum,th.timesum+tN);
+			src.duration="round "+to_string(round)+"\n";
+			if (writer.start(src,dir)) {printf("checkpoint: start failed\n"); err++; break;}
+			for (unsigned k=0;k!=20000;k++) th.inc(0,0,rng()%tN);	//after the copy, must not be in this checkpoint
+			writer.wait();
+			if (_check_checkpoint_files(dir,th,rows)) {printf("checkpoint: %u bit%s cells, round %u: files differ from the histogram at the start of the checkpoint\n",cbits[v],sparse[v]?" sparse":"",round); err++;}
+		}
+		const char* files[]={"alpha.dat","gamma.dat","timesum.dat","alphaproj.dat","gammaproj.dat","duration.txt","time.dat","time.sdat"};
+		for (unsigned f=0;f!=sizeof(files)/sizeof(files[0]);f++) unlink((dir+"/"+files[f]).c_str());
+		rmdir(dir.c_str());
+		th.close();
+		munmap(mem,memsize);
+	}
+	printf("checkpoint: %s\n",err?"FAILED":"shared memory checkpoints hold the histogram at their start");
+	return err;
+}
+
+int main(){
+	mt19937_64 rng(1);
+	int err=0;
+	err+=_check_reorder(rng);
+	err+=_check_coinc(rng);
+	err+=_check_spectrum();
+	err+=_check_checkpoint(rng);
+	return err?1:0;
+}
@@ -0,0 +1,341 @@
+/*
+    Alpha Gamma Counter
+    Copyright (C) 2017  Mario Vretenar
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstddef>
+#include <cstdio>
+#include <cerrno>
+#include <cstring>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+
+////------------------------------- checkpoints ------------------------------////
+// A checkpoint first writes everything that changed into a journal (checkpoint.jnl): the
+// energy spectra, timesum and the time projections, the new content of duration.txt and the time histogram cells marked
+// dirty. The rename of the finished journal is the commit point. The journal is then applied:
+// cells are written into time.dat in place and the other files are replaced through
+// write-to-temp-then-rename. A journal found at startup (crash during apply) is applied again,
+// so the files on disk always correspond to exactly one checkpoint and its elapsed time.
+// With a sparse time histogram (time.sdat) the journal has no cells. The whole time.sdat.new is
+// written and synced before the journal instead, and applying the journal renames it to time.sdat.
+// During acquisition checkpoints are written by a forked low priority process, which gets a
+// copy-on-write snapshot of all arrays for free and never blocks the processing thread.
+// The parent is multithreaded, so the child must not need a lock another thread may have held at
+// fork(): files are written with plain system calls, no stdio. The child does allocate (std::vector,
+// std::string), which POSIX does not promise to be safe after fork(), but glibc resets its malloc
+// locks in the child (the Red Pitaya images and the usual Linux distributions use glibc).
+// Shared memory (the live export, see shm.cpp) is not copy-on-write: the child first copies what
+// the journal needs (spectra, projections and the dirty cells, _ckpt_copy) and the parent waits
+// only for that. With a sparse time histogram the cells that are not dirty are taken from the
+// time.sdat of the previous checkpoint, they have not changed since.
+
+#define CKPT_MAGIC 0x4C434741		//"AGCL"
+#define CKPT_MAGIC_V2 0x4B434741	//"AGCK", journals with %uint32 spectra only
+#define CKPT_MAGIC_V1 0x4A434741	//"AGCJ", journals without the projections
+#define CKPT_SPARSE 1			//flag: time.sdat.new holds the time histogram
+
+struct ckpt_src{
+	const uint64_t *alpha_array; unsigned ENmax_alpha;
+	const uint64_t *gamma_array; unsigned ENmax_gamma;
+	bool wide;			//spectra as %uint64
+	time_hist *bins;
+	void* shared;			//shared memory the arrays are in, NULL if none
+	uint64_t elapsed;		//clock cycles, informational
+	std::string duration;		//full new content of duration.txt
+};
+
+struct _ckpt_header{
+	uint32_t magic;
+	uint32_t ENmax_alpha, ENmax_gamma;
+	uint32_t tN, ncells;
+	uint32_t durlen;
+	uint64_t elapsed;
+	uint32_t alpha_binN, gamma_binN;	//not in CKPT_MAGIC_V1 journals
+	uint32_t spec_width, flags;		//bytes per spectrum bin and CKPT_ flags, not in CKPT_MAGIC_V2 and V1 journals
+};
+
+int _write_all(int fd, const void* buf, size_t n)
+{
+	const char* p=(const char*)buf;
+	while (n){
+		ssize_t r=write(fd,p,n);
+		if (r<0) {if (errno==EINTR) continue; return -1;}
+		p+=r; n-=r;
+	}
+	return 0;
+}
+
+int _read_all(int fd, void* buf, size_t n)
+{
+	char* p=(char*)buf;
+	while (n){
+		ssize_t r=read(fd,p,n);
+		if (r<0) {if (errno==EINTR) continue; return -1;}
+		if (r==0) return -1;
+		p+=r; n-=r;
+	}
+	return 0;
+}
+
+int _rename_synced(const std::string& from, const std::string& to)	//rename, then fsync the directory so the rename itself survives a power loss
+{
+	if (rename(from.c_str(),to.c_str())) return -1;
+	size_t s=to.rfind('/');
+	int fd=open((s==std::string::npos)?".":to.substr(0,s).c_str(), O_RDONLY | O_DIRECTORY);
+	if (fd<0) return -1;
+	int r=fsync(fd);
+	close(fd);
+	return r;
+}
+
+int _replace_file(const std::string& fname, const void* buf, size_t n)		//write-to-temp-then-rename
+{
+	std::string tmp=fname+".tmp";
+	int fd=open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd<0) return -1;
+	if (_write_all(fd,buf,n) || fsync(fd)) {close(fd); return -1;}
+	close(fd);
+	return _rename_synced(tmp,fname);
+}
+
+struct _ckpt_copy{			//what the journal needs from the arrays, taken out of shared memory
+	std::vector<uint64_t> alpha, gamma;
+	std::vector<unsigned> proj;		//timesum, alpha_proj and gamma_proj, contiguous like in time_hist
+	std::vector<uint32_t> cells;		//the dirty energy cells, in order
+	std::vector<unsigned> rows;		//and their time spectra, tN each
+	
+	void take(const ckpt_src& src)
+	{
+		const time_hist& bins=*src.bins;
+		alpha.assign(src.alpha_array,src.alpha_array+src.ENmax_alpha);
+		gamma.assign(src.gamma_array,src.gamma_array+src.ENmax_gamma);
+		proj.assign(bins.timesum,bins.timesum+(size_t)(1+bins.alpha_binN+bins.gamma_binN)*bins.tN);
+		std::vector<unsigned> buf(bins.tN);
+		for (uint32_t c=0;c!=bins.dirty.size();c++){
+			if (!bins.dirty[c]) continue;
+			const unsigned* r=bins.row(c,buf.data());
+			cells.push_back(c);
+			rows.insert(rows.end(),r,r+bins.tN);
+		}
+	}
+	
+	int save_sparse(const time_hist& bins, const std::string& dir) const	//time.sdat.new from the dirty cells and the current time.sdat, returns 0 on success
+	{
+		tsparse_reader old;
+		bool have_old=false;
+		if (cells.size()!=bins.dirty.size()){
+			if (old.open((dir+"/time.sdat").c_str())==0) have_old=true;
+			else if (errno!=ENOENT) return -1;				//no file yet: the cells are all zero
+			if (have_old && (old.h.alpha_binN!=bins.alpha_binN || old.h.gamma_binN!=bins.gamma_binN || old.h.tN!=bins.tN)) return -1;
+		}
+		tsparse_writer w;
+		if (w.open((dir+"/time.sdat.new").c_str(),bins.alpha_binN,bins.gamma_binN,bins.tN)) return -1;
+		std::vector<unsigned> buf(bins.tN,0);
+		size_t d=0;
+		for (uint32_t c=0;c!=bins.dirty.size();c++){
+			const unsigned* r=buf.data();
+			if (d!=cells.size() && cells[d]==c) r=rows.data()+(d++)*bins.tN;
+			else if (have_old && old.cell(c,buf.data())) return -1;
+			if (w.put(r)) return -1;
+		}
+		return w.close();
+	}
+};
+
+int checkpoint_write_journal(const ckpt_src& src, const std::string& dir, const _ckpt_copy* cp=NULL)	//cp: the arrays from a _ckpt_copy instead of src, returns 0 when the journal is committed
+{
+	time_hist& bins=*src.bins;
+	size_t ncells=0;
+	if (bins.sparse) {if (cp?cp->save_sparse(bins,dir):bins.save_sparse((dir+"/time.sdat.new").c_str())) return -1;}
+	else if (cp) ncells=cp->cells.size();
+	else for (size_t c=0;c!=bins.dirty.size();c++) ncells+=bins.dirty[c];
+	const uint64_t* alpha_array=cp?cp->alpha.data():src.alpha_array;
+	const uint64_t* gamma_array=cp?cp->gamma.data():src.gamma_array;
+	const unsigned* timesum=cp?cp->proj.data():bins.timesum;
+	const unsigned* alpha_proj=timesum+bins.tN;
+	const unsigned* gamma_proj=alpha_proj+(size_t)bins.alpha_binN*bins.tN;
+	
+	_ckpt_header h;
+	h.magic=CKPT_MAGIC;
+	h.ENmax_alpha=src.ENmax_alpha; h.ENmax_gamma=src.ENmax_gamma;
+	h.tN=bins.tN; h.ncells=ncells;
+	h.durlen=src.duration.size();
+	h.elapsed=src.elapsed;
+	h.alpha_binN=bins.alpha_binN; h.gamma_binN=bins.gamma_binN;
+	h.spec_width=src.wide?sizeof(uint64_t):sizeof(uint32_t);
+	h.flags=bins.sparse?CKPT_SPARSE:0;
+	std::vector<uint64_t> spec(std::max(h.ENmax_alpha,h.ENmax_gamma));
+	std::vector<unsigned> row(bins.tN);
+	
+	std::string tmp=dir+"/checkpoint.jnl.tmp";
+	int fd=open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd<0) return -1;
+	int err=0;
+	err|=_write_all(fd,&h,sizeof(h));
+	err|=_write_all(fd,src.duration.data(),h.durlen);
+	err|=_write_all(fd,spec.data(),spec_export(alpha_array,h.ENmax_alpha,src.wide,spec.data()));
+	err|=_write_all(fd,spec.data(),spec_export(gamma_array,h.ENmax_gamma,src.wide,spec.data()));
+	err|=_write_all(fd,timesum,h.tN*sizeof(unsigned));
+	err|=_write_all(fd,alpha_proj,(size_t)h.alpha_binN*h.tN*sizeof(unsigned));
+	err|=_write_all(fd,gamma_proj,(size_t)h.gamma_binN*h.tN*sizeof(unsigned));
+	if (cp && ncells) for (size_t d=0;d!=cp->cells.size() && !err;d++){
+		err|=_write_all(fd,&cp->cells[d],sizeof(uint32_t));
+		err|=_write_all(fd,cp->rows.data()+d*h.tN,h.tN*sizeof(unsigned));
+	}
+	else for (uint32_t c=0;c!=bins.dirty.size() && ncells && !err;c++){
+		if (!bins.dirty[c]) continue;
+		err|=_write_all(fd,&c,sizeof(c));
+		err|=_write_all(fd,bins.row(c,row.data()),h.tN*sizeof(unsigned));
+	}
+	if (err || fsync(fd)) {close(fd); return -1;}
+	close(fd);
+	return _rename_synced(tmp,dir+"/checkpoint.jnl");
+}
+
+int checkpoint_replay(const std::string& dir)		//applies a committed journal if there is one, returns 0 on success or if there was none
+{
+	std::string jname=dir+"/checkpoint.jnl";
+	int fd=open(jname.c_str(), O_RDONLY);
+	if (fd<0) return (errno==ENOENT)?0:-1;
+	_ckpt_header h;
+	size_t hlen=offsetof(_ckpt_header,alpha_binN);
+	if (_read_all(fd,&h,hlen) || (h.magic!=CKPT_MAGIC && h.magic!=CKPT_MAGIC_V2 && h.magic!=CKPT_MAGIC_V1)) {close(fd); return -1;}
+	h.alpha_binN=h.gamma_binN=0;
+	h.spec_width=sizeof(uint32_t);
+	h.flags=0;
+	if (h.magic!=CKPT_MAGIC_V1){					//older journals lack the fields at the end
+		size_t n=((h.magic==CKPT_MAGIC)?sizeof(h):offsetof(_ckpt_header,spec_width))-hlen;
+		if (_read_all(fd,&h.alpha_binN,n)) {close(fd); return -1;}
+	}
+	if (h.spec_width!=sizeof(uint32_t) && h.spec_width!=sizeof(uint64_t)) {close(fd); return -1;}
+	std::string duration(h.durlen,'\0');
+	std::vector<char> alpha_array((size_t)h.ENmax_alpha*h.spec_width), gamma_array((size_t)h.ENmax_gamma*h.spec_width);
+	std::vector<unsigned> timesum(h.tN), cell(h.tN);
+	std::vector<unsigned> alpha_proj((size_t)h.alpha_binN*h.tN), gamma_proj((size_t)h.gamma_binN*h.tN);
+	if (_read_all(fd,&duration[0],h.durlen) ||
+	    _read_all(fd,alpha_array.data(),alpha_array.size()) ||
+	    _read_all(fd,gamma_array.data(),gamma_array.size()) ||
+	    _read_all(fd,timesum.data(),h.tN*sizeof(unsigned)) ||
+	    _read_all(fd,alpha_proj.data(),alpha_proj.size()*sizeof(unsigned)) ||
+	    _read_all(fd,gamma_proj.data(),gamma_proj.size()*sizeof(unsigned))) {close(fd); return -1;}
+	
+	if (h.flags&CKPT_SPARSE){
+		close(fd);
+		if (_rename_synced(dir+"/time.sdat.new",dir+"/time.sdat") && errno!=ENOENT) return -1;	//ENOENT: already renamed before a crash
+	}
+	else{
+		int tfd=open((dir+"/time.dat").c_str(), O_WRONLY | O_CREAT, 0644);
+		if (tfd<0) {close(fd); return -1;}
+		off_t tsize=(off_t)h.alpha_binN*h.gamma_binN*h.tN*sizeof(unsigned);	//a new time.dat (compact cells, shared memory) gets its full size, not only up to the last dirty cell
+		struct stat st;
+		if (tsize && (fstat(tfd,&st) || (st.st_size<tsize && ftruncate(tfd,tsize)))) {close(fd); close(tfd); return -1;}
+		for (uint32_t i=0;i!=h.ncells;i++){
+			uint32_t c;
+			if (_read_all(fd,&c,sizeof(c)) || _read_all(fd,cell.data(),h.tN*sizeof(unsigned))) {close(fd); close(tfd); return -1;}
+			size_t n=h.tN*sizeof(unsigned);
+			if (pwrite(tfd,cell.data(),n,(off_t)c*n)!=(ssize_t)n) {close(fd); close(tfd); return -1;}
+		}
+		close(fd);
+		if (fsync(tfd)) {close(tfd); return -1;}
+		close(tfd);
+	}
+	
+	if (_replace_file(dir+"/alpha.dat",alpha_array.data(),alpha_array.size()) ||
+	    _replace_file(dir+"/gamma.dat",gamma_array.data(),gamma_array.size()) ||
+	    _replace_file(dir+"/timesum.dat",timesum.data(),h.tN*sizeof(unsigned)) ||
+	    (h.alpha_binN && _replace_file(dir+"/alphaproj.dat",alpha_proj.data(),alpha_proj.size()*sizeof(unsigned))) ||
+	    (h.gamma_binN && _replace_file(dir+"/gammaproj.dat",gamma_proj.data(),gamma_proj.size()*sizeof(unsigned))) ||
+	    _replace_file(dir+"/duration.txt",duration.data(),h.durlen)) return -1;
+	return unlink(jname.c_str());
+}
+
+int checkpoint_write(const ckpt_src& src, const std::string& dir, const _ckpt_copy* cp=NULL)	//writes and applies one checkpoint, returns 0 on success
+{
+	if (checkpoint_write_journal(src,dir,cp)) return -1;
+	return checkpoint_replay(dir);
+}
+
+class checkpointer{
+public:
+	checkpointer(): pid(-1) {}
+	
+	int start(const ckpt_src& src, const std::string& dir)	//forks the checkpoint writer, returns 1 if the previous one is still running
+	{
+		if (poll()) return 1;
+		int pfd[2];
+		if (src.shared && pipe(pfd)<0) {fprintf(stderr, "pipe() failed: %s\n", strerror(errno)); return -1;}
+		pid=fork();
+		if (pid<0) {fprintf(stderr, "fork() failed: %s\n", strerror(errno)); if (src.shared) {close(pfd[0]); close(pfd[1]);} return -1;}
+		if (pid==0){
+			setpriority(PRIO_PROCESS,0,19);
+			if (src.shared){
+				_ckpt_copy cp;
+				cp.take(src);
+				close(pfd[1]);					//the parent goes on
+				_exit(checkpoint_write(src,dir,&cp)?1:0);
+			}
+			_exit(checkpoint_write(src,dir)?1:0);
+		}
+		if (src.shared){
+			char c;
+			close(pfd[1]);
+			while (read(pfd[0],&c,1)<0 && errno==EINTR);		//end of file once the child has its copy (or has exited)
+			close(pfd[0]);
+		}
+		src.bins->clear_dirty();					//the child has its own copy of the dirty flags
+		_bins=src.bins;
+		return 0;
+	}
+	
+	int poll()		//returns 1 while a checkpoint is being written
+	{
+		if (pid<0) return 0;
+		int status;
+		if (waitpid(pid,&status,WNOHANG)==0) return 1;
+		_done(status);
+		return 0;
+	}
+	
+	void wait()
+	{
+		if (pid<0) return;
+		int status;
+		waitpid(pid,&status,0);
+		_done(status);
+	}
+	
+private:
+	pid_t pid;
+	time_hist* _bins;
+	
+	void _done(int status)
+	{
+		pid=-1;
+		if (!WIFEXITED(status) || WEXITSTATUS(status)!=0){
+			fprintf(stderr, "Writing checkpoint failed, all cells will be written with the next one.\n");
+			_bins->mark_all();
+		}
+	}
+};
@@ -0,0 +1,115 @@
+/*
+    Alpha Gamma Counter
+    Copyright (C) 2017  Mario Vretenar
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <vector>
+#include <stdint.h>
+
+////--------------------------- coincidence engine -------------------------////
+// Keeps the open coincidence window of each channel in a ring buffer of (timestamp, energy bin)
+// and adds every alpha-gamma pair closer than `interval` to the time histogram. Peaks must be
+// pushed in chronological order (output of reorder_buf).
+// Window boundaries are those of the original counting loop: an alpha stays open for gammas
+// with t_gamma < t_alpha + interval, a gamma stays open for alphas with t_alpha <= t_gamma + interval.
+// Peaks whose energy bin is outside the histogram can never be counted, so they are not stored.
+
+struct _cpeak{
+	uint64_t time;
+	unsigned ebin;
+};
+
+class _coinc_window{
+public:
+	_coinc_window(uint64_t lim): buf(64), mask(63), head(0), tail(0), lim(lim) {}
+	
+	inline void push(uint64_t time, unsigned ebin){
+		if (tail-head>mask) _grow();
+		buf[tail&mask].time=time;
+		buf[tail&mask].ebin=ebin;
+		tail++;
+	}
+	inline void expire(uint64_t now){					//drops all entries with time+lim <= now in one step
+		while (head!=tail && buf[head&mask].time+lim<=now) head++;
+	}
+	inline size_t size() const {return tail-head;}
+	inline const _cpeak& operator[](size_t i) const {return buf[(head+i)&mask];}
+	
+private:
+	std::vector<_cpeak> buf;
+	size_t mask, head, tail;
+	uint64_t lim;
+	
+	void _grow(){
+		std::vector<_cpeak> nbuf(2*buf.size());
+		for (size_t i=head;i!=tail;i++) nbuf[i-head]=buf[i&mask];
+		tail-=head; head=0;
+		buf.swap(nbuf);
+		mask=buf.size()-1;
+	}
+};
+
+class coinc_engine{
+public:
+	coinc_engine(unsigned interval, const time_axis* taxis, time_hist* bins): interval(interval), taxis(taxis), bins(bins), alphas(interval), gammas((uint64_t)interval+1) {}
+	
+	inline void open_alpha(uint64_t time, unsigned abin){		//only opens the window, no pairs are counted
+		alphas.expire(time);
+		gammas.expire(time);
+		if (abin<bins->alpha_binN) alphas.push(time,abin);
+	}
+	
+	inline void open_gamma(uint64_t time, unsigned gbin){
+		alphas.expire(time);
+		gammas.expire(time);
+		if (gbin<bins->gamma_binN) gammas.push(time,gbin);
+	}
+	
+	inline void add_alpha(uint64_t time, unsigned abin){
+		alphas.expire(time);
+		gammas.expire(time);
+		if (abin>=bins->alpha_binN) return;
+		alphas.push(time,abin);
+		for (size_t j=0;j!=gammas.size();j++){
+			const _cpeak& g=gammas[j];
+			if ((time-g.time)<=interval)
+				bins->inc(abin,g.ebin,taxis->before(time-g.time));
+		}
+	}
+	
+	inline void add_gamma(uint64_t time, unsigned gbin){
+		alphas.expire(time);
+		gammas.expire(time);
+		if (gbin>=bins->gamma_binN) return;
+		gammas.push(time,gbin);
+		for (size_t j=0;j!=alphas.size();j++){
+			const _cpeak& a=alphas[j];
+			if ((time-a.time)<interval)
+				bins->inc(a.ebin,gbin,taxis->after(time-a.time));
+		}
+	}
+	
+	size_t open_alphas() const {return alphas.size();}
+	size_t open_gammas() const {return gammas.size();}
+	
+private:
+	unsigned interval;
+	const time_axis* taxis;
+	time_hist* bins;
+	_coinc_window alphas;
+	_coinc_window gammas;
+};
@@ -0,0 +1,291 @@
+/*
+    Alpha Gamma Counter
+    Copyright (C) 2017  Mario Vretenar
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <deque>
+#include <fstream>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <inttypes.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "fpga.cpp"
+#include "reorder.cpp"
+#include "ring.cpp"
+#include "timehist.cpp"
+#include "coinc.cpp"
+#include "kernel.cpp"
+#include "checkpoint.cpp"
+#include "listmode.cpp"
+#include "conf.cpp"
+#include "analysis.cpp"
+
+// Collector for several boards streaming their peaks (stream_to in their agc_conf.txt). Each
+// connection has a receiver thread that decodes the blocks into a ring. The processing thread
+// puts the peaks of each board in order (one reorder stage per board), shifts them by the clock
+// offset of the board and merges the boards (k-way merge on the timestamps). A peak is only
+// released once every other board is known to have nothing older left: its own reordered peaks
+// are older than what it sent last minus 2*interval. A board that sent nothing for
+// COLLECT_IDLE ms does not hold the others back, its peaks older than what was already
+// processed when it comes back are dropped and counted as late. The merged stream is
+// histogrammed like agc does for one board, into measurements/ with the agc_conf.txt of the
+// working directory (the thresholds there should match the boards).
+// Clock offsets: the timestamps of each board start at 0 when its acquisition starts, so boards
+// are first aligned by the wall clock time of that start (as good as their clocks are synchronized,
+// with NTP about a millisecond) and then by the offsets given on the command line.
+
+#define COLLECT_RING (1<<20)		//peaks per board between the receiver and the processing thread (power of two)
+#define COLLECT_IDLE 1000		//ms
+
+using namespace std;
+
+struct board_rx{
+	board_rx(): fd(-1), offset(0), ring(COLLECT_RING), done(false), last_rx(0), received(0), dropped(0), rb(NULL), newest(0), finished(false), late(0) {}
+	uint32_t id;
+	int fd;
+	uint64_t start_ns;
+	int64_t offset;			//clock cycles added to the timestamps
+	spsc_ring<peak> ring;
+	atomic<bool> done;		//stream ended, all its peaks are in the ring
+	atomic<int64_t> last_rx;	//steady clock ms of the last block
+	atomic<uint64_t> received, dropped;	//dropped: by the board, it could not send fast enough
+	thread thr;
+	//processing thread only
+	reorder_buf* rb;
+	deque<peak> q;			//reordered, waiting for the merge
+	uint64_t newest;		//largest shifted timestamp so far
+	bool finished;
+	uint64_t late;
+};
+
+int64_t _ms_now() {return chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now().time_since_epoch()).count();}
+
+int _recv_all(int fd, void* buf, size_t n)	//returns 0 on success, -1 on error or end of stream
+{
+	char* p=(char*)buf;
+	while (n){
+		ssize_t r=recv(fd,p,n,0);
+		if (r<0) {if (errno==EINTR) continue; return -1;}
+		if (r==0) return -1;
+		p+=r; n-=r;
+	}
+	return 0;
+}
+
+void receiver_fun(board_rx* b)
+{
+	lm_block_header h;
+	vector<uint8_t> data;
+	vector<peak> pks;
+	while (!_recv_all(b->fd,&h,sizeof(h))){
+		if (h.magic!=LM_MAGIC || h.nbytes>LM_BLOCK_SIZE) {fprintf(stderr, "Board %u: bad block header.\n", b->id); break;}
+		data.resize(h.nbytes);
+		if (_recv_all(b->fd,data.data(),h.nbytes)) break;
+		pks.clear();
+		if (lm_decode(h,data.data(),pks)) {fprintf(stderr, "Board %u: corrupt block.\n", b->id); break;}
+		for (size_t i=0;i!=pks.size();i++)
+			while (b->ring.push(pks[i])) this_thread::yield();	//processing is behind, TCP makes the board drop peaks
+		b->received.fetch_add(pks.size(),memory_order_relaxed);
+		b->dropped.fetch_add(h.dropped,memory_order_relaxed);
+		b->last_rx.store(_ms_now(),memory_order_relaxed);
+	}
+	close(b->fd);
+	b->done.store(true,memory_order_release);
+}
+
+int main(int argc,char *argv[]){
+	if (argc<3){
+		printf ("Usage: %s <port> <boards> [board:offset ...]\n"
+		        "Waits for <boards> Red Pitayas streaming their peaks (stream_to in their agc_conf.txt), merges them and histograms\n"
+		        "the merged stream into measurements/ like agc, with the agc_conf.txt of the working directory. Ends when all boards\n"
+		        "have ended. Offsets (in 8 ns clock cycles) are added to the timestamps of a board, after the boards are aligned by\n"
+		        "the wall clock time their acquisition started.\n",argv[0]);
+		return 0;
+	}
+	unsigned nboards=atoi(argv[2]);
+	if (nboards==0) {printf("At least one board is needed.\n"); return -1;}
+	vector<pair<uint32_t,int64_t> > user_off;
+	for (int i=3;i<argc;i++){
+		unsigned id; long long off;
+		if (sscanf(argv[i],"%u:%lld",&id,&off)!=2) {printf("Bad offset %s, must be board:offset.\n",argv[i]); return -1;}
+		user_off.push_back(make_pair(id,(int64_t)off));
+	}
+
+	_load_conf(true);
+	if (mkdir("measurements",0755) && errno!=EEXIST) {printf("Cannot create the measurements folder: %s\n",strerror(errno)); return -1;}
+	int match=_match_confs();
+	if (match<0) return -1;
+	if (match) {printf ("Configuration in working directory does not match the one in measurements folder. Aborting.\n"); return -1;}
+	analysis an;
+	if (an.setup(_analysis_conf())) {printf("Error in energy, step, interval or time axis settings.\n"); return -1;}
+	printf("\nalpha_binN=%u\ngamma_binN=%u\ntime_binN=%u\n\n",an.alpha_binN,an.gamma_binN,an.time_binN);
+	if (checkpoint_replay("measurements")) {printf("Applying the checkpoint journal measurements/checkpoint.jnl failed. Aborting.\n"); return -1;}
+	ifstream tdur("measurements/duration.txt");
+	string duration((istreambuf_iterator<char>(tdur)), istreambuf_iterator<char>());
+	if (an.open("measurements")) return -1;
+
+	int lfd=socket(AF_INET,SOCK_STREAM,0);
+	int one=1;
+	setsockopt(lfd,SOL_SOCKET,SO_REUSEADDR,&one,sizeof(one));
+	sockaddr_in addr;
+	memset(&addr,0,sizeof(addr));
+	addr.sin_family=AF_INET;
+	addr.sin_addr.s_addr=htonl(INADDR_ANY);
+	addr.sin_port=htons(atoi(argv[1]));
+	if (lfd<0 || bind(lfd,(sockaddr*)&addr,sizeof(addr)) || listen(lfd,nboards)) {printf("Cannot listen on port %s: %s\n",argv[1],strerror(errno)); return -1;}
+	printf("Waiting for %u boards on port %s...\n",nboards,argv[1]);
+
+	vector<board_rx*> bd;
+	while (bd.size()!=nboards){
+		sockaddr_in from;
+		socklen_t len=sizeof(from);
+		int fd=accept(lfd,(sockaddr*)&from,&len);
+		if (fd<0) {if (errno==EINTR) continue; printf("accept() failed: %s\n",strerror(errno)); return -1;}
+		lm_hello hello;
+		if (_recv_all(fd,&hello,sizeof(hello)) || hello.magic!=LM_HELLO_MAGIC) {printf("Connection from %s is not a board, ignored.\n",inet_ntoa(from.sin_addr)); close(fd); continue;}
+		bool dup=false;
+		for (size_t i=0;i!=bd.size();i++) dup|=(bd[i]->id==hello.board);
+		if (dup) {printf("Board %u is already connected, connection from %s refused. Each board needs its own number in stream_to.\n",hello.board,inet_ntoa(from.sin_addr)); close(fd); continue;}
+		board_rx* b=aligned_new<board_rx>();				//its ring has cache line aligned members
+		b->id=hello.board; b->fd=fd; b->start_ns=hello.start_ns;
+		b->last_rx=_ms_now();
+		bd.push_back(b);
+		printf("Board %u connected from %s.\n",b->id,inet_ntoa(from.sin_addr));
+	}
+	close(lfd);
+
+	uint64_t start_ns=bd[0]->start_ns;					//clock offsets
+	for (size_t i=0;i!=bd.size();i++) start_ns=min(start_ns,bd[i]->start_ns);
+	int64_t min_off=0;
+	for (size_t i=0;i!=bd.size();i++){
+		bd[i]->offset=(int64_t)(bd[i]->start_ns-start_ns)/8;
+		for (size_t j=0;j!=user_off.size();j++) if (user_off[j].first==bd[i]->id) bd[i]->offset+=user_off[j].second;
+		min_off=min(min_off,bd[i]->offset);
+	}
+	for (size_t i=0;i!=bd.size();i++){
+		bd[i]->offset-=min_off;						//no timestamp may go below 0
+		printf("Board %u: offset %" PRId64" clock cycles.\n",bd[i]->id,bd[i]->offset);
+		bd[i]->rb=new reorder_buf(2*an.c.interval);
+		bd[i]->thr=thread(receiver_fun,bd[i]);
+	}
+	if (bd.size()>1){
+		string missing;
+		for (size_t i=0;i!=bd.size();i++){
+			bool given=false;
+			for (size_t j=0;j!=user_off.size();j++) given|=(user_off[j].first==bd[i]->id);
+			if (!given) missing+=" "+to_string(bd[i]->id);
+		}
+		printf("WARNING: the boards are aligned by the wall clock time their acquisition started, which is only as good as their\n"
+		       "clock synchronization (NTP: about 1 ms = 125000 cycles, the interval is %u cycles). Coincidences between peaks\n"
+		       "of different boards are meaningless unless the offset of each board is measured and given as board:offset.\n",an.c.interval);
+		if (!missing.empty()) printf("No offset given for board%s:%s.\n",(missing.find(' ',1)==string::npos)?"":"s",missing.c_str());
+	}
+
+	checkpointer ckpt_writer;
+	ckpt_src ckpt;
+	ckpt.alpha_array=an.alpha_array; ckpt.ENmax_alpha=an.ENmax_alpha;
+	ckpt.gamma_array=an.gamma_array; ckpt.ENmax_gamma=an.ENmax_gamma;
+	ckpt.wide=an.c.wide_spectra;
+	ckpt.bins=&an.bins;
+	ckpt.shared=NULL;
+	uint64_t next_ckpt=(uint64_t)checkpoint_period*125000000;
+
+	vector<peak> out;
+	uint64_t emitted=0;					//timestamp of the last merged peak
+	int64_t t_print=_ms_now();
+	unsigned idle=0;
+	for (;;){
+		bool busy=false, all_finished=true;
+		int64_t now=_ms_now();
+		for (size_t i=0;i!=bd.size();i++){			//into the reorder stages
+			board_rx& b=*bd[i];
+			if (b.finished) continue;
+			all_finished=false;
+			bool done=b.done.load(memory_order_acquire);	//before popping, so no peak is missed
+			peak pk;
+			for (int n=0;n!=4096 && !b.ring.pop(&pk);n++){
+				pk.time+=b.offset;
+				if (pk.time>b.newest) b.newest=pk.time;
+				b.rb->push(pk);
+				busy=true;
+			}
+			if (done && b.ring.in_ring()==0) {b.rb->flush(); b.finished=true;}
+			while (!b.rb->pop(&pk)) b.q.push_back(pk);
+		}
+		uint64_t limit=UINT64_MAX;				//nothing older than this can come from the boards without queued peaks
+		for (size_t i=0;i!=bd.size();i++){
+			board_rx& b=*bd[i];
+			if (!b.q.empty() || b.finished) continue;
+			if (now-b.last_rx.load(memory_order_relaxed)>COLLECT_IDLE && b.ring.in_ring()==0) continue;
+			uint64_t safe=(b.newest>2*(uint64_t)an.c.interval)?b.newest-2*(uint64_t)an.c.interval:0;
+			limit=min(limit,safe);
+		}
+		out.clear();
+		for (;;){						//k-way merge, k is small
+			board_rx* m=NULL;
+			for (size_t i=0;i!=bd.size();i++) if (!bd[i]->q.empty() && (!m || bd[i]->q.front().time<m->q.front().time)) m=bd[i];
+			if (!m || m->q.front().time>limit) break;
+			const peak& pk=m->q.front();
+			if (pk.time<emitted) m->late++;
+			else {out.push_back(pk); emitted=pk.time;}
+			m->q.pop_front();
+			if (m->q.empty() && !m->finished){
+				uint64_t safe=(m->newest>2*(uint64_t)an.c.interval)?m->newest-2*(uint64_t)an.c.interval:0;
+				limit=min(limit,safe);
+			}
+		}
+		if (!out.empty()) {an.push_ordered(out.data(),out.size()); busy=true;}
+		if (all_finished) break;
+
+		if (checkpoint_period && an.st.last_time>=next_ckpt){
+			ckpt.elapsed=an.st.last_time;
+			ckpt.duration=duration+"+"+to_string(an.st.last_time/125000000)+" seconds\n";
+			if (!ckpt_writer.start(ckpt,"measurements")) next_ckpt=an.st.last_time+(uint64_t)checkpoint_period*125000000;
+		}
+		if (now-t_print>=1000){
+			t_print=now;
+			printf("N_alpha=%" PRIu64" N_gamma=%" PRIu64" elapsed time=%" PRIu64" s\n",an.st.N_alpha,an.st.N_gamma,an.st.last_time/125000000);
+			for (size_t i=0;i!=bd.size();i++)
+				printf("  board %u: received %" PRIu64" (dropped by the board %" PRIu64", late %" PRIu64")%s\n",bd[i]->id,bd[i]->received.load(),bd[i]->dropped.load(),bd[i]->late,bd[i]->finished?", ended":"");
+		}
+		if (busy) idle=0;
+		else AGC_backoff(idle++);
+	}
+
+	printf("All boards ended.\nN_alpha=%" PRIu64"\nN_gamma=%" PRIu64"\nelapsed time=%" PRIu64" s\n",an.st.N_alpha,an.st.N_gamma,an.st.last_time/125000000);
+	for (size_t i=0;i!=bd.size();i++){
+		bd[i]->thr.join();
+		printf("  board %u: received %" PRIu64" (dropped by the board %" PRIu64", late %" PRIu64")\n",bd[i]->id,bd[i]->received.load(),bd[i]->dropped.load(),bd[i]->late);
+		delete bd[i]->rb;
+		aligned_delete(bd[i]);
+	}
+	printf("Saving...");
+	ckpt_writer.wait();
+	ckpt.elapsed=an.st.last_time;
+	ckpt.duration=duration+"+"+to_string(an.st.last_time/125000000)+" seconds\n";
+	if (checkpoint_write(ckpt,"measurements")) {printf("Saving failed: %s\n",strerror(errno)); return -1;}
+	an.taxis.write_desc("measurements/time_axis.txt");
+	printf("done!\n");
+	an.close();
+	return 0;
+}
@@ -0,0 +1,383 @@
+/*
+    Alpha Gamma Counter
+    Copyright (C) 2017  Mario Vretenar
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <fstream>
+#include <vector>
+#include <cerrno>
+#include <cstring>
+#include <glob.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+int alpha_thresh;
+bool alpha_edge;	//0 - rising edge, 1 - falling edge
+int gamma_thresh;
+bool gamma_edge;
+double alpha_mintime;unsigned alpha_mintime_uint;
+double gamma_mintime;unsigned gamma_mintime_uint;
+double interval;unsigned interval_uint;
+unsigned step_alpha;
+unsigned step_gamma;
+int alpha_max;
+int gamma_max;
+unsigned time_binwidth=1;	//optional, in 8 ns steps
+unsigned time_logbins=0;	//optional, 0 = linear time axis
+unsigned checkpoint_period=600;	//optional, in seconds, 0 = save only at the end
+bool listmode=false;		//optional, record every peak to measurements/listmode.dat
+unsigned stats_period=1;	//optional, in seconds, 0 = no measurements/stats.txt
+bool spectrum_mode=false;	//optional, alpha.dat and gamma.dat from the FPGA histograms
+unsigned time_cell_bits=32;	//optional, 8 or 16 to save memory
+bool wide_spectra=false;	//optional, alpha.dat and gamma.dat as %uint64
+bool sparse_time=false;		//optional, time.sdat instead of time.dat
+bool shm_export_on=false;	//optional, histograms in shared memory for other processes
+string stream_to="-";		//optional, host:port/board of agc-collect
+
+void _gen_conf(const char* fname)
+{
+	FILE *conffile;
+	conffile=fopen(fname,"w");
+	fprintf(conffile,
+		"Thresholds are minimum intensities required for trigger.\n"
+		"alpha_thresh(-8192 - 8191):\t100\n"
+		"alpha zero level (not needed by program, for reference):\t0\n"
+		"alpha_edge(Rising (R) or Falling (F)):\tR\n"
+		"alpha_max(R edge: alpha_thresh < x < 8191, F edge: -8192 < x < alpha_thresh):\t8191\n"
+		"gamma_thresh(-8192 - 8191):\t100\n"
+		"gamma zero level (not needed by program, for reference):\t0\n"
+		"gamma_edge(Rising (R) or Falling (F)):\tR\n"
+		"gamma_max(R edge: gamma_thresh < x < 8191, F edge: -8192 < x < gamma_thresh):\t8191\n"
+		"Mintime is the minimum duration from threshold rising(falling) pass to falling(rising) pass for the peak to be registered. (in seconds)\n"
+		"alpha_mintime(0 - 34.3597):\t0.00001\n"
+		"gamma_mintime(0 - 34.3597):\t0.00001\n"
+		"Observed interval before and after trigger event(0 - 34.3597)(in seconds):\t0.00001\n"
+		"Time resolved alpha amplitude step:\t100000\n"
+		"Time resolved gamma amplitude step:\t100000\n"
+		"time_binwidth(in 8 ns steps, powers of two are fastest):\t1\n"
+		"time_logbins(0 for linear time axis, else number of linear bins near t=0 after which bin width doubles every time_logbins bins, power of two):\t0\n"
+		"checkpoint_period(in seconds, 0 = save only at the end):\t600\n"
+		"listmode(record every peak to measurements/listmode.dat, Y or N):\tN\n"
+		"stats_period(in seconds, 0 = no measurements/stats.txt):\t1\n"
+		"spectrum_mode(energy spectra histogrammed on the FPGA, only peaks that can be in a coincidence are read, Y or N):\tN\n"
+		"time_cell_bits(8, 16 or 32, memory per time.dat cell, larger counts are kept in a side table):\t32\n"
+		"wide_spectra(alpha.dat and gamma.dat as uint64 instead of uint32, Y or N):\tN\n"
+		"sparse_time(save time.dat compressed as time.sdat, see README, Y or N):\tN\n"
+		"shm_export(live histograms in POSIX shared memory /agc, other analyses in /agc_<name>, Y or N):\tN\n"
+		"stream_to(send every peak to agc-collect at host:port/board, e.g. 192.168.1.10:5000/1, - for none):\t-\n"
+		);
+	fclose(conffile);
+}
+
+void _load_conf(bool pf, const char* fname="agc_conf.txt")
+{
+	time_binwidth=1;		//optional settings missing from this file must not keep the value of a previously loaded one
+	time_logbins=0;
+	checkpoint_period=600;
+	listmode=false;
+	stats_period=1;
+	spectrum_mode=false;
+	time_cell_bits=32;
+	wide_spectra=false;
+	sparse_time=false;
+	shm_export_on=false;
+	stream_to="-";
+	
+	ifstream t(fname);
+	string conffile((istreambuf_iterator<char>(t)), istreambuf_iterator<char>());            //put the conf file into a string
+	
+	if (conffile.size()!=0){
+		char tmpch; int z;
+		size_t pos_alpha_thresh = conffile.find("alpha_thresh(-8192 - 8191):");
+			if (pos_alpha_thresh != string::npos){
+				pos_alpha_thresh+=27;
+				sscanf(conffile.substr(pos_alpha_thresh).c_str(), "%d", &alpha_thresh);
+				if(pf)printf("alpha_thresh=%d\n",alpha_thresh);
+			}else {printf("Error in alpha_thresh. Delete file to regenerate from template.\n"); exit(0);}
+		size_t pos_alpha_edge = conffile.find("alpha_edge(Rising (R) or Falling (F)):");
+			if (pos_alpha_edge != string::npos){
+				pos_alpha_edge+=38;
+				z=0; do {sscanf(conffile.substr(pos_alpha_edge+z).c_str(), "%c", &tmpch); z++;}
+				while (isspace(tmpch));
+				if (tmpch=='R') alpha_edge=0;
+				else if (tmpch=='F') alpha_edge=1;
+				else {printf("Error in alpha_edge. Must be F or R!\n"); exit(0);}
+				if(pf)printf("alpha_edge=%c\n",alpha_edge?'F':'R');
+			}else {printf("Error in alpha_edge. Delete file to regenerate from template.\n"); exit(0);}
+		size_t pos_gamma_thresh = conffile.find("gamma_thresh(-8192 - 8191):");
+			if (pos_gamma_thresh != string::npos){
+				pos_gamma_thresh+=27;
+				sscanf(conffile.substr(pos_gamma_thresh).c_str(), "%d", &gamma_thresh);
+				if(pf)printf("gamma_thresh=%d\n",gamma_thresh);
+			}else {printf("Error in gamma_thresh. Delete file to regenerate from template.\n"); exit(0);}
+		size_t pos_gamma_edge = conffile.find("gamma_edge(Rising (R) or Falling (F)):");
+			if (pos_gamma_edge != string::npos){
+				pos_gamma_edge+=38;
+				z=0; do {sscanf(conffile.substr(pos_gamma_edge+z).c_str(), "%c", &tmpch); z++;}
+				while (isspace(tmpch));
+				if (tmpch=='R') gamma_edge=0;
+				else if (tmpch=='F') gamma_edge=1;
+				else {printf("Error in gamma_edge. Must be F or R!\n"); exit(0);}
+				if(pf)printf("gamma_edge=%c\n",gamma_edge?'F':'R');
+			}else {printf("Error in gamma_edge. Delete file to regenerate from template.\n"); exit(0);}
+		size_t pos_alpha_mintime = conffile.find("alpha_mintime(0 - 34.3597):");
+			if (pos_alpha_mintime != string::npos){
+				pos_alpha_mintime+=27;
+				sscanf(conffile.substr(pos_alpha_mintime).c_str(), "%lf", &alpha_mintime);
+				if(pf)printf("alpha_mintime=%lf\n",alpha_mintime);
+			}else {printf("Error in alpha_mintime. Delete file to regenerate from template.\n"); exit(0);}
+		size_t pos_gamma_mintime = conffile.find("gamma_mintime(0 - 34.3597):");
+			if (pos_gamma_mintime != string::npos){
+				pos_gamma_mintime+=27;
+				sscanf(conffile.substr(pos_gamma_mintime).c_str(), "%lf", &gamma_mintime);
+				if(pf)printf("gamma_mintime=%lf\n",gamma_mintime);
+			}else {printf("Error in gamma_mintime. Delete file to regenerate from template.\n"); exit(0);}
+		char tmp[100];
+		size_t pos_interval = conffile.find("Observed interval before and after trigger event(0 - 34.3597)(in seconds):");
+			if (pos_interval != string::npos){
+				pos_interval+=74;
+				sscanf(conffile.substr(pos_interval).c_str(), "%lf", &interval);
+				if(pf)printf("interval=%lf\n",interval);
+			}else {printf("Error in interval. Delete file to regenerate from template.\n"); exit(0);}
+		size_t pos_step_alpha = conffile.find("Time resolved alpha amplitude step:");
+			if (pos_step_alpha != string::npos){
+				pos_step_alpha+=35;
+				sscanf(conffile.substr(pos_step_alpha).c_str(), "%u", &step_alpha);
+				if(pf)printf("step_alpha=%u\n",step_alpha);
+			}else {printf("Error in step_alpha. Delete file to regenerate from template.\n"); exit(0);}
+		size_t pos_step_gamma = conffile.find("Time resolved gamma amplitude step:");
+			if (pos_step_gamma != string::npos){
+				pos_step_gamma+=35;
+				sscanf(conffile.substr(pos_step_gamma).c_str(), "%u", &step_gamma);
+				if(pf)printf("step_gamma=%u\n",step_gamma);
+			}else {printf("Error in step_gamma. Delete file to regenerate from template.\n"); exit(0);}		
+		size_t pos_alpha_max = conffile.find("alpha_max(R edge: alpha_thresh < x < 8191, F edge: -8192 < x < alpha_thresh):");
+			if (pos_alpha_max != string::npos){
+				pos_alpha_max+=77;
+				sscanf(conffile.substr(pos_alpha_max).c_str(), "%d", &alpha_max);
+				if(pf)printf("alpha_max=%d\n",alpha_max);
+			}else {printf("Error in alpha_max. Delete file to regenerate from template.\n"); exit(0);}
+		size_t pos_gamma_max = conffile.find("gamma_max(R edge: gamma_thresh < x < 8191, F edge: -8192 < x < gamma_thresh):");
+			if (pos_gamma_max != string::npos){
+				pos_gamma_max+=77;
+				sscanf(conffile.substr(pos_gamma_max).c_str(), "%d", &gamma_max);
+				if(pf)printf("gamma_max=%d\n",gamma_max);
+			}else {printf("Error in gamma_max. Delete file to regenerate from template.\n"); exit(0);}
+		size_t pos_time_binwidth = conffile.find("time_binwidth(in 8 ns steps, powers of two are fastest):");		//optional, older config files do not have it
+			if (pos_time_binwidth != string::npos){
+				pos_time_binwidth+=56;
+				sscanf(conffile.substr(pos_time_binwidth).c_str(), "%u", &time_binwidth);
+				if (time_binwidth==0) {printf("Error in time_binwidth. Must be at least 1!\n"); exit(0);}
+			}
+			if(pf)printf("time_binwidth=%u\n",time_binwidth);
+		size_t pos_time_logbins = conffile.find("time_logbins(0 for linear time axis, else number of linear bins near t=0 after which bin width doubles every time_logbins bins, power of two):");
+			if (pos_time_logbins != string::npos){
+				pos_time_logbins+=142;
+				sscanf(conffile.substr(pos_time_logbins).c_str(), "%u", &time_logbins);
+				if (time_logbins&(time_logbins-1)) {printf("Error in time_logbins. Must be 0 or a power of two!\n"); exit(0);}
+			}
+			if(pf)printf("time_logbins=%u\n",time_logbins);
+		size_t pos_checkpoint_period = conffile.find("checkpoint_period(in seconds, 0 = save only at the end):");
+			if (pos_checkpoint_period != string::npos){
+				pos_checkpoint_period+=56;
+				sscanf(conffile.substr(pos_checkpoint_period).c_str(), "%u", &checkpoint_period);
+			}
+			if(pf)printf("checkpoint_period=%u\n",checkpoint_period);
+		size_t pos_listmode = conffile.find("listmode(record every peak to measurements/listmode.dat, Y or N):");
+			if (pos_listmode != string::npos){
+				pos_listmode+=65;
+				z=0; do {sscanf(conffile.substr(pos_listmode+z).c_str(), "%c", &tmpch); z++;}
+				while (isspace(tmpch));
+				if (tmpch=='Y') listmode=true;
+				else if (tmpch=='N') listmode=false;
+				else {printf("Error in listmode. Must be Y or N!\n"); exit(0);}
+			}
+			if(pf)printf("listmode=%c\n",listmode?'Y':'N');
+		size_t pos_stats_period = conffile.find("stats_period(in seconds, 0 = no measurements/stats.txt):");
+			if (pos_stats_period != string::npos){
+				pos_stats_period+=56;
+				sscanf(conffile.substr(pos_stats_period).c_str(), "%u", &stats_period);
+			}
+			if(pf)printf("stats_period=%u\n",stats_period);
+		size_t pos_spectrum_mode = conffile.find("spectrum_mode(energy spectra histogrammed on the FPGA, only peaks that can be in a coincidence are read, Y or N):");
+			if (pos_spectrum_mode != string::npos){
+				pos_spectrum_mode+=113;
+				z=0; do {sscanf(conffile.substr(pos_spectrum_mode+z).c_str(), "%c", &tmpch); z++;}
+				while (isspace(tmpch));
+				if (tmpch=='Y') spectrum_mode=true;
+				else if (tmpch=='N') spectrum_mode=false;
+				else {printf("Error in spectrum_mode. Must be Y or N!\n"); exit(0);}
+			}
+			if(pf)printf("spectrum_mode=%c\n",spectrum_mode?'Y':'N');
+		size_t pos_time_cell_bits = conffile.find("time_cell_bits(8, 16 or 32, memory per time.dat cell, larger counts are kept in a side table):");
+			if (pos_time_cell_bits != string::npos){
+				pos_time_cell_bits+=94;
+				sscanf(conffile.substr(pos_time_cell_bits).c_str(), "%u", &time_cell_bits);
+				if (time_cell_bits!=8 && time_cell_bits!=16 && time_cell_bits!=32) {printf("Error in time_cell_bits. Must be 8, 16 or 32!\n"); exit(0);}
+			}
+			if(pf)printf("time_cell_bits=%u\n",time_cell_bits);
+		size_t pos_wide_spectra = conffile.find("wide_spectra(alpha.dat and gamma.dat as uint64 instead of uint32, Y or N):");
+			if (pos_wide_spectra != string::npos){
+				pos_wide_spectra+=74;
+				z=0; do {sscanf(conffile.substr(pos_wide_spectra+z).c_str(), "%c", &tmpch); z++;}
+				while (isspace(tmpch));
+				if (tmpch=='Y') wide_spectra=true;
+				else if (tmpch=='N') wide_spectra=false;
+				else {printf("Error in wide_spectra. Must be Y or N!\n"); exit(0);}
+			}
+			if(pf)printf("wide_spectra=%c\n",wide_spectra?'Y':'N');
+		size_t pos_sparse_time = conffile.find("sparse_time(save time.dat compressed as time.sdat, see README, Y or N):");
+			if (pos_sparse_time != string::npos){
+				pos_sparse_time+=71;
+				z=0; do {sscanf(conffile.substr(pos_sparse_time+z).c_str(), "%c", &tmpch); z++;}
+				while (isspace(tmpch));
+				if (tmpch=='Y') sparse_time=true;
+				else if (tmpch=='N') sparse_time=false;
+				else {printf("Error in sparse_time. Must be Y or N!\n"); exit(0);}
+			}
+			if(pf)printf("sparse_time=%c\n",sparse_time?'Y':'N');
+		size_t pos_shm_export = conffile.find("shm_export(live histograms in POSIX shared memory /agc, other analyses in /agc_<name>, Y or N):");
+			if (pos_shm_export != string::npos){
+				pos_shm_export+=95;
+				z=0; do {sscanf(conffile.substr(pos_shm_export+z).c_str(), "%c", &tmpch); z++;}
+				while (isspace(tmpch));
+				if (tmpch=='Y') shm_export_on=true;
+				else if (tmpch=='N') shm_export_on=false;
+				else {printf("Error in shm_export. Must be Y or N!\n"); exit(0);}
+			}
+			if(pf)printf("shm_export=%c\n",shm_export_on?'Y':'N');
+		size_t pos_stream_to = conffile.find("stream_to(send every peak to agc-collect at host:port/board, e.g. 192.168.1.10:5000/1, - for none):");
+			if (pos_stream_to != string::npos){
+				pos_stream_to+=99;
+				if (sscanf(conffile.substr(pos_stream_to).c_str(), "%99s", tmp)==1) stream_to=tmp;
+				size_t c=stream_to.rfind(':'), b=(c==string::npos)?c:stream_to.find('/',c);	//the port is after the last ':', the board after the '/' following it
+				if (stream_to!="-" && (c==string::npos || c==0 || b==string::npos || b==c+1 || b+1==stream_to.size())) {printf("Error in stream_to. Must be host:port/board or -!\n"); exit(0);}
+			}
+			if(pf)printf("stream_to=%s\n",stream_to.c_str());
+			
+		if(pf)printf("All loaded, no errors (I did not check for boundaries, you better had chosen them properly)!.\n");
+	}
+	else{
+		printf ("No %s found. Generating file from template. Modify the file and rerun the program.\n",fname);
+		_gen_conf(fname);
+		exit(0);
+	}
+	t.close();
+	alpha_mintime_uint=(unsigned)(alpha_mintime*125000000);
+	gamma_mintime_uint=(unsigned)(gamma_mintime*125000000);
+	interval_uint=(unsigned)(interval*125000000);
+}
+
+int _make_dirs(const string& dir)	//creates dir and its parents if missing (mkdir -p), returns 0 on success
+{
+	for (size_t p=dir.find('/',1);;p=dir.find('/',p+1)){
+		string d=dir.substr(0,p);
+		if (mkdir(d.c_str(),0755) && errno!=EEXIST) {printf("Cannot create the %s folder: %s\n",d.c_str(),strerror(errno)); return -1;}
+		if (p==string::npos) return 0;
+	}
+}
+
+int _copy_file(const string& src, const string& dst)	//returns 0 on success
+{
+	FILE* in=fopen(src.c_str(),"rb");
+	if (in==NULL) {fprintf(stderr, "fopen(%s) failed: %s\n", src.c_str(), strerror(errno)); return -1;}
+	FILE* out=fopen(dst.c_str(),"wb");
+	if (out==NULL) {fprintf(stderr, "fopen(%s) failed: %s\n", dst.c_str(), strerror(errno)); fclose(in); return -1;}
+	char buf[4096];
+	size_t n;
+	int err=0;
+	while ((n=fread(buf,1,sizeof(buf),in))>0) if (fwrite(buf,1,n,out)!=n) {err=-1; break;}
+	if (ferror(in)) err=-1;
+	fclose(in);
+	if (fclose(out)) err=-1;
+	if (err) fprintf(stderr, "Copying %s to %s failed: %s\n", src.c_str(), dst.c_str(), strerror(errno));
+	return err;
+}
+
+int _match_confs(const string& fname="agc_conf.txt", const string& dir="measurements")	//compare configs: 0 if they match (or dir had none, then fname is copied there), 1 if not, -1 if the copy failed
+{
+	ifstream t0(fname);
+	string conffile0((istreambuf_iterator<char>(t0)), istreambuf_iterator<char>());
+	ifstream t1(dir+"/agc_conf.txt");
+	string conffile2((istreambuf_iterator<char>(t1)), istreambuf_iterator<char>());
+	if (conffile2.empty()){
+		if (_copy_file(fname,dir+"/agc_conf.txt")) return -1;
+	}
+	else if (conffile0.compare(conffile2) != 0) return 1;
+	return 0;
+}
+
+struct analysis_conf{		//everything that determines how peaks are histogrammed
+	int alpha_thresh;
+	bool alpha_edge;
+	int gamma_thresh;
+	bool gamma_edge;
+	unsigned interval;	//in clock cycles
+	unsigned step_alpha;
+	unsigned step_gamma;
+	int alpha_max;
+	int gamma_max;
+	unsigned time_binwidth;
+	unsigned time_logbins;
+	unsigned time_cell_bits;	//8, 16 or 32, time_hist storage
+	bool wide_spectra;		//alpha.dat and gamma.dat as %uint64
+	bool sparse_time;		//time.sdat instead of time.dat
+};
+
+analysis_conf _analysis_conf()	//of the loaded configuration
+{
+	analysis_conf c;
+	c.alpha_thresh=alpha_thresh; c.alpha_edge=alpha_edge;
+	c.gamma_thresh=gamma_thresh; c.gamma_edge=gamma_edge;
+	c.interval=interval_uint;
+	c.step_alpha=step_alpha; c.step_gamma=step_gamma;
+	c.alpha_max=alpha_max; c.gamma_max=gamma_max;
+	c.time_binwidth=time_binwidth; c.time_logbins=time_logbins;
+	c.time_cell_bits=time_cell_bits; c.wide_spectra=wide_spectra;
+	c.sparse_time=sparse_time;
+	return c;
+}
+
+struct pipeline_conf{
+	string name;		//the <name> of agc_conf_<name>.txt, histograms go to measurements/<name>
+	string fname;
+	analysis_conf c;
+};
+
+vector<pipeline_conf> _load_pipeline_confs(bool pf)	//additional analyses of the same peaks, one agc_conf_<name>.txt each, reloads agc_conf.txt at the end
+{
+	vector<pipeline_conf> pl;
+	glob_t g;
+	if (glob("agc_conf_*.txt",0,NULL,&g)==0){
+		for (size_t i=0;i!=g.gl_pathc;i++){
+			pipeline_conf p;
+			p.fname=g.gl_pathv[i];
+			p.name=p.fname.substr(9,p.fname.size()-13);
+			if (p.name.empty()) continue;
+			if(pf)printf("\nAnalysis %s (%s):\n",p.name.c_str(),p.fname.c_str());
+			_load_conf(pf,p.fname.c_str());		//only the settings in analysis_conf are used
+			p.c=_analysis_conf();
+			pl.push_back(p);
+		}
+	}
+	globfree(&g);
+	_load_conf(false);
+	return pl;
+}
@@ -0,0 +1,126 @@
+/*
+    Alpha Gamma Counter
+    Copyright (C) 2017  Mario Vretenar
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <cstddef>
+#include <stdint.h>
+#include <unistd.h>
+
+////-------------------------------- fan-out --------------------------------////
+// Feeds one peak stream to several analyses. With a single analysis peaks go straight to it
+// on the calling thread. With more, one reorder stage (window: 2x the longest interval) puts
+// the peaks in chronological order into a broadcast ring, and each analysis processes them
+// in place on its own worker thread, so the stream is neither reordered nor copied per analysis.
+// The state of the analyses may only be read or changed by the calling thread after sync().
+// Each analysis may have a live export (see shm.cpp), batches of peaks are marked in it.
+
+class fanout{
+public:
+	fanout(): _ring(NULL), _rb(NULL), _stop(false), _open_alphas(0), _open_gammas(0), _batch(0) {}
+	~fanout() {stop();}
+	
+	void start(const std::vector<analysis*>& an, const std::vector<shm_export*>& shm, size_t ring_size)	//ring_size: power of two, unused for a single analysis
+	{
+		_an=an;
+		_shm=shm;
+		if (_an.size()<2) return;
+		uint64_t window=0;
+		for (size_t i=0;i!=_an.size();i++) if (2*(uint64_t)_an[i]->c.interval>window) window=2*(uint64_t)_an[i]->c.interval;
+		_rb=new reorder_buf(window);
+		_ring=aligned_new<bcast_ring<peak> >(ring_size,_an.size());
+		_stop=false;
+		for (unsigned i=0;i!=_an.size();i++) _workers.push_back(std::thread(&fanout::_work,this,i));
+	}
+	
+	inline void push(const peak& pk)		//peaks may be out of chronological order by up to 2*interval
+	{
+		if (_an.size()==1){
+			if (!_batch++) _shm[0]->begin();
+			_an[0]->push(pk);
+			if (_batch==SHM_BATCH) publish();
+			return;
+		}
+		_rb->push(pk);
+		peak p;
+		while (!_rb->pop(&p))
+			while (_ring->push(p)) std::this_thread::yield();	//the slowest analysis is behind by a full ring
+	}
+	
+	inline void publish()				//single analysis: ends the batch in the live export, call when no peaks are waiting
+	{
+		if (_batch) {_shm[0]->end(_an[0]->st); _batch=0;}
+	}
+	
+	void sync()					//returns when all analyses have processed all released peaks
+	{
+		if (_an.size()==1) {publish(); return;}
+		while (!_ring->drained()) std::this_thread::yield();
+		_open_alphas=_an[0]->coinc().open_alphas();
+		_open_gammas=_an[0]->coinc().open_gammas();
+	}
+	
+	void stop()					//processes the released peaks and ends the worker threads
+	{
+		if (_workers.empty()) return;
+		sync();
+		_stop=true;
+		for (size_t i=0;i!=_workers.size();i++) _workers[i].join();
+		_workers.clear();
+		aligned_delete(_ring); _ring=NULL;
+		delete _rb; _rb=NULL;
+	}
+	
+	size_t in_reorder() const {return (_an.size()==1)?_an[0]->in_reorder():_rb->size();}
+	size_t open_alphas() const {return (_an.size()==1)?_an[0]->coinc().open_alphas():_open_alphas;}	//of the first analysis, as of the last sync() with several
+	size_t open_gammas() const {return (_an.size()==1)?_an[0]->coinc().open_gammas():_open_gammas;}
+	
+private:
+	std::vector<analysis*> _an;
+	std::vector<shm_export*> _shm;
+	std::vector<std::thread> _workers;
+	bcast_ring<peak>* _ring;
+	reorder_buf* _rb;
+	std::atomic<bool> _stop;
+	size_t _open_alphas, _open_gammas;
+	unsigned _batch;				//peaks in the current batch, single analysis
+	
+	void _work(unsigned r)
+	{
+		unsigned idle=0;
+		const peak* p;
+		for (;;){
+			size_t n=_ring->peek(r,&p);
+			if (n==0){
+				if (_stop.load(std::memory_order_relaxed)) return;
+				if (idle<64) idle++;
+				else if (idle<128) {idle++; std::this_thread::yield();}
+				else usleep(50);
+				continue;
+			}
+			idle=0;
+			if (n>SHM_BATCH) n=SHM_BATCH;
+			_shm[r]->begin();
+			_an[r]->push_ordered(p,n);
+			_shm[r]->end(_an[r]->st);
+			_ring->release(r,n);
+		}
+	}
+};
@@ -17,21 +17,42 @@
 */
 
 #include <cstdio>
+#include <cstdlib>
 #include <cerrno>
 #include <cstring>
+#include <strings.h>
 #include <sys/mman.h>
 #include <stdint.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sched.h>
+#include <poll.h>
+#include <dirent.h>
+#include <string>
 #include <cmath>
+#include <atomic>
 
 #define PI 3.14159265
 #define FREQ 125e6	//fpga clock freq
 
+struct peak{
+	uint64_t time;
+	int amp;
+	bool isalpha;
+};
+
 ////--------------------------- AGC regs -----------------------------------////
 
 #define AGC_BASE_ADDR		0x40600000
-#define AGC_BASE_SIZE		0x10000
+#define AGC_BASE_SIZE		0x30000		//registers and the spectrum mode histogram windows
+#define AGC_FIFO_SIZE		300		//FIFO_size of bitstreams up to v1.5 and of the emulator, newer ones report theirs in h40
+#define AGC_DMA_ADDR		0x1E000000	//DDR ring for DDR mode, must be kept out of Linux memory (reserved-memory or mem= boot argument)
+#define AGC_DMA_SIZE		0x00200000	//in bytes, power of two
+#define AGC_ID			0x41474315	//AGC_ID in ssla.v: "AGC" and the version (1.5), the last released bitstream
+#define AGC_HIST_SIZE		16384		//spectrum mode histogram bins, one per raw ADC code
+#define AGC_HIST_ALPHA		0x10000		//address of the alpha histogram window (AGC_HIST_SIZE x uint32_t)
+#define AGC_HIST_GAMMA		0x20000
+#define AGC_IRQ_TIMEOUT		5		//ms, peaks below the watermark are read at least this often
 
 struct _par_str{
 	uint32_t cntr_thresh_alpha;			//address: h00
@@ -48,24 +69,106 @@ struct _par_str{
 	                  				// b31-0 : number of lost samples (32 bit unsigned)
 	uint32_t mes_in_queue;				//address: h18
 	                      				// b31-16 : maximum number of samples in queue at any time since laste reset (16 bit unsigned) , b15-0 : number of samples currently in queue (16 bit unsigned)											
-	uint32_t UNU0;					//address: h1C
-	              					// Unused
+	uint32_t agc_id;				//address: h1C
+	                				// b31-0 : AGC_ID, bitstreams before this register read 0
 	uint32_t mes_data;				//address: h20
 	                  				// b31 : mes_isd (1=new, 0=empty), b30 : type (0 = alpha, 1 = gamma), b29-16 :  amplitude (14 bit signed), b15-b0 : empty (0s)
 	uint32_t mes_timestamp_l;			//address: h24	
 	                         			// 32bit unsigned int	lower part [31:0] of 64 bit unsigned timestamp			
 	uint32_t mes_timestamp_h;			//address: h28	
 	                         			// 32bit unsigned int	higher part [63:32] of 64 bit unsigned timestamp	##READING OF THIS REGISTER CLEARS THIS PEAK FROM FIFO##						
+	uint32_t dma_ctrl;				//address: h2C
+	                  				// b0 : DDR mode, peaks go to the DDR ring instead of registers h20-h28
+	uint32_t dma_start;				//address: h30
+	                   				// b31-0 : ring physical address (16 byte aligned)
+	uint32_t dma_size;				//address: h34
+	                  				// b31-0 : ring size in bytes (multiple of 16)
+	uint32_t dma_head;				//address: h38
+	                  				// b31-0 : byte offset of the next record the FPGA will write (read only)
+	uint32_t dma_tail;				//address: h3C
+	                  				// b31-0 : byte offset of the first record not yet consumed, written by the CPU
+	uint32_t caps;					//address: h40
+	              					// b31-16 : FIFO size, b2 : interrupt available, b1 : spectrum mode available, b0 : DDR mode available (bitstreams up to v1.5 read 0)
+	uint32_t flt_window;				//address: h44
+	                    				// b31-0 : spectrum mode, a peak is forwarded if a peak of the other type is within this many cycles
+	uint32_t spec_ctrl;				//address: h48
+	                   				// b12-8 : filter time bucket size (log2 cycles, must exceed 2*flt_window), b1 : write 1 to clear the histograms (reads 1 while clearing), b0 : spectrum mode
+	uint32_t flt_delay;				//address: h4C
+	                   				// b31-0 : the filter decides this many cycles after the peak timestamp (flt_window + longest pulse)
+	uint32_t spec_alpha;				//address: h50
+	                    				// b31-0 : alphas added to the histogram since it was cleared (wraps around)
+	uint32_t spec_gamma;				//address: h54
+	                    				// b31-0 : gammas added to the histogram since it was cleared (wraps around)
+	uint32_t spec_filtered;				//address: h58
+	                       				// b31-0 : peaks dropped by the filter since the FIFO reset
+	uint32_t irq_level;				//address: h5C
+	                   				// b15-0 : interrupt while at least this many peaks wait (FIFO, and in DDR mode the ring), 0 = off
+};
+
+struct agc_record{					//DDR mode record, written by the FPGA
+	uint64_t timestamp;
+	uint32_t data;					//as register h20
+	uint32_t seq;					//1 for the first record after a FIFO reset, written last
 };
 
 _par_str *AGC = NULL;	//parameters
 
+#include "fpga_emu.cpp"
+agc_source* _emu_src = NULL;
+agc_emu* AGC_emu = NULL;	//if set, registers are served by the emulator instead of /dev/mem
+
+#define AGC_RD(reg)	(AGC_emu?AGC_emu->read(offsetof(_par_str,reg)):((volatile _par_str*)AGC)->reg)
+#define AGC_RD_ADDR(a)	(AGC_emu?AGC_emu->read(a):((volatile uint32_t*)AGC)[(a)/4])	//for the histogram windows
+#define AGC_WR(reg,v)	do{if (AGC_emu) AGC_emu->write(offsetof(_par_str,reg),v); else ((volatile _par_str*)AGC)->reg=(v);}while(0)
+
 ////------------------------------------------------------------------------////
 
 int _mem_fd = -1;
+agc_record* _dma_ring = NULL;
+uint32_t _dma_n, _dma_tail, _dma_seq;	//ring size and next record to read, in records
+bool AGC_dma = false;			//DDR mode is on, read peaks with AGC_dma_get_samples
+bool AGC_spec = false;			//spectrum mode is on, read the spectra with AGC_spectrum_read and merge them with AGC_spectrum_merge
+uint32_t *_spec_bins = NULL;		//histogram bins at the previous and at the last read, each alphas then gammas
+uint32_t _spec_last_alpha, _spec_last_gamma;
+uint64_t AGC_spec_alpha = 0;		//peaks histogrammed by the FPGA in this run, updated by AGC_spectrum_counts
+uint64_t AGC_spec_gamma = 0;
+int _uio_fd = -1;			//UIO device of the counter interrupt
+bool AGC_irq = false;			//interrupts are on, the FIFO reader sleeps in AGC_wait until the watermark is reached
+uint32_t _irq_level;
 
 int AGC_exit(void)
 {
+	if (AGC_irq)
+	{
+		AGC_WR(irq_level,0);
+		AGC_irq = false;
+	}
+	if (_uio_fd>=0)
+	{
+		close(_uio_fd);
+		_uio_fd=-1;
+	}
+	if (AGC_dma)
+	{
+		AGC_WR(dma_ctrl,0);
+		if (!AGC_emu && munmap(_dma_ring, AGC_DMA_SIZE) < 0) {fprintf(stderr, "munmap() failed: %s\n", strerror(errno)); return -1;}
+		_dma_ring = NULL;
+		AGC_dma = false;
+	}
+	if (AGC_spec)
+	{
+		AGC_WR(spec_ctrl,0);
+		delete[] _spec_bins;
+		_spec_bins = NULL;
+		AGC_spec = false;
+	}
+	if (AGC_emu)
+	{
+		delete AGC_emu;
+		delete _emu_src;
+		AGC_emu = NULL;
+		_emu_src = NULL;
+	}
 	if(AGC)
 	{
 		if(munmap(AGC, AGC_BASE_SIZE) < 0)
@@ -75,7 +178,7 @@ int AGC_exit(void)
 	if (_mem_fd>=0)
 	{
 		close (_mem_fd);
-		_mem_fd=0;
+		_mem_fd=-1;
 	}
 	return 0;
 }
@@ -98,24 +201,190 @@ int AGC_init(void)
 	return 0;
 }
 
+bool AGC_loaded()	//true if the FPGA already holds the bitstream matching this program
+{
+	FILE* f=fopen("/sys/devices/soc0/amba/f8007000.devcfg/prog_done","r");	//accessing the PL of an unprogrammed FPGA hangs the CPU
+	if (f==NULL) return false;
+	int done=0;
+	if (fscanf(f,"%d",&done)!=1) done=0;
+	fclose(f);
+	if (!done) return false;
+	if (AGC_init()) return false;
+	bool ret=(AGC_RD(agc_id)==AGC_ID);
+	AGC_exit();
+	return ret;
+}
+
+int AGC_init_emu(double rate_alpha, double rate_gamma)	//use the emulator instead of the FPGA, rates in peaks per second
+{
+	_emu_src = new poisson_source(rate_alpha, rate_gamma);
+	AGC_emu = new agc_emu(_emu_src);
+	if (getenv("AGC_EMU_CAPS")) AGC_emu->set_caps(strtoul(getenv("AGC_EMU_CAPS"),NULL,0));	//0: test against the released bitstream
+	AGC_emu->start();
+	return 0;
+}
+
 void AGC_reset_fifo()
 {
-	AGC->reset_fifo=0;
+	if (AGC_spec){				//the histograms restart too, so they hold the same peaks as the rest of the run
+		AGC_WR(spec_ctrl,AGC_RD(spec_ctrl)|2);
+		while (AGC_RD(spec_ctrl)&2) usleep(100);	//clearing takes 131 us
+		memset(_spec_bins,0,4*AGC_HIST_SIZE*sizeof(uint32_t));
+		_spec_last_alpha=_spec_last_gamma=0;
+	}
+	if (AGC_dma){				//the ring has to be cleared too, old records could match the restarted sequence numbers
+		AGC_WR(dma_ctrl,0);
+		AGC_WR(reset_fifo,0);
+		memset(_dma_ring,0,_dma_n*sizeof(agc_record));
+		_dma_tail=0;
+		_dma_seq=1;
+		AGC_WR(dma_tail,0);
+		AGC_WR(dma_ctrl,1);
+	}
+	else AGC_WR(reset_fifo,0);
+}
+
+bool _dma_range_reserved()	//true if /proc/iomem shows the DDR ring outside of System RAM or inside a reserved entry
+{
+	FILE* f=fopen("/proc/iomem","r");
+	if (f==NULL) {fprintf(stderr, "fopen(/proc/iomem) failed: %s\n", strerror(errno)); return false;}
+	const unsigned long long a=AGC_DMA_ADDR, b=AGC_DMA_ADDR+AGC_DMA_SIZE-1;
+	unsigned long long s,e;
+	char name[64];
+	bool any=false, ram=false, reserved=false;
+	while (fscanf(f," %llx-%llx : %63[^\n]",&s,&e,name)==3){
+		if (e) any=true;				//all addresses read 0 without CAP_SYS_ADMIN
+		if (s>b || e<a) continue;
+		if (!strcmp(name,"System RAM")) ram=true;
+		else if (!strcasecmp(name,"reserved") && s<=a && e>=b) reserved=true;
+	}
+	fclose(f);
+	if (!any) fprintf(stderr, "/proc/iomem shows no addresses, cannot check the DDR ring.\n");
+	return any && (!ram || reserved);
+}
+
+int AGC_dma_init()	//switches to DDR mode, returns 0 on success, 1 if the bitstream does not support it
+{
+	if (!(AGC_RD(caps)&1)) return 1;
+	if (AGC_emu) _dma_ring=AGC_emu->dma_buffer(AGC_DMA_SIZE);
+	else{
+		if (!_dma_range_reserved()) {fprintf(stderr, "The DDR ring at 0x%X-0x%X is not reserved, the FPGA would overwrite Linux memory. Reserve it (reserved-memory node or mem= boot argument) or do not set AGC_DMA.\n", AGC_DMA_ADDR, AGC_DMA_ADDR+AGC_DMA_SIZE-1); return -1;}
+		void* ptr=mmap(NULL, AGC_DMA_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, _mem_fd, AGC_DMA_ADDR);	//O_SYNC: uncached, the FPGA writes bypass the CPU caches
+		if(ptr == MAP_FAILED) {fprintf(stderr, "mmap() of the DDR ring failed: %s\n", strerror(errno)); return -1;}
+		_dma_ring=(agc_record*)ptr;
+	}
+	_dma_n=AGC_DMA_SIZE/sizeof(agc_record);
+	AGC_WR(dma_ctrl,0);
+	AGC_WR(dma_start,AGC_DMA_ADDR);
+	AGC_WR(dma_size,AGC_DMA_SIZE);
+	AGC_dma=true;
+	AGC_reset_fifo();
+	return 0;
+}
+
+int AGC_spectrum_init(uint32_t window, uint32_t delay)	//switches to spectrum mode, returns 0 on success, 1 if the bitstream does not support it
+{
+	if (!(AGC_RD(caps)&2)) return 1;
+	uint32_t shift=0;
+	while (shift<31 && ((uint64_t)1<<shift)<=2*(uint64_t)window) shift++;	//both ends of the window in at most two buckets
+	AGC_WR(flt_window,window);
+	AGC_WR(flt_delay,delay);
+	AGC_WR(spec_ctrl,(shift<<8)|1);
+	_spec_bins=new uint32_t[4*AGC_HIST_SIZE];
+	AGC_spec_alpha=AGC_spec_gamma=0;
+	AGC_spec=true;
+	AGC_reset_fifo();
+	return 0;
+}
+
+void AGC_spectrum_read()	//reads the FPGA histograms, call more often than every 2^32 counts in a bin
+{
+	memcpy(_spec_bins,_spec_bins+2*AGC_HIST_SIZE,2*AGC_HIST_SIZE*sizeof(uint32_t));
+	uint32_t* now=_spec_bins+2*AGC_HIST_SIZE;
+	for (uint32_t r=0;r!=AGC_HIST_SIZE;r++){
+		now[r]=AGC_RD_ADDR(AGC_HIST_ALPHA+4*r);
+		now[AGC_HIST_SIZE+r]=AGC_RD_ADDR(AGC_HIST_GAMMA+4*r);
+	}
+}
+
+int _uio_open()		//the UIO device of the counter (AGC_UIO, or the one named agc in the device tree), -1 if there is none
+{
+	const char* dev=getenv("AGC_UIO");
+	if (dev) return open(dev, O_RDWR);
+	DIR* d=opendir("/sys/class/uio");
+	if (d==NULL) return -1;
+	int fd=-1;
+	for (struct dirent* e;fd<0 && (e=readdir(d))!=NULL;){
+		if (e->d_name[0]=='.') continue;
+		char name[64]="";
+		FILE* f=fopen((std::string("/sys/class/uio/")+e->d_name+"/name").c_str(),"r");
+		if (f==NULL) continue;
+		if (fscanf(f,"%63s",name)!=1) name[0]=0;
+		fclose(f);
+		if (!strcmp(name,"agc")) fd=open((std::string("/dev/")+e->d_name).c_str(), O_RDWR);
+	}
+	closedir(d);
+	return fd;
+}
+
+int AGC_irq_init(uint32_t level)	//the FIFO reader sleeps until level peaks wait, returns 0 on success, 1 if the bitstream or the kernel does not support it
+{
+	if (!(AGC_RD(caps)&4)) return 1;
+	_uio_fd=AGC_emu?AGC_emu->uio_fd():_uio_open();
+	if (_uio_fd<0) return 1;
+	if (level==0) level=1;
+	_irq_level=level;
+	AGC_WR(irq_level,level);
+	AGC_irq=true;
+	return 0;
+}
+
+void _spectrum_merge(const uint32_t* last, const uint32_t* now, uint64_t* array, unsigned ENmax, int thresh, bool edge)
+{
+	for (uint32_t r=0;r!=AGC_HIST_SIZE;r++){
+		int amp=(r&0x2000)?(int)r-0x4000:(int)r;
+		unsigned e=edge?(unsigned)(thresh-amp):(unsigned)(amp-thresh);	//as in the event kernel
+		if (e>=ENmax) continue;
+		array[e]+=(uint32_t)(now[r]-last[r]);					//wrap safe
+	}
+}
+
+void AGC_spectrum_merge(uint64_t* alpha_array, unsigned ENmax_alpha, int alpha_thresh, bool alpha_edge,
+                        uint64_t* gamma_array, unsigned ENmax_gamma, int gamma_thresh, bool gamma_edge)	//adds the counts between the last two reads
+{
+	const uint32_t* now=_spec_bins+2*AGC_HIST_SIZE;
+	_spectrum_merge(_spec_bins,now,alpha_array,ENmax_alpha,alpha_thresh,alpha_edge);
+	_spectrum_merge(_spec_bins+AGC_HIST_SIZE,now+AGC_HIST_SIZE,gamma_array,ENmax_gamma,gamma_thresh,gamma_edge);
+}
+
+void AGC_spectrum_counts()	//updates AGC_spec_alpha and AGC_spec_gamma, call more often than every 2^32 peaks
+{
+	uint32_t na=AGC_RD(spec_alpha), ng=AGC_RD(spec_gamma);
+	AGC_spec_alpha+=na-_spec_last_alpha;
+	AGC_spec_gamma+=ng-_spec_last_gamma;
+	_spec_last_alpha=na;
+	_spec_last_gamma=ng;
 }
 
 inline uint32_t AGC_get_num_lost()
 {
-	return AGC->mes_lost;
+	return AGC_RD(mes_lost);
 }
 
 inline uint16_t AGC_get_in_queue()	
 {
-	return (AGC->mes_in_queue&0x0000FFFF);
+	return (AGC_RD(mes_in_queue)&0x0000FFFF);
 }
 
 inline uint16_t AGC_get_max_in_queue()
 {
-	return (AGC->mes_in_queue&0xFFFF0000)>>16;
+	return (AGC_RD(mes_in_queue)&0xFFFF0000)>>16;
+}
+
+inline uint32_t AGC_get_fifo_size()
+{
+	uint32_t size=AGC_RD(caps)>>16;
+	return size?size:AGC_FIFO_SIZE;
 }
 
 int AGC_setup(int cntr_thresh_alpha, int cntr_thresh_gamma, bool cntr_edge_alpha, bool cntr_edge_gamma, uint32_t cntr_mintime_alpha, uint32_t cntr_mintime_gamma)	
@@ -124,24 +393,102 @@ int AGC_setup(int cntr_thresh_alpha, int cntr_thresh_gamma, bool cntr_edge_alpha
 	else if (cntr_thresh_alpha<-8192) cntr_thresh_alpha=-8192;		//if threshold is negative the peak is assumed to be inverted
 	if (cntr_thresh_gamma>8191) cntr_thresh_gamma=8191;
 	else if (cntr_thresh_gamma<-8192) cntr_thresh_gamma=-8192;
-	AGC->cntr_thresh_alpha = (cntr_thresh_alpha&0x3FFF)|(cntr_edge_alpha?0x4000:0);
-	AGC->cntr_thresh_gamma = (cntr_thresh_gamma&0x3FFF)|(cntr_edge_gamma?0x4000:0);
-	AGC->cntr_mintime_alpha = cntr_mintime_alpha;				//time is: cntr_mintime_alpha * 8 ns  (32bit unsigned)
-	AGC->cntr_mintime_gamma = cntr_mintime_gamma;
+	AGC_WR(cntr_thresh_alpha, (cntr_thresh_alpha&0x3FFF)|(cntr_edge_alpha?0x4000:0));
+	AGC_WR(cntr_thresh_gamma, (cntr_thresh_gamma&0x3FFF)|(cntr_edge_gamma?0x4000:0));
+	AGC_WR(cntr_mintime_alpha, cntr_mintime_alpha);				//time is: cntr_mintime_alpha * 8 ns  (32bit unsigned)
+	AGC_WR(cntr_mintime_gamma, cntr_mintime_gamma);
 	return 0;
 }
 
 inline int AGC_get_sample(bool *isalpha, int *amplitude, uint64_t *timestamp)
 {
 	uint32_t temp;
-	temp=AGC->mes_data;
+	temp=AGC_RD(mes_data);
 	if (!(temp&0x80000000)) return 1;					//nothing in queue, return 1
 	if (temp&0x40000000) *isalpha=false;
 	else *isalpha=true;
 	*amplitude = (temp&0x3FFF0000)>>16;
 	if (*amplitude&0x2000) *amplitude^=0xFFFFC000;
-	*timestamp=AGC->mes_timestamp_l;
-	*timestamp|=(uint64_t)AGC->mes_timestamp_h<<32;
+	*timestamp=AGC_RD(mes_timestamp_l);
+	*timestamp|=(uint64_t)AGC_RD(mes_timestamp_h)<<32;
 	return 0;								//new data was returned
 }
 
+
+std::atomic<uint64_t> AGC_stat_reads(0);	//number of register accesses done by AGC_get_samples and AGC_dma_get_samples
+std::atomic<uint64_t> AGC_stat_samples(0);	//number of peaks returned by AGC_get_samples
+std::atomic<uint64_t> AGC_stat_polls(0);	//number of AGC_get_samples calls that returned peaks
+std::atomic<uint64_t> AGC_stat_empty(0);	//number of AGC_get_samples calls that returned nothing
+
+int AGC_get_samples(peak *buffer, int max)	//returns the number of peaks written to buffer (0 if the queue is empty)
+{
+	int n=AGC_get_in_queue();
+	if (n>max) n=max;
+	int i;
+	uint32_t temp;
+	for (i=0;i!=n;i++){
+		temp=AGC_RD(mes_data);
+		if (!(temp&0x80000000)) break;					//peak is counted in queue but has not yet reached the end of the FIFO shift register
+		buffer[i].isalpha=!(temp&0x40000000);
+		buffer[i].amp = (temp&0x3FFF0000)>>16;
+		if (buffer[i].amp&0x2000) buffer[i].amp^=0xFFFFC000;
+		buffer[i].time=AGC_RD(mes_timestamp_l);
+		buffer[i].time|=(uint64_t)AGC_RD(mes_timestamp_h)<<32;
+	}
+	AGC_stat_reads.fetch_add(1+3*i+(i!=n),std::memory_order_relaxed);
+	AGC_stat_samples.fetch_add(i,std::memory_order_relaxed);
+	if (i) AGC_stat_polls.fetch_add(1,std::memory_order_relaxed);
+	else AGC_stat_empty.fetch_add(1,std::memory_order_relaxed);
+	return i;
+}
+
+int AGC_dma_get_samples(peak *buffer, int max)	//DDR mode AGC_get_samples, reads the records in place, returns the number of peaks written to buffer
+{
+	int i;
+	uint32_t temp;
+	for (i=0;i!=max;i++){
+		agc_record* r=_dma_ring+_dma_tail;
+		if (__atomic_load_n(&r->seq,__ATOMIC_ACQUIRE)!=_dma_seq) break;	//not written yet
+		temp=r->data;
+		buffer[i].isalpha=!(temp&0x40000000);
+		buffer[i].amp = (temp&0x3FFF0000)>>16;
+		if (buffer[i].amp&0x2000) buffer[i].amp^=0xFFFFC000;
+		buffer[i].time=r->timestamp;
+		_dma_tail=(_dma_tail+1)&(_dma_n-1);
+		_dma_seq++;
+	}
+	if (i) AGC_WR(dma_tail,_dma_tail*sizeof(agc_record));	//one register write per batch
+	AGC_stat_reads.fetch_add(i!=0,std::memory_order_relaxed);
+	AGC_stat_samples.fetch_add(i,std::memory_order_relaxed);
+	if (i) AGC_stat_polls.fetch_add(1,std::memory_order_relaxed);
+	else AGC_stat_empty.fetch_add(1,std::memory_order_relaxed);
+	return i;
+}
+
+inline double AGC_reads_per_peak()		//register reads per peak read so far, 0 before the first peak
+{
+	uint64_t n=AGC_stat_samples;
+	return n?(double)AGC_stat_reads/n:0;
+}
+
+void AGC_backoff(unsigned idle)		//call with the number of consecutive empty AGC_get_samples calls
+{
+	if (idle<64) return;						//spin first, peaks usually come in bursts
+	else if (idle<128) sched_yield();
+	else usleep(idle<256?10:50);					//the 300 peak FIFO fills in >3 ms at 100 kHz, so never sleep long
+}
+
+std::atomic<uint64_t> AGC_stat_irqs(0);		//number of interrupts AGC_wait woke up on
+std::atomic<uint64_t> AGC_stat_irq_missed(0);	//AGC_wait timeouts with the FIFO at the watermark, the interrupt should have fired
+
+void AGC_wait(unsigned idle)		//FIFO reader: call with the number of consecutive empty reads, as AGC_backoff
+{
+	if (!AGC_irq) {AGC_backoff(idle); return;}
+	uint32_t v=1;
+	if (write(_uio_fd,&v,sizeof(v))!=sizeof(v)) {AGC_backoff(idle); return;}	//unmasks the interrupt, it fires right away if the watermark is already reached
+	struct pollfd p;
+	p.fd=_uio_fd; p.events=POLLIN; p.revents=0;
+	int r=poll(&p,1,AGC_IRQ_TIMEOUT);
+	if (r>0 && read(_uio_fd,&v,sizeof(v))==sizeof(v)) AGC_stat_irqs.fetch_add(1,std::memory_order_relaxed);
+	else if (r==0 && (AGC_RD(mes_in_queue)&0xFFFF)>=_irq_level) AGC_stat_irq_missed.fetch_add(1,std::memory_order_relaxed);
+}
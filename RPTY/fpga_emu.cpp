@@ -0,0 +1,401 @@
+/*
+    Alpha Gamma Counter
+    Copyright (C) 2017  Mario Vretenar
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <cstddef>
+#include <deque>
+#include <queue>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <functional>
+#include <algorithm>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+////------------------------- AGC register block emulator ---------------------////
+// Software stand-in for the ssla.v register block, so the whole pipeline runs on any Linux machine.
+// A thread injects peaks in real time (125 MHz timestamps from the wall clock since the last FIFO
+// reset) and reproduces the FIFO semantics: FIFO_size entries, mes_lost counting peaks that do not
+// fit, max_mes_in_FIFO high-water mark, a new entry becoming readable only after it has shifted
+// through the FIFO, and reading mes_timestamp_h popping the oldest entry.
+// Like in the FPGA a peak is stored when it ends, its timestamp is when it started, so entries
+// are not in chronological order.
+// DDR mode is emulated as well, with the ring in a buffer allocated by the emulator, and so is spectrum
+// mode: histograms, counters and the time bucket coincidence filter work like in ssla.v.
+// The interrupt comes through a fake UIO file descriptor (one end of a socket pair) that behaves like
+// /dev/uioN with uio_pdrv_genirq: writing 1 unmasks the interrupt, when it fires it is masked again and
+// the interrupt count becomes readable.
+// Instead of the wall clock the emulator can run on a manual clock, moved by advance() without
+// starting the thread. The same source then gives the same peaks at the same reads, for checks.
+
+inline uint64_t emu_peak_end(const peak& pk, uint32_t mintime)	//cycle a peak ends and gets stored, a pseudo random pulse width
+{
+	return pk.time+((mintime<1250)?mintime:1250)+(pk.time&0xFF);
+}
+
+class agc_source{			//generates peaks in chronological order
+public:
+	virtual ~agc_source() {}
+	virtual void reset() = 0;
+	virtual peak next(int thresh_alpha, bool falling_alpha, int thresh_gamma, bool falling_gamma) = 0;
+};
+
+class poisson_source: public agc_source{	//independent alphas and gammas with flat amplitude spectra
+public:
+	poisson_source(double rate_alpha, double rate_gamma): ra(rate_alpha/125e6), rg(rate_gamma/125e6), rng(1) {reset();}
+	void reset() {ta=_step(ra); tg=_step(rg);}
+	peak next(int thresh_alpha, bool falling_alpha, int thresh_gamma, bool falling_gamma)
+	{
+		peak pk;
+		pk.isalpha=(ta<=tg);
+		pk.time=pk.isalpha?ta:tg;
+		if (pk.isalpha) {ta+=_step(ra); pk.amp=_amp(thresh_alpha,falling_alpha);}
+		else {tg+=_step(rg); pk.amp=_amp(thresh_gamma,falling_gamma);}
+		return pk;
+	}
+protected:
+	double ra, rg;
+	uint64_t ta, tg;
+	std::mt19937_64 rng;
+	uint64_t _step(double rate) {return (rate>0)?1+(uint64_t)std::exponential_distribution<double>(rate)(rng):UINT64_MAX/2;}
+	int _amp(int thresh, bool falling)
+	{
+		if (!falling) return std::uniform_int_distribution<int>(thresh,8191)(rng);
+		else return std::uniform_int_distribution<int>(-8192,thresh)(rng);
+	}
+};
+
+struct source_conf{
+	double rate_alpha;		//peaks per second
+	double rate_gamma;		//uncorrelated background gammas per second
+	double cascade_prob;		//probability that an alpha is followed by a gamma
+	double cascade_tau;		//mean alpha->gamma delay, in clock cycles
+	double alpha_amp, alpha_sigma;	//gaussian amplitude lines, on top of a flat background
+	double gamma_amp, gamma_sigma;
+	double flat;			//fraction of peaks with a flat amplitude spectrum
+};
+
+class cascade_source: public poisson_source{	//Am-241 like source: alphas each followed by a delayed gamma with cascade_prob
+public:
+	cascade_source(const source_conf& c): poisson_source(c.rate_alpha, c.rate_gamma), c(c) {}
+	void reset()
+	{
+		poisson_source::reset();
+		while (!cascade.empty()) cascade.pop();
+	}
+	peak next(int thresh_alpha, bool falling_alpha, int thresh_gamma, bool falling_gamma)
+	{
+		peak pk;
+		uint64_t tc=cascade.empty()?UINT64_MAX:cascade.top();	//cascade gammas of later alphas can only be later than ta
+		pk.isalpha=(ta<=tg && ta<=tc);
+		if (pk.isalpha){
+			pk.time=ta;
+			pk.amp=_line(c.alpha_amp,c.alpha_sigma,thresh_alpha,falling_alpha);
+			ta+=_step(ra);
+			if (std::uniform_real_distribution<double>(0,1)(rng)<c.cascade_prob)
+				cascade.push(pk.time+(uint64_t)std::exponential_distribution<double>(1/c.cascade_tau)(rng));
+			return pk;
+		}
+		if (tc<=tg) {pk.time=tc; cascade.pop();}
+		else {pk.time=tg; tg+=_step(rg);}
+		pk.amp=_line(c.gamma_amp,c.gamma_sigma,thresh_gamma,falling_gamma);
+		return pk;
+	}
+protected:
+	source_conf c;
+	std::priority_queue<uint64_t, std::vector<uint64_t>, std::greater<uint64_t> > cascade;	//times of pending cascade gammas
+	int _line(double amp, double sigma, int thresh, bool falling)
+	{
+		if (std::uniform_real_distribution<double>(0,1)(rng)<c.flat) return _amp(thresh,falling);
+		int a=(int)std::normal_distribution<double>(amp,sigma)(rng);
+		if (!falling) return (a<thresh)?thresh:(a>8191)?8191:a;
+		a=-a;
+		return (a>thresh)?thresh:(a<-8192)?-8192:a;
+	}
+};
+
+class agc_emu{
+public:
+	agc_emu(agc_source* src, bool manual=false): src(src), thresh_alpha(0x1FFF), thresh_gamma(0x1FFF), mintime_alpha(0xFFFFFFFF), mintime_gamma(0xFFFFFFFF),
+	                          dma_en(false), dma_size(16), dma_tail(0), spec_ctrl(0x800), flt_window(0), flt_delay(0),
+	                          hist(2*AGC_HIST_SIZE,0), flt(2*1024,0), spec_alpha(0), spec_gamma(0), irq_level(0), irq_fd(-1), irq_on(true), irq_count(0), reads(0), stop(false), manual(manual), clock(0), caps(7) {reset();}
+	~agc_emu()
+	{
+		end();
+		if (irq_fd>=0) close(irq_fd);
+	}
+	
+	agc_record* dma_buffer(size_t size)	//the DDR ring, the address written to dma_start is ignored
+	{
+		std::lock_guard<std::mutex> lk(mx);
+		dma_mem.assign(size/sizeof(agc_record),agc_record());
+		return dma_mem.data();
+	}
+	
+	int uio_fd()				//the file descriptor to use as the UIO device, -1 on error
+	{
+		std::lock_guard<std::mutex> lk(mx);
+		int sv[2];
+		if (irq_fd>=0 || socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) return -1;
+		fcntl(sv[1], F_SETFL, O_NONBLOCK);
+		irq_fd=sv[1];
+		return sv[0];
+	}
+	
+	void set_caps(uint32_t c)		//features in h40: b0 DDR, b1 spectrum, b2 interrupt, 0 reads like the released v1.5 bitstream
+	{
+		std::lock_guard<std::mutex> lk(mx);
+		caps=c&7;
+	}
+	
+	void start() {thr=std::thread(&agc_emu::_run,this);}
+	void advance(uint64_t cycles)		//manual clock: moves it and does what the thread would in that time
+	{
+		std::lock_guard<std::mutex> lk(mx);
+		clock+=cycles;
+		_tick();
+	}
+	void end()
+	{
+		stop=true;
+		if (thr.joinable()) thr.join();
+	}
+	
+	uint32_t read(unsigned addr)
+	{
+		std::lock_guard<std::mutex> lk(mx);
+		reads++;
+		if (addr>=AGC_HIST_ALPHA && addr<AGC_HIST_GAMMA+4*AGC_HIST_SIZE) return hist[(addr-AGC_HIST_ALPHA)/4%AGC_HIST_SIZE+((addr>=AGC_HIST_GAMMA)?AGC_HIST_SIZE:0)];
+		switch (addr){
+			case 0x00: return thresh_alpha;
+			case 0x04: return thresh_gamma;
+			case 0x08: return mintime_alpha;
+			case 0x0C: return mintime_gamma;
+			case 0x14: return lost;
+			case 0x18: return ((uint32_t)max_in_fifo<<16)|fifo.size();
+			case 0x1C: return caps?AGC_ID:0;
+			case 0x20: if (!_visible()) return 0;
+			           return 0x80000000|(fifo.front().pk.isalpha?0:0x40000000)|((fifo.front().pk.amp&0x3FFF)<<16);
+			case 0x24: return _visible()?(uint32_t)fifo.front().pk.time:0;
+			case 0x28: if (!_visible()) return 0;
+			           {uint32_t v=fifo.front().pk.time>>32; if (!dma_en) fifo.pop_front(); return v;}
+			case 0x2C: return dma_en;
+			case 0x34: return dma_size;
+			case 0x38: return dma_head;
+			case 0x3C: return dma_tail;
+			case 0x40: return caps?((AGC_FIFO_SIZE<<16)|caps):0;
+			case 0x44: return flt_window;
+			case 0x48: return spec_ctrl;
+			case 0x4C: return flt_delay;
+			case 0x50: return spec_alpha;
+			case 0x54: return spec_gamma;
+			case 0x58: return spec_filtered;
+			case 0x5C: return irq_level;
+			default: return 0;
+		}
+	}
+	
+	void write(unsigned addr, uint32_t v)
+	{
+		std::lock_guard<std::mutex> lk(mx);
+		switch (addr){
+			case 0x00: thresh_alpha=v&0x7FFF; break;
+			case 0x04: thresh_gamma=v&0x7FFF; break;
+			case 0x08: mintime_alpha=v; break;
+			case 0x0C: mintime_gamma=v; break;
+			case 0x10: reset(); break;
+			case 0x2C: dma_en=v&1; break;
+			case 0x34: dma_size=v&~0xF; break;
+			case 0x3C: dma_tail=v; break;
+			case 0x44: flt_window=v; break;
+			case 0x48: spec_ctrl=v&0x1F01;
+			           if (v&2) {std::fill(hist.begin(),hist.end(),0); spec_alpha=spec_gamma=0;}	//instantly
+			           break;
+			case 0x4C: flt_delay=v; break;
+			case 0x5C: irq_level=v&0xFFFF; break;
+		}
+	}
+	
+	uint64_t num_reads()
+	{
+		std::lock_guard<std::mutex> lk(mx);
+		return reads;
+	}
+	
+	double cpu_time()			//CPU seconds used by the emulator thread so far, for benchmarks to leave out
+	{
+		clockid_t c;
+		struct timespec ts;
+		if (!thr.joinable() || pthread_getcpuclockid(thr.native_handle(),&c) || clock_gettime(c,&ts)) return 0;
+		return ts.tv_sec+ts.tv_nsec*1e-9;
+	}
+	
+private:
+	struct _entry{
+		peak pk;
+		uint64_t when;			//pending: cycle it gets stored, in FIFO: cycle it reaches the output
+		bool fwd;			//passed the spectrum mode filter
+	};
+	struct _later{bool operator()(const _entry& a, const _entry& b) const {return a.when>b.when;}};
+	
+	agc_source* src;
+	std::mutex mx;
+	std::deque<_entry> fifo;
+	std::priority_queue<_entry, std::vector<_entry>, _later> pending;
+	uint32_t thresh_alpha, thresh_gamma, mintime_alpha, mintime_gamma;
+	uint32_t lost;
+	uint16_t max_in_fifo;
+	bool dma_en;
+	uint32_t dma_size, dma_tail, dma_head, dma_seq;
+	std::vector<agc_record> dma_mem;
+	uint32_t spec_ctrl, flt_window, flt_delay;
+	std::vector<uint32_t> hist;		//alphas then gammas
+	std::vector<uint32_t> flt;		//bucket tables, alphas then gammas
+	uint32_t spec_alpha, spec_gamma, spec_filtered;
+	uint32_t irq_level;
+	int irq_fd;				//emulator end of the fake UIO device
+	bool irq_on;				//unmasked
+	uint32_t irq_count;
+	uint64_t reads;				//register reads so far, what MMIO reads cost on the board
+	std::chrono::steady_clock::time_point t0;
+	peak nextpk;
+	std::thread thr;
+	std::atomic<bool> stop;
+	bool manual;				//time is clock instead of the wall clock
+	uint64_t clock;
+	uint32_t caps;
+	
+	uint64_t _now() {return manual?clock:std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now()-t0).count()/8;}
+	bool _visible()			//also applies the spectrum mode filter to the oldest entry
+	{
+		uint64_t now=_now();
+		while (!fifo.empty() && fifo.front().when<=now){
+			_entry& e=fifo.front();
+			if (!(spec_ctrl&1) || e.fwd) return true;
+			if (now-e.pk.time<flt_delay) return false;
+			unsigned shift=(spec_ctrl>>8)&0x1F;
+			const uint32_t* other=flt.data()+(e.pk.isalpha?1024:0);
+			uint64_t lo=((e.pk.time>flt_window)?e.pk.time-flt_window:0)>>shift, hi=(e.pk.time+flt_window)>>shift;
+			if (now-e.pk.time+flt_window>=((uint64_t)1023<<shift) || other[lo&1023]==(uint32_t)lo || other[hi&1023]==(uint32_t)hi) e.fwd=true;
+			else {fifo.pop_front(); spec_filtered++;}
+		}
+		return false;
+	}
+	void _save(const peak& pk)		//spectrum mode part of saving a peak, also for peaks that do not fit in the FIFO
+	{
+		if (!(spec_ctrl&1)) return;
+		hist[(pk.amp&0x3FFF)+(pk.isalpha?0:AGC_HIST_SIZE)]++;
+		if (pk.isalpha) spec_alpha++;
+		else spec_gamma++;
+		uint32_t bucket=pk.time>>((spec_ctrl>>8)&0x1F);
+		flt[(bucket&1023)+(pk.isalpha?0:1024)]=bucket;
+	}
+	
+	void _dma_drain()			//with mx locked
+	{
+		if (!dma_en || dma_mem.empty()) return;
+		uint32_t size=std::min<uint32_t>(dma_size,dma_mem.size()*sizeof(agc_record));
+		while (_visible()){
+			uint32_t used=(dma_head>=dma_tail)?dma_head-dma_tail:dma_head+size-dma_tail;
+			if (used>=size-sizeof(agc_record)) return;				//ring full, peaks wait in the FIFO
+			agc_record& r=dma_mem[dma_head/sizeof(agc_record)];
+			const peak& pk=fifo.front().pk;
+			r.timestamp=pk.time;
+			r.data=0x80000000|(pk.isalpha?0:0x40000000)|((pk.amp&0x3FFF)<<16);
+			__atomic_store_n(&r.seq,dma_seq++,__ATOMIC_RELEASE);
+			dma_head+=sizeof(agc_record);
+			if (dma_head>=size) dma_head=0;
+			fifo.pop_front();
+		}
+	}
+	void _irq()				//with mx locked
+	{
+		if (irq_fd<0) return;
+		uint32_t v;
+		while (::read(irq_fd,&v,sizeof(v))==sizeof(v)) irq_on=(v!=0);	//unmask/mask requests
+		if (!irq_on || !irq_level) return;
+		size_t pending=fifo.size();
+		if (dma_en && !dma_mem.empty()){
+			uint32_t size=std::min<uint32_t>(dma_size,dma_mem.size()*sizeof(agc_record));
+			pending+=((dma_head>=dma_tail)?dma_head-dma_tail:dma_head+size-dma_tail)/sizeof(agc_record);
+		}
+		if (pending<irq_level) return;
+		irq_on=false;				//masked by the kernel until the program unmasks it
+		irq_count++;
+		if (::write(irq_fd,&irq_count,sizeof(irq_count))!=sizeof(irq_count)) return;
+	}
+	int _thresh(uint32_t r) {int t=r&0x3FFF; return (t&0x2000)?t-0x4000:t;}
+	
+	void reset()			//with mx locked (or from the constructor)
+	{
+		fifo.clear();
+		while (!pending.empty()) pending.pop();
+		lost=0;
+		max_in_fifo=0;
+		spec_filtered=0;
+		dma_head=0;
+		dma_seq=1;
+		t0=std::chrono::steady_clock::now();
+		clock=0;
+		src->reset();
+		nextpk=src->next(_thresh(thresh_alpha),thresh_alpha&0x4000,_thresh(thresh_gamma),thresh_gamma&0x4000);
+	}
+	
+	void _tick()				//with mx locked
+	{
+		uint64_t now=_now();
+		while (nextpk.time<=now){					//peaks that started by now
+			_entry e;
+			e.pk=nextpk;
+			e.when=emu_peak_end(nextpk,nextpk.isalpha?mintime_alpha:mintime_gamma);
+			e.fwd=false;
+			pending.push(e);
+			nextpk=src->next(_thresh(thresh_alpha),thresh_alpha&0x4000,_thresh(thresh_gamma),thresh_gamma&0x4000);
+		}
+		while (!pending.empty() && pending.top().when<=now){		//peaks that ended by now
+			_entry e=pending.top();
+			pending.pop();
+			_save(e.pk);
+			if (fifo.size()>=AGC_FIFO_SIZE) {lost++; continue;}
+			e.when+=AGC_FIFO_SIZE-1-fifo.size();			//shifting through the FIFO
+			fifo.push_back(e);
+			if (fifo.size()>max_in_fifo) max_in_fifo=fifo.size();
+		}
+		_dma_drain();
+		_irq();
+	}
+	
+	void _run()
+	{
+		while (!stop){
+			{
+				std::lock_guard<std::mutex> lk(mx);
+				_tick();
+			}
+			usleep(10);
+		}
+	}
+};
@@ -0,0 +1,108 @@
+/*
+    Alpha Gamma Counter
+    Copyright (C) 2017  Mario Vretenar
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <stdint.h>
+
+////----------------------------- event kernel -----------------------------////
+// Processing of peaks released by the reorder stage: energy spectra and coincidences.
+// The kernel is specialized at compile time on the trigger edge of each channel (so the
+// distance from the threshold needs no abs()) and on whether each energy step is a power
+// of two (so the energy bin is a shift instead of a division). select_kernel() picks the
+// instantiation once after the configuration is loaded; the non power of two variants are
+// the generic path for arbitrary steps.
+// A peak on the wrong side of its threshold (not produced by the FPGA) is not counted.
+
+struct event_state{
+	int alpha_thresh;
+	int gamma_thresh;
+	unsigned step_alpha, shift_alpha;
+	unsigned step_gamma, shift_gamma;
+	unsigned ENmax_alpha;
+	unsigned ENmax_gamma;
+	uint64_t *alpha_array;
+	uint64_t *gamma_array;
+	coinc_engine *coinc;
+	uint64_t N_alpha;
+	uint64_t N_gamma;
+	uint64_t last_time;		//timestamp of the last processed peak
+};
+
+template <bool AFALL, bool GFALL, bool APOW2, bool GPOW2>
+inline void process_peak(event_state& st, const peak& pk)
+{
+	st.last_time=pk.time;
+	if (pk.isalpha){
+		st.N_alpha++;
+		unsigned e = AFALL ? (unsigned)(st.alpha_thresh-pk.amp) : (unsigned)(pk.amp-st.alpha_thresh);
+		if (e<st.ENmax_alpha) st.alpha_array[e]++;
+		st.coinc->add_alpha(pk.time, APOW2 ? (e>>st.shift_alpha) : (e/st.step_alpha));
+	}
+	else{
+		st.N_gamma++;
+		unsigned e = GFALL ? (unsigned)(st.gamma_thresh-pk.amp) : (unsigned)(pk.amp-st.gamma_thresh);
+		if (e<st.ENmax_gamma) st.gamma_array[e]++;
+		st.coinc->add_gamma(pk.time, GPOW2 ? (e>>st.shift_gamma) : (e/st.step_gamma));
+	}
+}
+
+template <bool AFALL, bool GFALL, bool APOW2, bool GPOW2>
+void process_released(event_state& st, reorder_buf& rb)		//processes all peaks the reorder stage can release
+{
+	peak pk;
+	while (!rb.pop(&pk)) process_peak<AFALL,GFALL,APOW2,GPOW2>(st,pk);
+}
+
+template <bool AFALL, bool GFALL, bool APOW2, bool GPOW2>
+void process_ordered(event_state& st, const peak* pks, size_t n)	//peaks already in chronological order (shared reorder stage)
+{
+	for (size_t i=0;i!=n;i++) process_peak<AFALL,GFALL,APOW2,GPOW2>(st,pks[i]);
+}
+
+typedef void (*kernel_fn)(event_state&, reorder_buf&);
+typedef void (*ordered_fn)(event_state&, const peak*, size_t);
+
+template <bool AFALL, bool GFALL, bool APOW2>
+kernel_fn _select_kernel_g(bool gpow2) {return gpow2 ? process_released<AFALL,GFALL,APOW2,true> : process_released<AFALL,GFALL,APOW2,false>;}
+template <bool AFALL, bool GFALL>
+kernel_fn _select_kernel_a(bool apow2, bool gpow2) {return apow2 ? _select_kernel_g<AFALL,GFALL,true>(gpow2) : _select_kernel_g<AFALL,GFALL,false>(gpow2);}
+
+kernel_fn select_kernel(event_state& st, bool alpha_edge, bool gamma_edge, bool generic=false)	//also sets the shifts in st, generic=true forces division
+{
+	bool apow2 = !generic && !(st.step_alpha&(st.step_alpha-1));
+	bool gpow2 = !generic && !(st.step_gamma&(st.step_gamma-1));
+	st.shift_alpha = __builtin_ctz(st.step_alpha);
+	st.shift_gamma = __builtin_ctz(st.step_gamma);
+	if (!alpha_edge) return gamma_edge ? _select_kernel_a<false,true>(apow2,gpow2) : _select_kernel_a<false,false>(apow2,gpow2);
+	else             return gamma_edge ? _select_kernel_a<true,true>(apow2,gpow2)  : _select_kernel_a<true,false>(apow2,gpow2);
+}
+
+template <bool AFALL, bool GFALL, bool APOW2>
+ordered_fn _select_ordered_g(bool gpow2) {return gpow2 ? process_ordered<AFALL,GFALL,APOW2,true> : process_ordered<AFALL,GFALL,APOW2,false>;}
+template <bool AFALL, bool GFALL>
+ordered_fn _select_ordered_a(bool apow2, bool gpow2) {return apow2 ? _select_ordered_g<AFALL,GFALL,true>(gpow2) : _select_ordered_g<AFALL,GFALL,false>(gpow2);}
+
+ordered_fn select_ordered_kernel(event_state& st, bool alpha_edge, bool gamma_edge, bool generic=false)	//as select_kernel()
+{
+	bool apow2 = !generic && !(st.step_alpha&(st.step_alpha-1));
+	bool gpow2 = !generic && !(st.step_gamma&(st.step_gamma-1));
+	st.shift_alpha = __builtin_ctz(st.step_alpha);
+	st.shift_gamma = __builtin_ctz(st.step_gamma);
+	if (!alpha_edge) return gamma_edge ? _select_ordered_a<false,true>(apow2,gpow2) : _select_ordered_a<false,false>(apow2,gpow2);
+	else             return gamma_edge ? _select_ordered_a<true,true>(apow2,gpow2)  : _select_ordered_a<true,false>(apow2,gpow2);
+}
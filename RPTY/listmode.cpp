@@ -0,0 +1,280 @@
+/*
+    Alpha Gamma Counter
+    Copyright (C) 2017  Mario Vretenar
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <cstdio>
+#include <cerrno>
+#include <cstring>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <stdint.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+
+////------------------------------- list mode -------------------------------////
+// Raw peak stream (in FIFO order, before reordering) recorded to a binary file as a sequence of
+// self-contained blocks:
+//	lm_block_header, followed by `nbytes` of peaks
+//	each peak: zigzag varint of the timestamp difference to the previous peak (the first one to
+//	`base_time`), then 2 bytes little endian: b13-b0 amplitude (14 bit signed), b14 type (1 = alpha)
+// Timestamps restart at 0 with every run, the first block of a run has LM_NEWRUN set.
+// Peaks are encoded by the processing thread into one of two large buffers; full buffers are
+// written by a separate thread. If the SD card falls behind and both buffers are full, peaks are
+// dropped (and counted in the next block header) instead of stalling acquisition.
+// The same blocks can be streamed over TCP to agc-collect (see collect.cpp), which merges the
+// peaks of several boards. The stream starts with an lm_hello, blocks are smaller and are also
+// sent when they are LM_STREAM_AGE old, so the collector does not have to wait for full blocks.
+
+#define LM_MAGIC	0x4C434741		//"AGCL"
+#define LM_NEWRUN	0x1
+#define LM_BLOCK_SIZE	(1<<20)			//payload bytes per block
+#define LM_MAX_PEAK	12			//max encoded size of one peak
+#define LM_HELLO_MAGIC	0x48434741		//"AGCH"
+#define LM_STREAM_BLOCK	(1<<16)			//payload bytes per block when streaming
+#define LM_STREAM_AGE	20			//ms
+
+struct lm_block_header{
+	uint32_t magic;
+	uint32_t nbytes;			//payload size
+	uint32_t npeaks;
+	uint32_t dropped;			//peaks dropped right before this block
+	uint64_t base_time;
+	uint32_t flags;
+	uint32_t reserved;
+};
+
+struct lm_hello{				//first thing sent on a stream
+	uint32_t magic;
+	uint32_t board;				//number of the board, chosen by the user
+	uint64_t start_ns;			//CLOCK_REALTIME when the timestamps were 0, aligns the boards roughly
+};
+
+inline uint8_t* lm_encode(uint8_t* p, const peak& pk, uint64_t prev)
+{
+	int64_t d=(int64_t)(pk.time-prev);
+	uint64_t z=((uint64_t)d<<1)^(uint64_t)(d>>63);				//zigzag
+	while (z>=0x80) {*p++=(uint8_t)(z|0x80); z>>=7;}
+	*p++=(uint8_t)z;
+	uint16_t v=(pk.amp&0x3FFF)|(pk.isalpha?0x4000:0);
+	*p++=v&0xFF;
+	*p++=v>>8;
+	return p;
+}
+
+int lm_decode(const lm_block_header& h, const uint8_t* p, std::vector<peak>& out)	//appends the peaks of one block to out, returns 0 on success
+{
+	const uint8_t* end=p+h.nbytes;
+	uint64_t prev=h.base_time;
+	for (uint32_t i=0;i!=h.npeaks;i++){
+		uint64_t z=0;
+		for (unsigned s=0;;s+=7){
+			if (p==end || s>63) return -1;
+			z|=(uint64_t)(*p&0x7F)<<s;
+			if (!(*p++&0x80)) break;
+		}
+		if (end-p<2) return -1;
+		uint16_t v=p[0]|(p[1]<<8); p+=2;
+		peak pk;
+		pk.time=prev+(uint64_t)((int64_t)(z>>1)^-(int64_t)(z&1));
+		pk.amp=v&0x3FFF;
+		if (pk.amp&0x2000) pk.amp^=0xFFFFC000;
+		pk.isalpha=(v&0x4000)!=0;
+		out.push_back(pk);
+		prev=pk.time;
+	}
+	return 0;
+}
+
+class lm_writer{
+public:
+	lm_writer(): ofile(NULL), _fd(-1), _bsize(LM_BLOCK_SIZE), cur(0), stop(false), written(0), dropped(0), _dropped_block(0), _newrun(true), _lost(0) {}
+	
+	int open(const char* fname)		//appends to fname, returns 0 on success
+	{
+		ofile=fopen(fname,"ab");
+		if (ofile==NULL) {fprintf(stderr, "fopen(%s) failed: %s\n", fname, strerror(errno)); return -1;}
+		_bsize=LM_BLOCK_SIZE;
+		_start();
+		return 0;
+	}
+	
+	int connect(const std::string& host, const std::string& port)	//streams to agc-collect instead, start with begin(), returns 0 on success
+	{
+		addrinfo hints, *res;
+		memset(&hints,0,sizeof(hints));
+		hints.ai_family=AF_UNSPEC;
+		hints.ai_socktype=SOCK_STREAM;
+		int r=getaddrinfo(host.c_str(),port.c_str(),&hints,&res);
+		if (r) {fprintf(stderr, "getaddrinfo(%s) failed: %s\n", host.c_str(), gai_strerror(r)); return -1;}
+		for (addrinfo* a=res;a;a=a->ai_next){
+			_fd=socket(a->ai_family,a->ai_socktype,a->ai_protocol);
+			if (_fd<0) continue;
+			if (::connect(_fd,a->ai_addr,a->ai_addrlen)==0) break;
+			::close(_fd); _fd=-1;
+		}
+		freeaddrinfo(res);
+		if (_fd<0) {fprintf(stderr, "Cannot connect to %s:%s: %s\n", host.c_str(), port.c_str(), strerror(errno)); return -1;}
+		return 0;
+	}
+	
+	int begin(uint32_t board, uint64_t start_ns)	//streaming: call right when the timestamps restart, returns 0 on success
+	{
+		lm_hello hello;
+		hello.magic=LM_HELLO_MAGIC; hello.board=board; hello.start_ns=start_ns;
+		if (_send(&hello,sizeof(hello))) {fprintf(stderr, "Streaming peaks failed: %s\n", strerror(errno)); ::close(_fd); _fd=-1; return -1;}
+		_bsize=LM_STREAM_BLOCK;
+		_start();
+		return 0;
+	}
+	
+	inline void push(const peak& pk)
+	{
+		_block& b=buf[cur];
+		if (b.full.load(std::memory_order_acquire)) {dropped++; _dropped_block++; return;}	//writer is behind
+		if (b.h.npeaks==0){
+			b.h.base_time=pk.time; b.prev=pk.time;
+			if (_fd>=0) _t_first=std::chrono::steady_clock::now();
+		}
+		b.end=lm_encode(b.end,pk,b.prev);
+		b.prev=pk.time;
+		b.h.npeaks++;
+		if (b.end+LM_MAX_PEAK>b.data.data()+_bsize) _hand_over();
+	}
+	
+	void poll()				//streaming: sends the current block if it is old enough, call when there are no peaks to push
+	{
+		if (_fd<0 || buf[cur].full.load(std::memory_order_relaxed) || buf[cur].h.npeaks==0) return;
+		if (std::chrono::steady_clock::now()-_t_first>=std::chrono::milliseconds(LM_STREAM_AGE)) _hand_over();
+	}
+	
+	void close()				//writes what is left and waits for the writer
+	{
+		if (ofile==NULL && _fd<0) return;
+		if (thr.joinable()){			//not if begin() was never called
+			if (!buf[cur].full && buf[cur].h.npeaks) _hand_over();
+			stop=true;
+			cv.notify_one();
+			thr.join();
+		}
+		if (ofile){
+			fflush(ofile);
+			fsync(fileno(ofile));
+			fclose(ofile);
+			ofile=NULL;
+		}
+		else {::close(_fd); _fd=-1;}
+	}
+	
+	uint64_t num_written() const {return written.load(std::memory_order_relaxed);}
+	uint64_t num_dropped() const {return dropped+_lost.load(std::memory_order_relaxed);}
+	
+private:
+	struct _block{
+		lm_block_header h;
+		std::vector<uint8_t> data;
+		uint8_t* end;
+		uint64_t prev;
+		std::atomic<bool> full;
+	};
+	FILE* ofile;
+	int _fd;				//socket when streaming
+	size_t _bsize;
+	std::chrono::steady_clock::time_point _t_first;	//first peak of the current block, streaming
+	_block buf[2];
+	int cur;
+	std::thread thr;
+	std::mutex mx;
+	std::condition_variable cv;
+	std::atomic<bool> stop;
+	std::atomic<uint64_t> written;
+	uint64_t dropped;
+	uint32_t _dropped_block;
+	bool _newrun;
+	std::atomic<uint64_t> _lost;		//peaks of the blocks that were not written because writing failed
+	
+	void _start()
+	{
+		for (int i=0;i!=2;i++){
+			buf[i].data.resize(_bsize);
+			buf[i].full=false;
+			_reset(i);
+		}
+		thr=std::thread(&lm_writer::_writer_fun,this);
+	}
+	
+	int _send(const void* p, size_t n)
+	{
+		const char* c=(const char*)p;
+		while (n){
+			ssize_t r=send(_fd,c,n,MSG_NOSIGNAL);
+			if (r<0) {if (errno==EINTR) continue; return -1;}
+			c+=r; n-=r;
+		}
+		return 0;
+	}
+	
+	void _reset(int i)
+	{
+		buf[i].h.magic=LM_MAGIC;
+		buf[i].h.nbytes=0; buf[i].h.npeaks=0; buf[i].h.dropped=0;
+		buf[i].h.base_time=0; buf[i].h.flags=0; buf[i].h.reserved=0;
+		buf[i].end=buf[i].data.data();
+	}
+	
+	void _hand_over()
+	{
+		_block& b=buf[cur];
+		b.h.nbytes=b.end-b.data.data();
+		b.h.dropped=_dropped_block; _dropped_block=0;
+		b.h.flags=_newrun?LM_NEWRUN:0; _newrun=false;
+		b.full.store(true,std::memory_order_release);
+		cv.notify_one();
+		cur^=1;
+	}
+	
+	void _writer_fun()
+	{
+		int next=0;
+		bool broken=false;			//a write failed, nothing is written anymore and the peaks are counted as dropped
+		for (;;){
+			if (!buf[next].full.load(std::memory_order_acquire)){
+				if (stop) return;
+				std::unique_lock<std::mutex> lk(mx);
+				cv.wait_for(lk,std::chrono::milliseconds(100));
+				continue;
+			}
+			_block& b=buf[next];
+			if (!broken){
+				if (ofile) broken=(fwrite(&b.h,sizeof(b.h),1,ofile)!=1 || fwrite(b.data.data(),1,b.h.nbytes,ofile)!=b.h.nbytes);
+				else broken=(_send(&b.h,sizeof(b.h)) || _send(b.data.data(),b.h.nbytes));
+				if (broken) fprintf(stderr, "%s failed, no more peaks are %s: %s\n", ofile?"Writing the list mode file":"Streaming peaks", ofile?"written":"sent", strerror(errno));
+			}
+			if (broken) _lost.fetch_add(b.h.npeaks,std::memory_order_relaxed);
+			else written.fetch_add(b.h.npeaks,std::memory_order_relaxed);
+			_reset(next);
+			b.full.store(false,std::memory_order_release);
+			next^=1;
+		}
+	}
+};
@@ -0,0 +1,171 @@
+/*
+    Alpha Gamma Counter
+    Copyright (C) 2017  Mario Vretenar
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <inttypes.h>
+#include "fpga.cpp"
+#include "reorder.cpp"
+#include "timehist.cpp"
+#include "coinc.cpp"
+#include "kernel.cpp"
+#include "listmode.cpp"
+#include "conf.cpp"
+#include "analysis.cpp"
+
+// Offline re-histogramming of a list mode file (see listmode.cpp) with any configuration.
+// The peaks of each run are sorted, runs are placed one after another with a gap of more than
+// 2*interval, and the stream is split into chunks processed in parallel into per-thread histograms.
+// Each chunk first opens the coincidence windows with the peaks of the preceding 2*interval (halo)
+// without counting them, so the summed histograms are identical to a single-threaded run.
+
+int _read_listmode(const char* fname, vector<peak>& peaks, unsigned gap, unsigned nthreads)	//returns 0 on success
+{
+	FILE* ifile=fopen(fname,"rb");
+	if (ifile==NULL) {fprintf(stderr, "fopen(%s) failed: %s\n", fname, strerror(errno)); return -1;}
+	vector<lm_block_header> heads;
+	vector<vector<uint8_t> > data;
+	lm_block_header h;
+	while (fread(&h,sizeof(h),1,ifile)==1){
+		if (h.magic!=LM_MAGIC) {fprintf(stderr, "%s: bad block header, file is truncated or corrupt.\n", fname); break;}
+		data.push_back(vector<uint8_t>(h.nbytes));
+		if (fread(data.back().data(),1,h.nbytes,ifile)!=h.nbytes) {fprintf(stderr, "%s: last block is truncated.\n", fname); data.pop_back(); break;}
+		heads.push_back(h);
+	}
+	fclose(ifile);
+	
+	vector<vector<peak> > dec(heads.size());				//blocks are self-contained, decode them in parallel
+	atomic<size_t> next(0);
+	atomic<bool> err(false);
+	vector<thread> thr;
+	for (unsigned t=0;t!=nthreads;t++) thr.push_back(thread([&](){
+		for (size_t b;(b=next++)<heads.size();)
+			if (lm_decode(heads[b],data[b].data(),dec[b])) err=true;
+	}));
+	for (unsigned t=0;t!=nthreads;t++) thr[t].join();
+	if (err) {fprintf(stderr, "%s: corrupt block.\n", fname); return -1;}
+	
+	uint64_t offset=0, runmax=0;
+	size_t runstart=0;
+	for (size_t b=0;b!=heads.size();b++){
+		if ((heads[b].flags&LM_NEWRUN) && b!=0){			//timestamps restart, continue after the previous run
+			sort(peaks.begin()+runstart,peaks.end(),[](const peak& x, const peak& y){return _peak_later()(y,x);});
+			offset=runmax+gap;
+			runstart=peaks.size();
+		}
+		for (size_t i=0;i!=dec[b].size();i++){
+			peak pk=dec[b][i];
+			pk.time+=offset;
+			if (pk.time>runmax) runmax=pk.time;
+			peaks.push_back(pk);
+		}
+		vector<peak>().swap(dec[b]);
+	}
+	sort(peaks.begin()+runstart,peaks.end(),[](const peak& x, const peak& y){return _peak_later()(y,x);});
+	return 0;
+}
+
+int _write_dat(const string& fname, const void* array, size_t n, size_t size=sizeof(unsigned))
+{
+	FILE* ofile=fopen(fname.c_str(),"wb");
+	if (ofile==NULL) {fprintf(stderr, "fopen(%s) failed: %s\n", fname.c_str(), strerror(errno)); return -1;}
+	size_t r=fwrite(array,size,n,ofile);
+	fclose(ofile);
+	return (r==n)?0:-1;
+}
+
+int _write_spec(const string& fname, const uint64_t* array, unsigned n, bool wide)
+{
+	vector<uint64_t> buf(n);
+	return _write_dat(fname,buf.data(),spec_export(array,n,wide,buf.data()),1);
+}
+
+int main(int argc,char *argv[]){
+	if (argc<4 || argc>5){
+		printf ("Usage: %s <listmode.dat> <agc_conf.txt> <output folder> [threads]\n"
+		        "Rebuilds alpha.dat, gamma.dat, time.dat (time.sdat with sparse_time), timesum.dat, alphaproj.dat and gammaproj.dat in the output folder from a list mode file.\n",argv[0]);
+		return 0;
+	}
+	unsigned nthreads=(argc==5)?atoi(argv[4]):thread::hardware_concurrency();
+	if (nthreads==0) nthreads=1;
+	
+	{ifstream t(argv[2]); if (!t.good()) {printf("Configuration file %s not found.\n",argv[2]); return -1;}}
+	_load_conf(false,argv[2]);
+	analysis_conf conf=_analysis_conf();
+	analysis probe;
+	if (probe.setup(conf)) {printf("Error in energy, step, interval or time axis settings.\n"); return -1;}
+	printf("alpha_binN=%u gamma_binN=%u time_binN=%u, %.1lf MB per thread\n",probe.alpha_binN,probe.gamma_binN,probe.time_binN,(double)probe.memreq()/1024/1024);
+	
+	vector<peak> peaks;
+	if (_read_listmode(argv[1],peaks,2*conf.interval+1,nthreads)) return -1;
+	printf("%zu peaks read.\n",peaks.size());
+	
+	size_t nchunks=(nthreads==1)?1:4*nthreads;
+	vector<size_t> cstart(nchunks+1);
+	for (size_t k=0;k<=nchunks;k++) cstart[k]=peaks.size()*k/nchunks;
+	
+	vector<analysis> an(nthreads);
+	atomic<size_t> next(0);
+	vector<thread> thr;
+	for (unsigned t=0;t!=nthreads;t++){
+		an[t].setup(conf);
+		if (an[t].open(NULL)) return -1;
+		thr.push_back(thread([&,t](){
+			for (size_t k;(k=next++)<nchunks;){
+				size_t s=cstart[k], e=cstart[k+1];
+				if (s==e) continue;
+				an[t].restart();
+				size_t h=s;						//halo: peaks of the preceding 2*interval
+				while (h>0 && peaks[h-1].time+2*(uint64_t)conf.interval>=peaks[s].time) h--;
+				for (size_t i=h;i!=s;i++) an[t].warm(peaks[i]);
+				for (size_t i=s;i!=e;i++) an[t].push(peaks[i]);
+				an[t].flush();
+			}
+		}));
+	}
+	for (unsigned t=0;t!=nthreads;t++) thr[t].join();
+	
+	analysis& sum=an[0];							//reduction
+	for (unsigned t=1;t!=nthreads;t++){
+		for (unsigned i=0;i!=sum.ENmax_alpha;i++) sum.alpha_array[i]+=an[t].alpha_array[i];
+		for (unsigned i=0;i!=sum.ENmax_gamma;i++) sum.gamma_array[i]+=an[t].gamma_array[i];
+		sum.bins.add(an[t].bins);
+		sum.st.N_alpha+=an[t].st.N_alpha;
+		sum.st.N_gamma+=an[t].st.N_gamma;
+		an[t].close();
+	}
+	
+	string dir=argv[3];
+	if (_make_dirs(dir)) return -1;
+	if (_write_spec(dir+"/alpha.dat",sum.alpha_array,sum.ENmax_alpha,conf.wide_spectra) ||
+	    _write_spec(dir+"/gamma.dat",sum.gamma_array,sum.ENmax_gamma,conf.wide_spectra) ||
+	    (conf.sparse_time?sum.bins.save_sparse((dir+"/time.sdat").c_str()):sum.bins.save((dir+"/time.dat").c_str())) ||
+	    _write_dat(dir+"/timesum.dat",sum.bins.timesum,sum.time_binN) ||
+	    _write_dat(dir+"/alphaproj.dat",sum.bins.alpha_proj,(size_t)sum.alpha_binN*sum.time_binN) ||
+	    _write_dat(dir+"/gammaproj.dat",sum.bins.gamma_proj,(size_t)sum.gamma_binN*sum.time_binN) ||
+	    sum.taxis.write_desc((dir+"/time_axis.txt").c_str())) return -1;
+	if (_copy_file(argv[2],dir+"/agc_conf.txt")) return -1;
+	printf("N_alpha=%" PRIu64"\nN_gamma=%" PRIu64"\nWritten to %s.\n",sum.st.N_alpha,sum.st.N_gamma,dir.c_str());
+	return 0;
+}
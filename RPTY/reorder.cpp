@@ -0,0 +1,60 @@
+/*
+    Alpha Gamma Counter
+    Copyright (C) 2017  Mario Vretenar
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <vector>
+#include <queue>
+#include <stdint.h>
+
+////--------------------------- reorder stage ------------------------------////
+// Peaks may come out of the FPGA FIFO out of chronological order, so they are held in a
+// min-heap keyed on the timestamp and released in order once the newest peak is more than
+// `window` clock cycles ahead of them. Push is O(log n), releasing one peak is O(log n).
+// On equal timestamps alphas are released before gammas.
+
+struct _peak_later{
+	bool operator()(const peak& a, const peak& b) const {
+		if (a.time==b.time) return (!a.isalpha && b.isalpha);
+		return (a.time>b.time);
+	}
+};
+
+class reorder_buf{
+public:
+	reorder_buf(uint64_t window): window(window), newest(0) {}
+	
+	void push(const peak& p){
+		if (heap.empty() || p.time>newest) newest=p.time;
+		heap.push(p);
+	}
+	
+	int pop(peak* p){							//returns 0 and the oldest peak if it can be released, else returns 1
+		if (heap.empty() || !(newest>heap.top().time+window)) return 1;
+		*p=heap.top();
+		heap.pop();
+		return 0;
+	}
+	
+	void flush() {newest=UINT64_MAX;}				//end of stream: everything may be released, peaks pushed later are released right away
+	
+	size_t size() const {return heap.size();}
+	
+private:
+	uint64_t window;
+	uint64_t newest;						//largest timestamp pushed so far
+	std::priority_queue<peak, std::vector<peak>, _peak_later> heap;
+};
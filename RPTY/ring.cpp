@@ -0,0 +1,180 @@
+/*
+    Alpha Gamma Counter
+    Copyright (C) 2017  Mario Vretenar
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <atomic>
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+#include <utility>
+#include <thread>
+#include <stdint.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+
+////------------------------ cache line aligned allocation ------------------------////
+// C++11 new only guarantees the alignment of std::max_align_t, so the alignas(64) members below
+// are only on their own cache lines in objects from the stack, globals, or aligned_new.
+
+inline void* aligned_alloc64(size_t size)
+{
+	void* p;
+	if (posix_memalign(&p,64,size)) throw std::bad_alloc();
+	return p;
+}
+
+template <typename T, typename... A>
+T* aligned_new(A&&... args)
+{
+	static_assert(alignof(T)<=64, "aligned_new: alignment above a cache line");
+	return new(aligned_alloc64(sizeof(T))) T(std::forward<A>(args)...);
+}
+
+template <typename T>
+void aligned_delete(T* p)
+{
+	if (p==NULL) return;
+	p->~T();
+	free(p);
+}
+
+////------------------------ single producer/consumer ring ------------------------////
+// Lock-free ring buffer for exactly one producer thread and one consumer thread.
+// Size must be a power of two. The producer keeps track of the high-water mark.
+// An idle consumer can sleep in wait(), the producer then wakes it with notify() after its pushes.
+
+template <typename T>
+class spsc_ring{
+public:
+	spsc_ring(size_t size): mask(size-1), head(0), tail(0), maxocc(0), sleeping(false) {buf = new T[size]; efd=eventfd(0,EFD_NONBLOCK|EFD_CLOEXEC);}
+	~spsc_ring() {delete[] buf; if (efd>=0) close(efd);}
+	
+	int push(const T& v){							//returns 0 on success, 1 if ring is full
+		size_t h=head.load(std::memory_order_relaxed);
+		size_t occ=h-tail.load(std::memory_order_acquire);
+		if (occ>mask) return 1;
+		buf[h&mask]=v;
+		head.store(h+1,std::memory_order_release);
+		if (occ+1>maxocc.load(std::memory_order_relaxed)) maxocc.store(occ+1,std::memory_order_relaxed);
+		return 0;
+	}
+	
+	int pop(T* v){								//returns 0 on success, 1 if ring is empty
+		size_t t=tail.load(std::memory_order_relaxed);
+		if (t==head.load(std::memory_order_acquire)) return 1;
+		*v=buf[t&mask];
+		tail.store(t+1,std::memory_order_release);
+		return 0;
+	}
+	
+	void notify(){								//producer, after a batch of pushes: wakes the consumer if it sleeps
+		std::atomic_thread_fence(std::memory_order_seq_cst);	//head before sleeping, pairs with the fence in wait()
+		if (!sleeping.load(std::memory_order_relaxed)) return;
+		uint64_t one=1;
+		if (write(efd,&one,sizeof(one))!=sizeof(one)) return;
+	}
+	
+	void wait(unsigned idle, int timeout_ms){				//consumer, after idle consecutive empty pops: spins, yields, then sleeps until notify() or the timeout
+		if (idle<64) return;
+		if (idle<128 || efd<0) {std::this_thread::yield(); return;}
+		sleeping.store(true,std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (head.load(std::memory_order_relaxed)==tail.load(std::memory_order_relaxed)){	//else pushed before the producer could see sleeping
+			struct pollfd p={efd,POLLIN,0};
+			poll(&p,1,timeout_ms);
+		}
+		sleeping.store(false,std::memory_order_relaxed);
+		uint64_t n;
+		if (read(efd,&n,sizeof(n))!=sizeof(n)) return;		//clears a pending wake-up
+	}
+	
+	size_t size() const {return mask+1;}
+	size_t in_ring() const {return head.load(std::memory_order_relaxed)-tail.load(std::memory_order_relaxed);}
+	size_t max_in_ring() const {return maxocc.load(std::memory_order_relaxed);}
+	
+private:
+	T* buf;
+	size_t mask;
+	alignas(64) std::atomic<size_t> head;				//written only by the producer
+	alignas(64) std::atomic<size_t> tail;				//written only by the consumer
+	alignas(64) std::atomic<size_t> maxocc;
+	alignas(64) std::atomic<bool> sleeping;				//written only by the consumer
+	int efd;							//eventfd for notify(), -1 if it could not be made
+};
+
+////------------------------ single producer, many consumers ------------------------////
+// Ring buffer for one producer thread and a fixed number of consumer threads, every consumer
+// sees every element. Consumers work on the elements in place (peek) and then release them,
+// a slot is reused once the slowest consumer has released it. Size must be a power of two.
+
+template <typename T>
+class bcast_ring{
+public:
+	bcast_ring(size_t size, unsigned readers): mask(size-1), readers(readers), head(0), min_tail(0)
+	{
+		buf = new T[size];
+		tails = (_tail*)aligned_alloc64(readers*sizeof(_tail));
+		for (unsigned r=0;r!=readers;r++) {new(tails+r) _tail; tails[r].v.store(0,std::memory_order_relaxed);}
+	}
+	~bcast_ring() {delete[] buf; free(tails);}			//_tail is trivially destructible
+	
+	int push(const T& v){							//returns 0 on success, 1 if ring is full
+		size_t h=head.load(std::memory_order_relaxed);
+		if (h-min_tail>mask){
+			min_tail=_min_tail();
+			if (h-min_tail>mask) return 1;
+		}
+		buf[h&mask]=v;
+		head.store(h+1,std::memory_order_release);
+		return 0;
+	}
+	
+	size_t peek(unsigned r, const T** v) const {				//returns the number of elements at *v consumer r has not released yet
+		size_t t=tails[r].v.load(std::memory_order_relaxed);
+		size_t n=head.load(std::memory_order_acquire)-t;
+		size_t m=mask+1-(t&mask);					//up to the end of the buffer
+		*v=buf+(t&mask);
+		return (n<m)?n:m;
+	}
+	
+	void release(unsigned r, size_t n) {tails[r].v.store(tails[r].v.load(std::memory_order_relaxed)+n,std::memory_order_release);}
+	
+	bool drained() const {return _min_tail()==head.load(std::memory_order_relaxed);}	//producer: all consumers have released everything
+	size_t size() const {return mask+1;}
+	size_t in_ring() const {return head.load(std::memory_order_relaxed)-_min_tail();}
+	
+private:
+	struct _tail{
+		alignas(64) std::atomic<size_t> v;				//written only by its consumer
+	};
+	T* buf;
+	size_t mask;
+	unsigned readers;
+	_tail* tails;
+	alignas(64) std::atomic<size_t> head;				//written only by the producer
+	size_t min_tail;						//producer only, slowest consumer at the last check
+	
+	size_t _min_tail() const {
+		size_t h=head.load(std::memory_order_relaxed), m=h;
+		for (unsigned r=0;r!=readers;r++){
+			size_t t=tails[r].v.load(std::memory_order_acquire);
+			if (h-t>h-m) m=t;
+		}
+		return m;
+	}
+};
@@ -0,0 +1,175 @@
+/*
+    Alpha Gamma Counter
+    Copyright (C) 2017  Mario Vretenar
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <string>
+#include <atomic>
+#include <cstdio>
+#include <cerrno>
+#include <cstring>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+////----------------------------- live export ------------------------------////
+// The histograms of an analysis live in a named POSIX shared memory segment (/dev/shm/agc), so
+// other processes can map it and read them at any time while the acquisition runs. The segment
+// starts with a shm_header (one page) describing the arrays, followed by the arrays themselves.
+// The processing thread makes the sequence number odd while it changes the arrays (one batch of
+// at most SHM_BATCH peaks) and even again after, like a seqlock. It never waits for readers.
+// A reader copies the segment one page at a time and retries a page until the sequence number
+// was even and did not change during its copy (shm_snapshot). Each page then holds the counts
+// between two batches, different pages may be from different batches. A page that keeps
+// changing is copied cell by cell, the cells are whole but not from one batch.
+
+#define SHM_MAGIC 0x53434741		//"AGCS"
+#define SHM_VERSION 2
+#define SHM_HEADER_SIZE 4096
+#define SHM_BATCH 4096			//peaks processed per odd sequence number at most
+
+struct shm_header{			//all offsets are in bytes from the start of the segment
+	uint32_t magic, version;
+	uint64_t size;			//of the whole segment
+	std::atomic<uint32_t> seq;	//odd while the arrays are being changed
+	uint32_t pad;
+	uint64_t elapsed;		//clock cycles, up to the last processed peak
+	uint64_t N_alpha, N_gamma;
+	uint32_t ENmax_alpha, ENmax_gamma;		//%uint64 spectra, bin 0 is the threshold
+	uint32_t alpha_binN, gamma_binN, tN;		//time.dat dimensions
+	uint32_t cellbits;				//time.dat cells, 8 and 16 bit cells are the counts modulo 2^cellbits
+	uint32_t wide_spectra;				//alpha.dat and gamma.dat are saved as %uint64
+	uint32_t taxis_half, taxis_width;		//t=0 is the start of time bin half, width in 8 ns (see time_axis.txt)
+	uint32_t reserved;
+	uint64_t off_alpha, off_gamma;
+	uint64_t off_timesum, off_alpha_proj, off_gamma_proj;	//%uint32, [tN], [alpha_binN][tN], [gamma_binN][tN]
+	uint64_t off_cells;				//[alpha_binN][gamma_binN][tN] of cellbits
+};
+
+class shm_export{
+public:
+	shm_export(): h(NULL) {}
+	~shm_export() {close();}
+	
+	void* create(const std::string& name, size_t bytes)	//creates the segment (replacing an old one), returns zeroed memory of bytes for the arrays, NULL on error
+	{
+		_name=name;
+		shm_unlink(name.c_str());
+		int fd=shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+		if (fd<0) {fprintf(stderr, "shm_open(%s) failed: %s\n", name.c_str(), strerror(errno)); return NULL;}
+		_size=SHM_HEADER_SIZE+bytes;
+		if (ftruncate(fd,_size)<0) {fprintf(stderr, "ftruncate(%s) failed: %s\n", name.c_str(), strerror(errno)); ::close(fd); shm_unlink(name.c_str()); return NULL;}
+		void* p=mmap(NULL, _size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		::close(fd);
+		if (p==MAP_FAILED) {fprintf(stderr, "mmap(%s) failed: %s\n", name.c_str(), strerror(errno)); shm_unlink(name.c_str()); return NULL;}
+		h=(shm_header*)p;
+		h->size=_size;
+		h->seq.store(1,std::memory_order_relaxed);		//odd until describe()
+		h->pad=0;
+		return (char*)p+SHM_HEADER_SIZE;
+	}
+	
+	void describe(const analysis& an)	//fills in the header once the analysis is open in the segment, readers may read from now on
+	{
+		if (!h) return;
+		h->ENmax_alpha=an.ENmax_alpha; h->ENmax_gamma=an.ENmax_gamma;
+		h->alpha_binN=an.alpha_binN; h->gamma_binN=an.gamma_binN; h->tN=an.time_binN;
+		h->cellbits=an.c.time_cell_bits;
+		h->wide_spectra=an.c.wide_spectra;
+		h->taxis_half=an.taxis.half; h->taxis_width=an.taxis.width;
+		h->reserved=0;
+		h->off_alpha=_off(an.alpha_array); h->off_gamma=_off(an.gamma_array);
+		h->off_timesum=_off(an.bins.timesum);
+		h->off_alpha_proj=_off(an.bins.alpha_proj);
+		h->off_gamma_proj=_off(an.bins.gamma_proj);
+		h->off_cells=_off(an.bins.bins?(void*)an.bins.bins:an.bins.bins16?(void*)an.bins.bins16:(void*)an.bins.bins8);
+		h->version=SHM_VERSION;
+		h->elapsed=an.st.last_time; h->N_alpha=an.st.N_alpha; h->N_gamma=an.st.N_gamma;
+		h->magic=SHM_MAGIC;
+		h->seq.store(2,std::memory_order_release);
+	}
+	
+	inline void begin()			//before changing the arrays
+	{
+		if (!h) return;
+		h->seq.store(h->seq.load(std::memory_order_relaxed)+1,std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+	}
+	
+	inline void end(const event_state& st)	//after
+	{
+		if (!h) return;
+		h->elapsed=st.last_time; h->N_alpha=st.N_alpha; h->N_gamma=st.N_gamma;
+		h->seq.store(h->seq.load(std::memory_order_relaxed)+1,std::memory_order_release);
+	}
+	
+	void* base() const {return h;}
+	size_t size() const {return h?_size:0;}
+	
+	void close()
+	{
+		if (!h) return;
+		munmap(h,_size);
+		shm_unlink(_name.c_str());
+		h=NULL;
+	}
+	
+private:
+	shm_header* h;
+	std::string _name;
+	size_t _size;
+	
+	uint64_t _off(const void* p) const {return (const char*)p-(const char*)h;}
+};
+
+const shm_header* shm_attach(const std::string& name)	//maps an existing segment, NULL on error
+{
+	int fd=shm_open(name.c_str(), O_RDWR, 0);
+	if (fd<0) {fprintf(stderr, "shm_open(%s) failed: %s\n", name.c_str(), strerror(errno)); return NULL;}
+	shm_header hd;
+	if (pread(fd,&hd,sizeof(hd),0)!=(ssize_t)sizeof(hd) || hd.magic!=SHM_MAGIC || hd.version!=SHM_VERSION) {fprintf(stderr, "%s is not an agc segment.\n", name.c_str()); ::close(fd); return NULL;}
+	void* p=mmap(NULL, hd.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	::close(fd);
+	if (p==MAP_FAILED) {fprintf(stderr, "mmap(%s) failed: %s\n", name.c_str(), strerror(errno)); return NULL;}
+	return (const shm_header*)p;
+}
+
+size_t shm_snapshot(const shm_header* h, void* out, unsigned tries=100)	//copies the segment (h->size bytes), returns the number of pages copied cell by cell
+{
+	const char* src=(const char*)h;
+	char* dst=(char*)out;
+	size_t percell=0;
+	for (uint64_t off=0;off<h->size;off+=SHM_HEADER_SIZE){			//the header first, its counts are not newer than the arrays
+		size_t n=(h->size-off<SHM_HEADER_SIZE)?h->size-off:SHM_HEADER_SIZE;
+		unsigned i;
+		for (i=0;i!=tries;i++){
+			uint32_t s=h->seq.load(std::memory_order_acquire);
+			if (s&1) {sched_yield(); continue;}			//a batch is being processed
+			memcpy(dst+off,src+off,n);
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if (h->seq.load(std::memory_order_relaxed)==s) break;
+		}
+		if (i!=tries) continue;
+		size_t k;							//all cells are aligned, none is split by an 8 byte load
+		for (k=0;k+8<=n;k+=8) *(uint64_t*)(dst+off+k)=__atomic_load_n((const uint64_t*)(src+off+k),__ATOMIC_RELAXED);
+		memcpy(dst+off+k,src+off+k,n-k);
+		percell++;
+	}
+	return percell;
+}
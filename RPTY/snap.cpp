@@ -0,0 +1,85 @@
+/*
+    Alpha Gamma Counter
+    Copyright (C) 2017  Mario Vretenar
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <inttypes.h>
+#include "fpga.cpp"
+#include "reorder.cpp"
+#include "timehist.cpp"
+#include "coinc.cpp"
+#include "kernel.cpp"
+#include "conf.cpp"
+#include "analysis.cpp"
+#include "shm.cpp"
+
+// Copies the live histograms of a running acquisition (shm_export in agc_conf.txt) without
+// stopping it and writes them in the same files and formats the acquisition program saves.
+
+using namespace std;
+
+int _write_dat(const string& fname, const void* array, size_t n, size_t size=sizeof(unsigned))
+{
+	FILE* ofile=fopen(fname.c_str(),"wb");
+	if (ofile==NULL) {fprintf(stderr, "fopen(%s) failed: %s\n", fname.c_str(), strerror(errno)); return -1;}
+	size_t r=fwrite(array,size,n,ofile);
+	fclose(ofile);
+	return (r==n)?0:-1;
+}
+
+int _write_spec(const string& fname, const uint64_t* array, unsigned n, bool wide)
+{
+	vector<uint64_t> buf(n);
+	return _write_dat(fname,buf.data(),spec_export(array,n,wide,buf.data()),1);
+}
+
+int main(int argc,char *argv[]){
+	if (argc!=3){
+		printf ("Usage: %s <segment> <output folder>\n"
+		        "Copies the live histograms of a running acquisition from the shared memory segment (/agc, or /agc_<name> for\n"
+		        "the analysis of agc_conf_<name>.txt) into alpha.dat, gamma.dat, time.dat, timesum.dat, alphaproj.dat and gammaproj.dat.\n",argv[0]);
+		return 0;
+	}
+	const shm_header* h=shm_attach(argv[1]);
+	if (h==NULL) return -1;
+	vector<char> copy(h->size);
+	chrono::steady_clock::time_point t0=chrono::steady_clock::now();
+	size_t percell=shm_snapshot(h,copy.data());
+	double t=chrono::duration<double>(chrono::steady_clock::now()-t0).count();
+	const shm_header& c=*(const shm_header*)copy.data();
+	const char* b=copy.data();
+	
+	string dir=argv[2];
+	if (_make_dirs(dir)) return -1;
+	if (_write_spec(dir+"/alpha.dat",(const uint64_t*)(b+c.off_alpha),c.ENmax_alpha,c.wide_spectra) ||
+	    _write_spec(dir+"/gamma.dat",(const uint64_t*)(b+c.off_gamma),c.ENmax_gamma,c.wide_spectra) ||
+	    _write_dat(dir+"/timesum.dat",b+c.off_timesum,c.tN) ||
+	    _write_dat(dir+"/alphaproj.dat",b+c.off_alpha_proj,(size_t)c.alpha_binN*c.tN) ||
+	    _write_dat(dir+"/gammaproj.dat",b+c.off_gamma_proj,(size_t)c.gamma_binN*c.tN)) return -1;
+	if (c.cellbits==32){
+		if (_write_dat(dir+"/time.dat",b+c.off_cells,(size_t)c.alpha_binN*c.gamma_binN*c.tN)) return -1;
+	}
+	else printf("time.dat not written, with %u bit cells the shared memory only has the counts modulo 2^%u.\n",c.cellbits,c.cellbits);
+	printf("N_alpha=%" PRIu64"\nN_gamma=%" PRIu64"\nelapsed time=%" PRIu64" s\n",c.N_alpha,c.N_gamma,c.elapsed/125000000);
+	printf("%zu bytes copied in %.3lf ms, written to %s.\n",copy.size(),t*1000,dir.c_str());
+	if (percell) printf("%zu of %zu pages kept changing and were copied cell by cell, their cells may be from different batches of peaks.\n",percell,(copy.size()+SHM_HEADER_SIZE-1)/SHM_HEADER_SIZE);
+	return 0;
+}
@@ -0,0 +1,188 @@
+/*
+    Alpha Gamma Counter
+    Copyright (C) 2017  Mario Vretenar
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <stdint.h>
+#include <inttypes.h>
+#include <unistd.h>
+
+////------------------------------- live stats -------------------------------////
+// Counters kept by the processing loop (hot_stats) and a thread that publishes them, together
+// with the FIFO reader counters, every period seconds to a stats file (measurements/stats.txt),
+// replaced atomically so monitoring never reads a partial file. Every line is "key value...",
+// keys are only ever added, so the format stays stable for parsers.
+
+#define HS_SAMPLE	64		//processing time is measured on one in HS_SAMPLE peaks
+#define HS_BUCKETS	24		//processing time histogram, bucket k: [2^k,2^(k+1)) ns
+
+struct hot_stats{			//owned by the processing thread
+	hot_stats() {memset(this,0,sizeof(*this));}
+	
+	inline bool timed() {return !(++processed&(HS_SAMPLE-1));}
+	inline void record(uint64_t ns)
+	{
+		int k=0;
+		while (ns>1 && k!=HS_BUCKETS-1) {ns>>=1; k++;}
+		proc_hist[k]++;
+	}
+	inline void track(size_t reorder, size_t alphas, size_t gammas)
+	{
+		reorder_depth=reorder; if (reorder>reorder_max) reorder_max=reorder;
+		open_alphas=alphas; if (alphas>alphas_max) alphas_max=alphas;
+		open_gammas=gammas; if (gammas>gammas_max) gammas_max=gammas;
+	}
+	
+	uint64_t processed;
+	uint64_t N_alpha, N_gamma;
+	uint64_t elapsed;			//timestamp of the last processed peak
+	size_t reorder_depth, reorder_max;	//maxima are since the previous publication
+	size_t open_alphas, alphas_max;
+	size_t open_gammas, gammas_max;
+	uint64_t proc_hist[HS_BUCKETS];
+};
+
+class stats_publisher{
+public:
+	stats_publisher(): startup(0), ring(NULL), stop(false), due(false), fresh(false) {}
+	~stats_publisher() {end();}
+	
+	int start(const char* fname, unsigned period, const spsc_ring<peak>* ring)	//period in seconds, returns 0 on success
+	{
+		this->fname=fname;
+		this->period=period;
+		this->ring=ring;
+		t0=std::chrono::steady_clock::now();
+		thr=std::thread(&stats_publisher::_run,this);
+		return 0;
+	}
+	void end()
+	{
+		{std::lock_guard<std::mutex> lk(mx); stop=true;}
+		cv.notify_all();
+		if (thr.joinable()) thr.join();
+	}
+	
+	double startup;				//seconds from program start to acquisition start
+	
+	inline bool is_due() const {return due.load(std::memory_order_relaxed);}
+	void submit(hot_stats& hs)		//called by the processing thread when is_due(), resets the maxima
+	{
+		{
+			std::lock_guard<std::mutex> lk(mx);
+			snap=hs;
+			fresh=true;
+			due.store(false,std::memory_order_relaxed);
+		}
+		cv.notify_all();
+		hs.reorder_max=hs.reorder_depth;
+		hs.alphas_max=hs.open_alphas;
+		hs.gammas_max=hs.open_gammas;
+	}
+	
+private:
+	std::string fname;
+	unsigned period;
+	const spsc_ring<peak>* ring;
+	std::chrono::steady_clock::time_point t0;
+	std::thread thr;
+	std::mutex mx;
+	std::condition_variable cv;
+	bool stop;
+	std::atomic<bool> due;
+	bool fresh;
+	hot_stats snap;
+	
+	void _run()
+	{
+		uint64_t last_samples=AGC_stat_samples, last_lost=AGC_get_num_lost();
+		std::chrono::steady_clock::time_point next=t0, last=t0;
+		std::unique_lock<std::mutex> lk(mx);
+		while (!stop){
+			next+=std::chrono::seconds(period);
+			if (cv.wait_until(lk,next,[this]{return stop;})) break;
+			due.store(true,std::memory_order_relaxed);			//ask the processing thread for a snapshot
+			cv.wait_for(lk,std::chrono::milliseconds(100),[this]{return stop||fresh;});
+			fresh=false;
+			hot_stats hs=snap;
+			lk.unlock();
+			
+			std::chrono::steady_clock::time_point now=std::chrono::steady_clock::now();
+			double dt=std::chrono::duration<double>(now-last).count();
+			last=now;
+			uint64_t samples=AGC_stat_samples, lost=AGC_get_num_lost();
+			uint32_t inq=AGC_RD(mes_in_queue);
+			if (_write(hs,std::chrono::duration<double>(now-t0).count(),(samples-last_samples)/dt,(lost-last_lost)/dt,samples,lost,inq))
+				fprintf(stderr, "Writing %s failed: %s\n", fname.c_str(), strerror(errno));
+			last_samples=samples;
+			last_lost=lost;
+			lk.lock();
+		}
+	}
+	
+	int _write(const hot_stats& snap, double t, double input_rate, double loss_rate, uint64_t samples, uint64_t lost, uint32_t inq)
+	{
+		std::string tmp=fname+".tmp";
+		FILE* f=fopen(tmp.c_str(),"w");
+		if (f==NULL) return -1;
+		fprintf(f,"stats_version 1\n");
+		fprintf(f,"uptime_s %.3lf\n",t);
+		fprintf(f,"startup_s %.3lf\n",startup);
+		fprintf(f,"elapsed_s %.3lf\n",snap.elapsed/125e6);
+		fprintf(f,"input_rate %.1lf\n",input_rate);
+		fprintf(f,"loss_rate %.1lf\n",loss_rate);
+		fprintf(f,"peaks %" PRIu64"\n",samples);
+		fprintf(f,"lost %" PRIu64"\n",lost);
+		fprintf(f,"fifo_in_queue %u\n",inq&0xFFFF);
+		fprintf(f,"fifo_max_in_queue %u\n",inq>>16);
+		fprintf(f,"fifo_size %u\n",AGC_get_fifo_size());
+		fprintf(f,"ddr_mode %d\n",AGC_dma?1:0);
+		fprintf(f,"polls %" PRIu64"\n",(uint64_t)AGC_stat_polls);
+		fprintf(f,"polls_empty %" PRIu64"\n",(uint64_t)AGC_stat_empty);
+		fprintf(f,"irq_mode %d\n",AGC_irq?1:0);
+		fprintf(f,"irq_wakeups %" PRIu64"\n",(uint64_t)AGC_stat_irqs);
+		fprintf(f,"irq_missed %" PRIu64"\n",(uint64_t)AGC_stat_irq_missed);
+		fprintf(f,"ring_in %zu\n",ring->in_ring());
+		fprintf(f,"ring_max %zu\n",ring->max_in_ring());
+		fprintf(f,"ring_size %zu\n",ring->size());
+		fprintf(f,"processed %" PRIu64"\n",snap.processed);
+		fprintf(f,"N_alpha %" PRIu64"\n",snap.N_alpha);
+		fprintf(f,"N_gamma %" PRIu64"\n",snap.N_gamma);
+		fprintf(f,"reorder_depth %zu\n",snap.reorder_depth);
+		fprintf(f,"reorder_max %zu\n",snap.reorder_max);
+		fprintf(f,"open_alphas %zu\n",snap.open_alphas);
+		fprintf(f,"open_alphas_max %zu\n",snap.alphas_max);
+		fprintf(f,"open_gammas %zu\n",snap.open_gammas);
+		fprintf(f,"open_gammas_max %zu\n",snap.gammas_max);
+		fprintf(f,"proc_ns_sample %u\n",HS_SAMPLE);
+		fprintf(f,"proc_ns_log2");
+		for (int k=0;k!=HS_BUCKETS;k++) fprintf(f," %" PRIu64,snap.proc_hist[k]);
+		fprintf(f,"\n");
+		if (fflush(f) || fsync(fileno(f))) {fclose(f); return -1;}
+		if (fclose(f)) return -1;
+		return _rename_synced(tmp,fname);			//checkpoint.cpp
+	}
+};
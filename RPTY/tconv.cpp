@@ -0,0 +1,116 @@
+/*
+    Alpha Gamma Counter
+    Copyright (C) 2017  Mario Vretenar
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <chrono>
+#include <inttypes.h>
+#include "fpga.cpp"
+#include "reorder.cpp"
+#include "timehist.cpp"
+#include "coinc.cpp"
+#include "kernel.cpp"
+#include "conf.cpp"
+#include "analysis.cpp"
+
+// Converts time.dat to the compressed time.sdat (sparse_time in agc_conf.txt) and back, and prints
+// single energy cells of a time.sdat. Neither file is loaded as a whole, one cell is read at a time.
+
+using namespace std;
+
+int _to_sparse(const char* in, const char* out, const char* conf)
+{
+	{ifstream t(conf); if (!t.good()) {printf("Configuration file %s not found.\n",conf); return -1;}}
+	_load_conf(false,conf);
+	analysis an;
+	if (an.setup(_analysis_conf())) {printf("Error in energy, step, interval or time axis settings.\n"); return -1;}
+	size_t ncells=(size_t)an.alpha_binN*an.gamma_binN, tN=an.time_binN;
+	FILE* ifile=fopen(in,"rb");
+	if (ifile==NULL) {fprintf(stderr, "fopen(%s) failed: %s\n", in, strerror(errno)); return -1;}
+	fseek(ifile,0,SEEK_END);
+	if ((size_t)ftell(ifile)!=ncells*tN*sizeof(unsigned)) {printf("%s has size %ld, expected %zu for a %u:%u:%u time.dat. Wrong configuration?\n",in,ftell(ifile),ncells*tN*sizeof(unsigned),an.alpha_binN,an.gamma_binN,an.time_binN); fclose(ifile); return -1;}
+	rewind(ifile);
+	tsparse_writer w;
+	if (w.open(out,an.alpha_binN,an.gamma_binN,an.time_binN)) {fprintf(stderr, "open(%s) failed: %s\n", out, strerror(errno)); fclose(ifile); return -1;}
+	vector<unsigned> row(tN);
+	for (size_t c=0;c!=ncells;c++){
+		if (fread(row.data(),sizeof(unsigned),tN,ifile)!=tN) {fprintf(stderr, "fread(%s) failed\n", in); fclose(ifile); return -1;}
+		if (w.put(row.data())) {fprintf(stderr, "write(%s) failed: %s\n", out, strerror(errno)); fclose(ifile); return -1;}
+	}
+	fclose(ifile);
+	if (w.close()) {fprintf(stderr, "write(%s) failed: %s\n", out, strerror(errno)); return -1;}
+	printf("%u:%u:%u, %" PRIu64" counts, %" PRIu64" bytes instead of %zu.\n",an.alpha_binN,an.gamma_binN,an.time_binN,w.h.total,w.size(),ncells*tN*sizeof(unsigned));
+	return 0;
+}
+
+int _open_sparse(tsparse_reader& rd, const char* in)
+{
+	if (rd.open(in)==0) return 0;
+	fprintf(stderr, "open(%s) failed: %s\n", in, (errno==EINVAL)?"not a valid time.sdat":strerror(errno));
+	return -1;
+}
+
+int _to_dense(const char* in, const char* out)
+{
+	tsparse_reader rd;
+	if (_open_sparse(rd,in)) return -1;
+	FILE* ofile=fopen(out,"wb");
+	if (ofile==NULL) {fprintf(stderr, "fopen(%s) failed: %s\n", out, strerror(errno)); return -1;}
+	vector<unsigned> row(rd.h.tN);
+	uint64_t total=0;
+	for (size_t c=0;c!=rd.ncells();c++){
+		if (rd.cell(c,row.data())) {fprintf(stderr, "read(%s) failed: cell %zu is corrupt\n", in, c); fclose(ofile); return -1;}
+		for (unsigned k=0;k!=rd.h.tN;k++) total+=row[k];
+		if (fwrite(row.data(),sizeof(unsigned),rd.h.tN,ofile)!=rd.h.tN) {fprintf(stderr, "fwrite(%s) failed: %s\n", out, strerror(errno)); fclose(ofile); return -1;}
+	}
+	if (fclose(ofile)) {fprintf(stderr, "fclose(%s) failed: %s\n", out, strerror(errno)); return -1;}
+	if (total!=rd.h.total) {printf("%s has %" PRIu64" counts, the header says %" PRIu64".\n",in,total,rd.h.total); return -1;}
+	printf("%u:%u:%u, %" PRIu64" counts, %zu bytes written.\n",rd.h.alpha_binN,rd.h.gamma_binN,rd.h.tN,total,rd.ncells()*rd.h.tN*sizeof(unsigned));
+	return 0;
+}
+
+int _print_cell(const char* in, unsigned a, unsigned g)
+{
+	tsparse_reader rd;
+	if (_open_sparse(rd,in)) return -1;
+	if (a>=rd.h.alpha_binN || g>=rd.h.gamma_binN) {printf("The cell must be within %u:%u.\n",rd.h.alpha_binN,rd.h.gamma_binN); return -1;}
+	vector<unsigned> row(rd.h.tN);
+	if (rd.cell((size_t)a*rd.h.gamma_binN+g,row.data())) {fprintf(stderr, "read(%s) failed: the cell is corrupt\n", in); return -1;}
+	for (unsigned k=0;k!=rd.h.tN;k++) printf("%u\t%u\n",k,row[k]);
+	return 0;
+}
+
+int main(int argc,char *argv[]){
+	if (argc==5 && string(argv[1])=="-c") return _print_cell(argv[2],atoi(argv[3]),atoi(argv[4]))?-1:0;
+	if (argc!=3 && argc!=4){
+		printf ("Usage: %s <time.dat> <time.sdat> <agc_conf.txt>\n"
+		        "       %s <time.sdat> <time.dat>\n"
+		        "       %s -c <time.sdat> <alpha bin> <gamma bin>\n"
+		        "Converts time.dat into the compressed time.sdat (the time.dat dimensions are taken from the agc_conf.txt\n"
+		        "of the measurement), or time.sdat back into time.dat. With -c prints the time spectrum (bin, count) of one\n"
+		        "energy cell of a time.sdat.\n",argv[0],argv[0],argv[0]);
+		return 0;
+	}
+	chrono::steady_clock::time_point t0=chrono::steady_clock::now();
+	if ((argc==4)?_to_sparse(argv[1],argv[2],argv[3]):_to_dense(argv[1],argv[2])) return -1;
+	printf("Converted in %.3lf s.\n",chrono::duration<double>(chrono::steady_clock::now()-t0).count());
+	return 0;
+}
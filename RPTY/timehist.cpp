@@ -0,0 +1,568 @@
+/*
+    Alpha Gamma Counter
+    Copyright (C) 2017  Mario Vretenar
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <cstdio>
+#include <cerrno>
+#include <cstring>
+#include <stdint.h>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+////-------------------------- histogram reduction -------------------------////
+// dst[i]+=src[i], the kernel of every pass over the time histogram (rebuilding the projections,
+// summing per thread histograms). A plain loop the compiler can vectorize.
+
+inline void hist_add(unsigned* dst, const unsigned* src, size_t n)
+{
+	size_t i=0;
+	for (;i+4<=n;i+=4){
+		dst[i]+=src[i]; dst[i+1]+=src[i+1];
+		dst[i+2]+=src[i+2]; dst[i+3]+=src[i+3];
+	}
+	for (;i!=n;i++) dst[i]+=src[i];
+}
+
+////---------------------------- energy spectra ----------------------------////
+// Energy spectra are counted in 64 bits, so no bin wraps around even in very long runs.
+// alpha.dat and gamma.dat are %uint32 with bins that do not fit saturated at 2^32-1, or %uint64
+// with wide_spectra (see agc_conf.txt).
+
+inline size_t spec_export(const uint64_t* array, unsigned n, bool wide, void* out)	//out must hold n uint64_t, returns the number of bytes written
+{
+	if (wide) {memcpy(out,array,n*sizeof(uint64_t)); return n*sizeof(uint64_t);}
+	uint32_t* o=(uint32_t*)out;
+	for (unsigned i=0;i!=n;i++) o[i]=(array[i]>0xFFFFFFFF)?0xFFFFFFFF:(uint32_t)array[i];
+	return n*sizeof(uint32_t);
+}
+
+inline bool spec_saturated(const uint64_t* array, unsigned n)	//some bins do not fit in %uint32
+{
+	for (unsigned i=0;i!=n;i++) if (array[i]>0xFFFFFFFF) return true;
+	return false;
+}
+
+////------------------------- sparse time histogram ------------------------////
+// time.sdat, the compressed alternative to time.dat (sparse_time in agc_conf.txt). Most bins of
+// time.dat are zero, so each energy cell (the time spectrum of one alpha bin, gamma bin pair) is
+// stored as a chunk of (gap, count) pairs for its non-zero bins, gap being the number of zero bins
+// before it, both as LEB128 varints (7 bits per byte, high bit set on all but the last byte).
+// The file is a tsparse_header, an index of alpha_binN*gamma_binN+1 %uint64 file offsets (chunk c
+// is the bytes from index[c] to index[c+1], empty cells take none) and the chunks in the order of
+// time.dat. So any single cell is found with two small reads. All numbers are little endian.
+
+#define TSPARSE_MAGIC 0x54434741	//"AGCT"
+#define TSPARSE_VERSION 1
+#define TSPARSE_FLUSH (1<<20)		//bytes of chunks buffered before they are written
+
+struct tsparse_header{
+	uint32_t magic, version;
+	uint32_t alpha_binN, gamma_binN, tN;	//time.dat dimensions
+	uint32_t reserved;
+	uint64_t total;				//sum of all counts
+};
+
+inline void _tsparse_put(std::vector<uint8_t>& out, uint32_t v)
+{
+	while (v>=0x80) {out.push_back((uint8_t)(v|0x80)); v>>=7;}
+	out.push_back((uint8_t)v);
+}
+
+inline uint64_t tsparse_encode(const unsigned* r, unsigned tN, std::vector<uint8_t>& out)	//appends the chunk of one cell to out, returns the sum of its counts
+{
+	uint64_t sum=0;
+	unsigned gap=0;
+	for (unsigned k=0;k!=tN;k++){
+		if (!r[k]) {gap++; continue;}
+		_tsparse_put(out,gap);
+		_tsparse_put(out,r[k]);
+		sum+=r[k];
+		gap=0;
+	}
+	return sum;
+}
+
+inline int tsparse_decode(const uint8_t* p, size_t n, unsigned tN, unsigned* r)	//one chunk into r (tN elements), returns 0 on success, -1 if it is corrupt
+{
+	std::fill(r,r+tN,0);
+	const uint8_t* e=p+n;
+	unsigned k=0;
+	while (p!=e){
+		uint32_t v[2];
+		for (int j=0;j!=2;j++){
+			v[j]=0;
+			for (unsigned s=0;;s+=7){
+				if (p==e || s>28) return -1;
+				v[j]|=(uint32_t)(*p&0x7F)<<s;
+				if (!(*p++&0x80)) break;
+			}
+		}
+		if (v[0]>=tN-k) return -1;
+		k+=v[0];
+		r[k++]=v[1];
+	}
+	return 0;
+}
+
+class tsparse_writer{		//writes a time.sdat one cell after the other, without stdio (the checkpoint writer uses it)
+public:
+	tsparse_writer(): _fd(-1) {}
+	~tsparse_writer() {if (_fd>=0) ::close(_fd);}
+	
+	int open(const char* fname, unsigned abinN, unsigned gbinN, unsigned tbinN)	//returns 0 on success
+	{
+		_fd=::open(fname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (_fd<0) return -1;
+		h.magic=TSPARSE_MAGIC; h.version=TSPARSE_VERSION;
+		h.alpha_binN=abinN; h.gamma_binN=gbinN; h.tN=tbinN;
+		h.reserved=0; h.total=0;
+		size_t ncells=(size_t)abinN*gbinN;
+		_index.clear();
+		_index.reserve(ncells+1);
+		_index.push_back(sizeof(h)+(ncells+1)*sizeof(uint64_t));
+		_off=_index[0];
+		_buf.clear();
+		return 0;
+	}
+	
+	int put(const unsigned* r)	//appends the time spectrum (tN elements) of the next energy cell, returns 0 on success
+	{
+		h.total+=tsparse_encode(r,h.tN,_buf);
+		_index.push_back(_off+_buf.size());
+		return (_buf.size()>=TSPARSE_FLUSH)?_flush():0;
+	}
+	
+	int close()		//writes the index and syncs the file to disk, returns 0 on success
+	{
+		int err=(_index.size()!=(size_t)h.alpha_binN*h.gamma_binN+1);
+		err|=_flush();
+		err|=_pwrite_all(&h,sizeof(h),0);
+		err|=_pwrite_all(_index.data(),_index.size()*sizeof(uint64_t),sizeof(h));
+		err|=fsync(_fd);
+		::close(_fd);
+		_fd=-1;
+		return err?-1:0;
+	}
+	
+	uint64_t size() const {return _off+_buf.size();}	//of the file so far, in bytes
+	
+	tsparse_header h;
+private:
+	int _fd;
+	std::vector<uint64_t> _index;
+	std::vector<uint8_t> _buf;	//chunks not written yet, they start at file offset _off
+	uint64_t _off;
+	
+	int _pwrite_all(const void* buf, size_t n, uint64_t off)
+	{
+		const char* p=(const char*)buf;
+		while (n){
+			ssize_t r=pwrite(_fd,p,n,(off_t)off);
+			if (r<0) {if (errno==EINTR) continue; return -1;}
+			p+=r; n-=r; off+=r;
+		}
+		return 0;
+	}
+	int _flush()
+	{
+		if (_pwrite_all(_buf.data(),_buf.size(),_off)) return -1;
+		_off+=_buf.size();
+		_buf.clear();
+		return 0;
+	}
+};
+
+class tsparse_reader{		//random access to the cells of a time.sdat
+public:
+	tsparse_reader(): _fd(-1) {}
+	~tsparse_reader() {close();}
+	
+	int open(const char* fname)	//reads the header and the index, returns 0 on success, -1 with errno set (EINVAL: not a valid time.sdat)
+	{
+		_fd=::open(fname, O_RDONLY);
+		if (_fd<0) return -1;
+		struct stat st;
+		if (fstat(_fd,&st)<0) {close(); return -1;}
+		if (pread(_fd,&h,sizeof(h),0)!=(ssize_t)sizeof(h) || h.magic!=TSPARSE_MAGIC || h.version!=TSPARSE_VERSION) return _invalid();
+		size_t n=(size_t)h.alpha_binN*h.gamma_binN+1;
+		if (sizeof(h)+n*sizeof(uint64_t)>(uint64_t)st.st_size) return _invalid();
+		_index.resize(n);
+		if (pread(_fd,_index.data(),n*sizeof(uint64_t),sizeof(h))!=(ssize_t)(n*sizeof(uint64_t))) return _invalid();
+		if (_index[0]!=sizeof(h)+n*sizeof(uint64_t) || _index[n-1]!=(uint64_t)st.st_size) return _invalid();
+		for (size_t c=1;c!=n;c++) if (_index[c]<_index[c-1]) return _invalid();
+		return 0;
+	}
+	
+	int cell(size_t c, unsigned* r)		//time spectrum of energy cell c (alpha bin*gamma_binN+gamma bin) into r (tN elements), returns 0 on success
+	{
+		size_t n=_index[c+1]-_index[c];
+		if (n==0) {std::fill(r,r+h.tN,0); return 0;}
+		_buf.resize(n);
+		if (pread(_fd,_buf.data(),n,(off_t)_index[c])!=(ssize_t)n) return -1;
+		return tsparse_decode(_buf.data(),n,h.tN,r);
+	}
+	
+	void close()
+	{
+		if (_fd>=0) ::close(_fd);
+		_fd=-1;
+	}
+	
+	size_t ncells() const {return (size_t)h.alpha_binN*h.gamma_binN;}
+	uint64_t size() const {return _index.empty()?0:_index.back();}	//of the file, in bytes
+	
+	tsparse_header h;
+private:
+	int _fd;
+	std::vector<uint64_t> _index;
+	std::vector<uint8_t> _buf;
+	
+	int _invalid()
+	{
+		close();
+		errno=EINVAL;
+		return -1;
+	}
+};
+
+////--------------------------- time histogram -----------------------------////
+// The 3D coincidence histogram [alpha bin][gamma bin][time bin], stored contiguously in the layout
+// of time.dat. With 32 bit cells (the default) it is mapped onto the file copy-on-write (MAP_PRIVATE),
+// so opening an existing file needs no read pass, and the file itself only changes when a checkpoint
+// writes the energy cells marked dirty since the last one (see checkpoint.cpp).
+// With 8 or 16 bit cells it takes 4 or 2 times less memory: the file is read once when opened and
+// each time a cell wraps around the carry is counted in a side table (spill), so cells still count
+// to 2^32 like in time.dat, which is always %uint32. Most cells stay small, so the table stays small.
+// The projections onto the time axis (timesum, and per alpha and per gamma energy bin) are kept up
+// to date by every increment, so they can be saved or inspected at any time without a pass over
+// the 3D array. They are rebuilt once when an existing file is opened.
+// Everything can also be kept in memory given by the caller (shared memory, see shm.cpp): the
+// projections first, then the cells, and an existing file is then read once like with compact cells.
+// With sparse set it is kept in RAM as well, loaded from and saved to a time.sdat (see above).
+
+class time_hist{
+public:
+	time_hist(): bins(NULL), bins16(NULL), bins8(NULL), cellbits(32), sparse(false), alpha_binN(0), gamma_binN(0), tN(0),
+	             timesum(NULL), alpha_proj(NULL), gamma_proj(NULL), _mem(NULL), _extmem(false), _fd(-1), _size(0) {}
+	~time_hist() {close();}
+	
+	static size_t mem_size(unsigned abinN, unsigned gbinN, unsigned tbinN, unsigned cbits)	//bytes open() needs in mem
+	{
+		return (size_t)(1+abinN+gbinN)*tbinN*sizeof(unsigned)+(size_t)abinN*gbinN*tbinN*cbits/8;
+	}
+	
+	int open(const char* fname, unsigned abinN, unsigned gbinN, unsigned tbinN, unsigned cbits=32, void* mem=NULL, bool sp=false)	//opens or creates the file (fname==NULL: zeroed, in RAM only), cbits: 8, 16 or 32,
+	{																		//mem: zeroed, mem_size() bytes to keep everything in, sp: fname is a time.sdat, returns 0 on success
+		alpha_binN=abinN; gamma_binN=gbinN; tN=tbinN; cellbits=cbits; sparse=sp;
+		size_t ncells=(size_t)alpha_binN*gamma_binN*tN;
+		size_t nproj=(size_t)(1+alpha_binN+gamma_binN)*tN;
+		_size=ncells*cellbits/8;
+		dirty.assign((size_t)alpha_binN*gamma_binN,0);
+		spilled.assign((size_t)alpha_binN*gamma_binN,0);
+		spill.clear();
+		if (mem) _proj.clear();
+		else _proj.assign(nproj,0);
+		timesum=mem?(unsigned*)mem:_proj.data();
+		alpha_proj=timesum+tN;
+		gamma_proj=alpha_proj+(size_t)alpha_binN*tN;
+		_extmem=(mem!=NULL);
+		if(mem){
+			_mem=timesum+nproj;
+			_set_ptrs();
+			return fname?_read(fname,ncells):0;
+		}
+		if(fname == NULL || cellbits != 32 || sparse){
+			_mem=mmap(NULL, _size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if(_mem == MAP_FAILED) {_mem=NULL; fprintf(stderr, "mmap() failed: %s\n", strerror(errno)); return -1;}
+			_set_ptrs();
+			return fname?_read(fname,ncells):0;
+		}
+		_fd=::open(fname, O_RDWR | O_CREAT, 0644);
+		if(_fd < 0) {fprintf(stderr, "open(%s) failed: %s\n", fname, strerror(errno)); return -1;}
+		struct stat st;
+		if(fstat(_fd, &st) < 0) {fprintf(stderr, "fstat(%s) failed: %s\n", fname, strerror(errno)); close(); return -1;}
+		if(st.st_size == 0){
+			if(ftruncate(_fd, _size) < 0) {fprintf(stderr, "ftruncate(%s) failed: %s\n", fname, strerror(errno)); close(); return -1;}	//new file, reads as zeros
+		}
+		else if((size_t)st.st_size != _size) {fprintf(stderr, "%s has size %ld, expected %zu. Wrong configuration?\n", fname, (long)st.st_size, _size); close(); return -1;}
+		_mem=mmap(NULL, _size, PROT_READ | PROT_WRITE, MAP_PRIVATE, _fd, 0);
+		if(_mem == MAP_FAILED) {_mem=NULL; fprintf(stderr, "mmap(%s) failed: %s\n", fname, strerror(errno)); close(); return -1;}
+		_set_ptrs();
+		if(st.st_size != 0) rebuild_proj();
+		return 0;
+	}
+	
+	void rebuild_proj()		//recomputes the projections from the 3D array
+	{
+		std::vector<unsigned> buf(tN);
+		std::fill(timesum,timesum+(size_t)(1+alpha_binN+gamma_binN)*tN,0);		//all three are contiguous
+		for (unsigned a=0;a!=alpha_binN;a++){
+			unsigned* ap=&alpha_proj[(size_t)a*tN];
+			for (unsigned g=0;g!=gamma_binN;g++){
+				const unsigned* c=row((size_t)a*gamma_binN+g,buf.data());
+				hist_add(ap,c,tN);
+				hist_add(&gamma_proj[(size_t)g*tN],c,tN);
+			}
+		}
+		for (unsigned a=0;a!=alpha_binN;a++) hist_add(timesum,&alpha_proj[(size_t)a*tN],tN);
+	}
+	
+	void add(const time_hist& o)	//adds a histogram of the same size, with its projections
+	{
+		if (cellbits==32 && o.cellbits==32) hist_add(bins,o.bins,(size_t)alpha_binN*gamma_binN*tN);
+		else{
+			std::vector<unsigned> buf(tN);
+			for (size_t c=0;c!=dirty.size();c++){
+				const unsigned* r=o.row(c,buf.data());
+				for (unsigned k=0;k!=tN;k++) if (r[k]) _add(c*tN+k,c,r[k]);
+			}
+		}
+		hist_add(timesum,o.timesum,tN);
+		hist_add(alpha_proj,o.alpha_proj,(size_t)alpha_binN*tN);
+		hist_add(gamma_proj,o.gamma_proj,(size_t)gamma_binN*tN);
+	}
+	
+	int save(const char* fname) const	//writes the whole histogram as time.dat, returns 0 on success
+	{
+		FILE* ofile=fopen(fname,"wb");
+		if (ofile==NULL) {fprintf(stderr, "fopen(%s) failed: %s\n", fname, strerror(errno)); return -1;}
+		std::vector<unsigned> buf(tN);
+		size_t c;
+		for (c=0;c!=dirty.size();c++) if (fwrite(row(c,buf.data()),sizeof(unsigned),tN,ofile)!=tN) break;
+		fclose(ofile);
+		return (c==dirty.size())?0:-1;
+	}
+	
+	int save_sparse(const char* fname) const	//writes the whole histogram as time.sdat, without stdio, returns 0 on success
+	{
+		tsparse_writer w;
+		if (w.open(fname,alpha_binN,gamma_binN,tN)) return -1;
+		std::vector<unsigned> buf(tN);
+		for (size_t c=0;c!=dirty.size();c++) if (w.put(row(c,buf.data()))) return -1;
+		return w.close();
+	}
+	
+	int close()
+	{
+		if(_mem){
+			if(!_extmem && munmap(_mem, _size) < 0) {fprintf(stderr, "munmap() failed: %s\n", strerror(errno)); return -1;}
+			_mem=NULL;
+			_set_ptrs();
+		}
+		if(_fd >= 0){
+			::close(_fd);
+			_fd=-1;
+		}
+		spill.clear();
+		return 0;
+	}
+	
+	inline const unsigned* row(size_t c, unsigned* buf) const	//time spectrum of energy cell c, compact cells are expanded into buf (tN elements)
+	{
+		if (cellbits==32) return bins+c*tN;
+		size_t i0=c*tN;
+		if (cellbits==16) for (unsigned k=0;k!=tN;k++) buf[k]=bins16[i0+k];
+		else for (unsigned k=0;k!=tN;k++) buf[k]=bins8[i0+k];
+		if (spilled[c]){
+			for (unsigned k=0;k!=tN;k++){
+				std::unordered_map<size_t,unsigned>::const_iterator it=spill.find(i0+k);
+				if (it!=spill.end()) buf[k]+=it->second<<cellbits;
+			}
+		}
+		return buf;
+	}
+	inline void inc(unsigned a, unsigned g, unsigned t)
+	{
+		size_t c=(size_t)a*gamma_binN+g;
+		size_t i=c*tN+t;
+		dirty[c]=1;
+		if (cellbits==32) bins[i]++;
+		else if (cellbits==16) {if (!++bins16[i]) _carry(i,c,1);}
+		else {if (!++bins8[i]) _carry(i,c,1);}
+		timesum[t]++;
+		alpha_proj[(size_t)a*tN+t]++;
+		gamma_proj[(size_t)g*tN+t]++;
+	}
+	
+	void clear_dirty() {std::fill(dirty.begin(),dirty.end(),0);}
+	void mark_all() {std::fill(dirty.begin(),dirty.end(),1);}
+	size_t spill_size() const {return spill.size();}
+	
+	unsigned* bins;				//one of these three is used, depending on cellbits
+	uint16_t* bins16;
+	uint8_t* bins8;
+	unsigned cellbits;
+	bool sparse;				//saved as time.sdat
+	unsigned alpha_binN, gamma_binN, tN;
+	std::vector<unsigned char> dirty;	//one flag per energy cell, set on every increment
+	unsigned* timesum;			//[time bin], sum over all energy cells
+	unsigned* alpha_proj;			//[alpha bin][time bin], sum over the gamma bins
+	unsigned* gamma_proj;			//[gamma bin][time bin], sum over the alpha bins
+private:
+	void* _mem;
+	bool _extmem;				//_mem and the projections are in memory given to open()
+	std::vector<unsigned> _proj;		//the projections, unless _extmem
+	int _fd;
+	size_t _size;
+	std::unordered_map<size_t,unsigned> spill;	//compact cells: number of times each cell wrapped around
+	std::vector<unsigned char> spilled;		//one flag per energy cell, set if any of its cells is in spill
+	
+	void _set_ptrs()
+	{
+		bins=(cellbits==32)?(unsigned*)_mem:NULL;
+		bins16=(cellbits==16)?(uint16_t*)_mem:NULL;
+		bins8=(cellbits==8)?(uint8_t*)_mem:NULL;
+	}
+	void _carry(size_t i, size_t c, unsigned n)
+	{
+		spill[i]+=n;
+		spilled[c]=1;
+	}
+	void _add(size_t i, size_t c, unsigned v)	//compact cells
+	{
+		uint64_t s=v;
+		if (cellbits==16) {s+=bins16[i]; bins16[i]=(uint16_t)s;}
+		else {s+=bins8[i]; bins8[i]=(uint8_t)s;}
+		if (s>>cellbits) _carry(i,c,s>>cellbits);
+	}
+	int _read(const char* fname, size_t ncells)	//loads an existing time.dat into compact cells or into _extmem
+	{
+		if (sparse) return _read_sparse(fname);
+		int fd=::open(fname, O_RDONLY);
+		if(fd < 0 && errno == ENOENT) return 0;						//new file, created by the first checkpoint
+		if(fd < 0) {fprintf(stderr, "open(%s) failed: %s\n", fname, strerror(errno)); return -1;}
+		struct stat st;
+		if(fstat(fd, &st) < 0) {fprintf(stderr, "fstat(%s) failed: %s\n", fname, strerror(errno)); ::close(fd); return -1;}
+		if(st.st_size == 0) {::close(fd); return 0;}
+		if((size_t)st.st_size != ncells*sizeof(unsigned)) {fprintf(stderr, "%s has size %ld, expected %zu. Wrong configuration?\n", fname, (long)st.st_size, ncells*sizeof(unsigned)); ::close(fd); return -1;}
+		std::vector<unsigned> buf(tN);
+		for (size_t c=0;c!=dirty.size();c++){
+			size_t n=tN*sizeof(unsigned);
+			unsigned* r=(cellbits==32)?bins+c*tN:buf.data();
+			if (pread(fd,r,n,(off_t)(c*n))!=(ssize_t)n) {fprintf(stderr, "read(%s) failed: %s\n", fname, strerror(errno)); ::close(fd); return -1;}
+			if (cellbits!=32) for (unsigned k=0;k!=tN;k++) if (r[k]) _add(c*tN+k,c,r[k]);
+		}
+		::close(fd);
+		rebuild_proj();
+		return 0;
+	}
+	int _read_sparse(const char* fname)		//loads an existing time.sdat
+	{
+		tsparse_reader rd;
+		if(rd.open(fname) < 0){
+			if(errno == ENOENT) return 0;						//new file, created by the first checkpoint
+			fprintf(stderr, "open(%s) failed: %s\n", fname, (errno == EINVAL)?"not a valid time.sdat":strerror(errno));
+			return -1;
+		}
+		if(rd.h.alpha_binN != alpha_binN || rd.h.gamma_binN != gamma_binN || rd.h.tN != tN) {fprintf(stderr, "%s has size %u:%u:%u, expected %u:%u:%u. Wrong configuration?\n", fname, rd.h.alpha_binN, rd.h.gamma_binN, rd.h.tN, alpha_binN, gamma_binN, tN); return -1;}
+		std::vector<unsigned> buf(tN);
+		uint64_t total=0;
+		for (size_t c=0;c!=dirty.size();c++){
+			unsigned* r=(cellbits==32)?bins+c*tN:buf.data();
+			if (rd.cell(c,r)) {fprintf(stderr, "read(%s) failed: cell %zu is corrupt\n", fname, c); return -1;}
+			for (unsigned k=0;k!=tN;k++){
+				total+=r[k];
+				if (cellbits!=32 && r[k]) _add(c*tN+k,c,r[k]);
+			}
+		}
+		if (total != rd.h.total) {fprintf(stderr, "read(%s) failed: %llu counts, the header says %llu\n", fname, (unsigned long long)total, (unsigned long long)rd.h.total); return -1;}
+		rebuild_proj();
+		return 0;
+	}
+};
+
+////------------------------------ time axis -------------------------------////
+// Maps the time difference between a gamma and an alpha peak (in 8 ns clock cycles) to a time bin.
+// Bins are symmetric around t=0: bin `half` starts at t=0, bin `half-1` ends there. Bin width is
+// `width` clock cycles; with `logbins`!=0 only the first `logbins` bins on each side are that wide,
+// after that bins double in width every `logbins` bins (like a float with log2(logbins) mantissa bits).
+// With width=1 and logbins=0 this is exactly the original 8 ns axis of 2*interval bins.
+
+class time_axis{
+public:
+	int setup(unsigned interval, unsigned binwidth, unsigned logbins)	//returns 0 on success
+	{
+		if (binwidth==0 || interval==0) return -1;
+		if (logbins&(logbins-1)) return -1;				//must be a power of two
+		width=binwidth;
+		wshift=__builtin_ctz(width);
+		wpow2=!(width&(width-1));
+		islog=(logbins!=0);
+		sbits=islog?__builtin_ctz(logbins):0;
+		half=_f(interval-1)+1;
+		_interval=interval;
+		return 0;
+	}
+	
+	inline unsigned size() const {return 2*half;}
+	inline unsigned after(unsigned x) const {return half+_f(x);}			//gamma came x cycles after alpha (0 <= x < interval)
+	inline unsigned before(unsigned x) const {return x?half-1-_f(x-1):half;}	//gamma came x cycles before alpha (0 <= x <= interval)
+	
+	uint64_t start(unsigned j) const	//first cycle (from t=0) covered by bin half+j
+	{
+		uint64_t u;
+		if (!islog || j<(1u<<sbits)) u=j;
+		else{
+			unsigned e=(j>>sbits)+sbits-1;
+			u=(uint64_t)((1u<<sbits)+(j&((1u<<sbits)-1)))<<(e-sbits);
+		}
+		u*=width;
+		return (u<_interval)?u:_interval;
+	}
+	
+	int write_desc(const char* fname)	//writes the axis description, returns 0 on success
+	{
+		FILE* ofile=fopen(fname,"w");
+		if (ofile==NULL) {fprintf(stderr, "fopen(%s) failed: %s\n", fname, strerror(errno)); return -1;}
+		fprintf(ofile,"time axis of time.dat and timesum.dat: %u bins, t=0 is the start of bin %u, bin width %u x 8 ns, %s\n",size(),half,width,islog?"logarithmic":"linear");
+		if (islog){
+			fprintf(ofile,"first %u bins on each side of t=0 are linear, after that bin width doubles every %u bins\n"
+			              "bin\tstart(s)\twidth(s)\n",1u<<sbits,1u<<sbits);
+			for (unsigned j=half;j--;){
+				uint64_t s0=start(j), s1=start(j+1);
+				fprintf(ofile,"%u\t%.9lf\t%.9lf\n",half-1-j,-(double)s1/125000000,(double)(s1-s0)/125000000);
+			}
+			for (unsigned j=0;j!=half;j++){
+				uint64_t s0=start(j), s1=start(j+1);
+				fprintf(ofile,"%u\t%.9lf\t%.9lf\n",half+j,(double)s0/125000000,(double)(s1-s0)/125000000);
+			}
+		}
+		else fprintf(ofile,"bin k covers t = (k-%u) x %u x 8 ns\n",half,width);
+		fclose(ofile);
+		return 0;
+	}
+	
+	unsigned half, width;
+	bool islog;
+private:
+	unsigned wshift, sbits, _interval;
+	bool wpow2;
+	
+	inline unsigned _f(unsigned x) const
+	{
+		x=wpow2?(x>>wshift):(x/width);
+		if (!islog || x<(1u<<sbits)) return x;
+		unsigned e=31-__builtin_clz(x);
+		return ((e-sbits+1)<<sbits)+(x>>(e-sbits))-(1u<<sbits);
+	}
+};